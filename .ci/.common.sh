@@ -20,12 +20,15 @@ bufferinfo/legacy/BufferInfoMaliHisi.cpp
 bufferinfo/legacy/BufferInfoMaliMediatek.cpp
 bufferinfo/legacy/BufferInfoMaliMeson.cpp
 bufferinfo/legacy/BufferInfoMinigbm.cpp
+bufferinfo/SidebandStreamProvider.cpp
 compositor/DrmDisplayComposition.cpp
 compositor/DrmDisplayCompositor.cpp
 compositor/Planner.cpp
+compositor/SpeculativeValidator.cpp
 drm/DrmConnector.cpp
 drm/DrmCrtc.cpp
 drm/DrmDevice.cpp
+drm/DrmDisplayPipeline.cpp
 drm/DrmEncoder.cpp
 drm/DrmEventListener.cpp
 drm/DrmFbImporter.cpp
@@ -35,8 +38,11 @@ drm/DrmProperty.cpp
 DrmHwcTwo.cpp
 drm/ResourceManager.cpp
 drm/VSyncWorker.cpp
+tests/edid_parser_test.cpp
+tests/slot_map_test.cpp
 tests/worker_test.cpp
 utils/autolock.cpp
+utils/EdidParser.cpp
 #utils/hwcutils.cpp
 utils/Worker.cpp
 )
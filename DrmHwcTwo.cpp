@@ -25,14 +25,20 @@
 #include <sync/sync.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cinttypes>
 #include <iostream>
+#include <set>
 #include <sstream>
 #include <string>
+#include <tuple>
 
 #include "backend/BackendManager.h"
 #include "bufferinfo/BufferInfoGetter.h"
+#include "bufferinfo/SidebandStreamProvider.h"
 #include "compositor/DrmDisplayComposition.h"
+#include "drm/DrmFbImporter.h"
+#include "utils/clock.h"
 #include "utils/log.h"
 #include "utils/properties.h"
 
@@ -57,18 +63,16 @@ HWC2::Error DrmHwcTwo::CreateDisplay(hwc2_display_t displ,
                     std::forward_as_tuple(&resource_manager_, drm, displ, type,
                                           this));
 
-  DrmCrtc *crtc = drm->GetCrtcForDisplay(static_cast<int>(displ));
-  if (!crtc) {
-    ALOGE("Failed to get crtc for display %d", static_cast<int>(displ));
-    return HWC2::Error::BadDisplay;
-  }
-  auto display_planes = std::vector<DrmPlane *>();
-  for (const auto &plane : drm->planes()) {
-    if (plane->GetCrtcSupported(*crtc))
-      display_planes.push_back(plane.get());
+  /* Only a display without a connector or CRTC fails the HAL. A display
+   * that fails later in Init() stays registered, as it always has. */
+  auto &display = displays_.at(displ);
+  HWC2::Error err = display.Init();
+  if (err != HWC2::Error::None && display.pipeline() != nullptr) {
+    ALOGE("Display %d initialized partially with error %d",
+          static_cast<int>(displ), err);
+    return HWC2::Error::None;
   }
-  displays_.at(displ).Init(&display_planes);
-  return HWC2::Error::None;
+  return err;
 }
 
 HWC2::Error DrmHwcTwo::Init() {
@@ -105,6 +109,16 @@ static inline void supported(char const *func) {
   ALOGV("Supported function: %s", func);
 }
 
+/* FNV-1a, values must not contain padding */
+template <typename T>
+static uint64_t HashMix(uint64_t hash, const T &value) {
+  constexpr uint64_t kFnvPrime = 0x100000001b3;
+  const auto *bytes = reinterpret_cast<const uint8_t *>(&value);
+  for (size_t i = 0; i < sizeof(T); i++)
+    hash = (hash ^ bytes[i]) * kFnvPrime;
+  return hash;
+}
+
 HWC2::Error DrmHwcTwo::CreateVirtualDisplay(uint32_t width, uint32_t height,
                                             int32_t *format,
                                             hwc2_display_t *display) {
@@ -131,6 +145,9 @@ std::string DrmHwcTwo::HwcDisplay::DumpDelta(
              ? " !!! Internal failure, FIX it please\n"
              : "")
      << " Flattened frames: " << delta.frames_flattened_ << "\n"
+     << " Presented without validate: " << delta.validations_skipped_ << "\n"
+     << " Speculatively planned frames: " << delta.speculative_plans_ << "\n"
+     << " Front buffer flushes: " << delta.front_buffer_flushes_ << "\n"
      << " Pixel operations (free units)"
      << " : [TOTAL: " << delta.total_pixops_ << " / GPU: " << delta.gpu_pixops_
      << "]\n"
@@ -159,9 +176,59 @@ std::string DrmHwcTwo::HwcDisplay::Dump() {
                              " VSync remains";
   }
 
+  std::string vrr_state_str = "Not supported";
+  if (VrrSupported())
+    vrr_state_str = vrr_active_ ? "Active" : "Inactive";
+
+  std::string resume_latency_str = "No resume yet";
+  if (compositor_.last_resume_latency_ns() >= 0)
+    resume_latency_str = std::to_string(compositor_.last_resume_latency_ns() /
+                                        1000) +
+                         " us";
+
+  std::string async_flip_str = "Disabled";
+  if (async_flip_allowed_) {
+    auto [flips, failures] = compositor_.async_flip_stats();
+    async_flip_str = std::to_string(flips) + " flips, " +
+                     std::to_string(failures) + " refused";
+  }
+
+  const EdidInfo &edid = pipeline_->connector->edid_info();
+  std::string sink_str = "Unknown";
+  if (edid.valid) {
+    sink_str = edid.manufacturer + " " + std::to_string(edid.product_code);
+    if (!edid.name.empty())
+      sink_str += " \"" + edid.name + "\"";
+    if (edid.hdr)
+      sink_str += std::string(" HDR:") + (edid.hdr->hdr10 ? " HDR10" : "") +
+                  (edid.hdr->hlg ? " HLG" : "");
+    if (edid.vrr)
+      sink_str += " VRR: " + std::to_string(edid.min_v_refresh) + "-" +
+                  std::to_string(edid.max_v_refresh) + " Hz";
+    if (edid.allm)
+      sink_str += " ALLM";
+  }
+
+  hwc_frect_t client_crop = client_layer_.source_crop();
+  std::string client_target_str =
+      std::to_string(int(client_crop.right - client_crop.left)) + "x" +
+      std::to_string(int(client_crop.bottom - client_crop.top));
+  if (IsClientTargetUpscaled())
+    client_target_str += " upscaled";
+
+  const DrmFbImporter::Stats &fb_stats = drm_->GetDrmFbImporter().stats();
   std::stringstream ss;
-  ss << "- Display on: " << connector_->name() << "\n"
+  ss << "- Display on: " << pipeline_->connector->name() << "\n"
+     << "  Sink: " << sink_str << "\n"
+     << "  Framebuffer cache (hits/misses): direct " << fb_stats.direct_hits
+     << "/" << fb_stats.direct_misses << ", shadow copy "
+     << fb_stats.shadow_hits << "/" << fb_stats.shadow_misses
+     << ", failed " << fb_stats.failures << "\n"
      << "  Flattening state: " << flattening_state_str << "\n"
+     << "  Variable refresh rate: " << vrr_state_str << "\n"
+     << "  Client target: " << client_target_str << "\n"
+     << "  Async flips: " << async_flip_str << "\n"
+     << "  Last resume to first frame: " << resume_latency_str << "\n"
      << "Statistics since system boot:\n"
      << DumpDelta(total_stats_) << "\n\n"
      << "Statistics since last dumpsys request:\n"
@@ -191,6 +258,168 @@ void DrmHwcTwo::Dump(uint32_t *outSize, char *outBuffer) {
   *outSize = static_cast<uint32_t>(mDumpString.size());
 }
 
+/* The display and layer are resolved once per select command, property
+ * commands go straight to the selected layer */
+HWC2::Error DrmHwcTwo::ExecuteCommands(uint32_t num_words,
+                                       const uint32_t *words,
+                                       uint32_t num_handles,
+                                       const native_handle_t *const *handles,
+                                       uint32_t *out_error_offset) {
+  supported(__func__);
+  HwcDisplay *display = nullptr;
+  HwcLayer *layer = nullptr;
+  uint32_t error_offset = 0;
+  if (out_error_offset == nullptr)
+    out_error_offset = &error_offset;
+
+  auto handle_at = [&](uint32_t index) -> const native_handle_t * {
+    return index < num_handles ? handles[index] : nullptr;
+  };
+  auto float_at = [](const uint32_t *word) {
+    float value = 0.0F;
+    memcpy(&value, word, sizeof(value));
+    return value;
+  };
+  auto id_at = [](const uint32_t *word) {
+    return uint64_t(word[0]) | (uint64_t(word[1]) << 32);
+  };
+
+  uint32_t pos = 0;
+  while (pos < num_words) {
+    uint32_t opcode = words[pos] & kDrmHwcCommandOpcodeMask;
+    uint32_t length = words[pos] & kDrmHwcCommandLengthMask;
+    const uint32_t *args = &words[pos + 1];
+    *out_error_offset = pos;
+    if (length > num_words - pos - 1)
+      return HWC2::Error::BadParameter;
+
+    /* Region payloads are a list of rects */
+    bool is_region = opcode == kDrmHwcCommandSetLayerSurfaceDamage ||
+                     opcode == kDrmHwcCommandSetLayerVisibleRegion ||
+                     opcode == kDrmHwcCommandFlushLayerDamage;
+    uint32_t expected = 1;
+    switch (opcode) {
+      case kDrmHwcCommandSelectDisplay:
+      case kDrmHwcCommandSelectLayer:
+      case kDrmHwcCommandSetLayerCursorPosition:
+        expected = 2;
+        break;
+      case kDrmHwcCommandSetLayerBuffer:
+        expected = 3;
+        break;
+      case kDrmHwcCommandSetLayerDisplayFrame:
+      case kDrmHwcCommandSetLayerSourceCrop:
+        expected = 4;
+        break;
+      default:
+        break;
+    }
+    if (is_region ? length % 4 != 0 : length != expected)
+      return HWC2::Error::BadParameter;
+
+    if (opcode == kDrmHwcCommandSelectDisplay) {
+      display = GetDisplay(this, id_at(args));
+      layer = nullptr;
+      if (display == nullptr)
+        return HWC2::Error::BadDisplay;
+      pos += length + 1;
+      continue;
+    }
+
+    if (display == nullptr)
+      return HWC2::Error::BadDisplay;
+
+    if (opcode == kDrmHwcCommandSelectLayer) {
+      layer = display->get_layer(id_at(args));
+      if (layer == nullptr)
+        return HWC2::Error::BadLayer;
+      pos += length + 1;
+      continue;
+    }
+
+    if (layer == nullptr)
+      return HWC2::Error::BadLayer;
+
+    HWC2::Error ret = HWC2::Error::None;
+    switch (opcode) {
+      case kDrmHwcCommandSetLayerCursorPosition:
+        ret = layer->SetCursorPosition(int32_t(args[0]), int32_t(args[1]));
+        break;
+      case kDrmHwcCommandSetLayerBuffer: {
+        const native_handle_t *fence = handle_at(args[2]);
+        int fence_fd = -1;
+        if (fence != nullptr && fence->numFds == 1)
+          fence_fd = fcntl(fence->data[0], F_DUPFD_CLOEXEC, 0);
+        ret = layer->SetLayerBuffer(handle_at(args[1]), fence_fd);
+        break;
+      }
+      case kDrmHwcCommandSetLayerSurfaceDamage:
+      case kDrmHwcCommandSetLayerVisibleRegion:
+        /* Not used for composition decisions */
+        break;
+      case kDrmHwcCommandSetLayerBlendMode:
+        ret = layer->SetLayerBlendMode(int32_t(args[0]));
+        break;
+      case kDrmHwcCommandSetLayerColor: {
+        hwc_color_t color = {uint8_t(args[0]), uint8_t(args[0] >> 8),
+                             uint8_t(args[0] >> 16), uint8_t(args[0] >> 24)};
+        ret = layer->SetLayerColor(color);
+        break;
+      }
+      case kDrmHwcCommandSetLayerCompositionType:
+        ret = layer->SetLayerCompositionType(int32_t(args[0]));
+        break;
+      case kDrmHwcCommandSetLayerDataspace:
+        ret = layer->SetLayerDataspace(int32_t(args[0]));
+        break;
+      case kDrmHwcCommandSetLayerDisplayFrame:
+        ret = layer->SetLayerDisplayFrame({int32_t(args[0]), int32_t(args[1]),
+                                           int32_t(args[2]),
+                                           int32_t(args[3])});
+        break;
+      case kDrmHwcCommandSetLayerPlaneAlpha:
+        ret = layer->SetLayerPlaneAlpha(float_at(&args[0]));
+        break;
+      case kDrmHwcCommandSetLayerSidebandStream:
+        ret = layer->SetLayerSidebandStream(handle_at(args[0]));
+        break;
+      case kDrmHwcCommandSetLayerSourceCrop:
+        ret = layer->SetLayerSourceCrop({float_at(&args[0]), float_at(&args[1]),
+                                         float_at(&args[2]),
+                                         float_at(&args[3])});
+        break;
+      case kDrmHwcCommandSetLayerTransform:
+        ret = layer->SetLayerTransform(int32_t(args[0]));
+        break;
+      case kDrmHwcCommandSetLayerZOrder:
+        ret = layer->SetLayerZOrder(args[0]);
+        break;
+      case kDrmHwcCommandSetLayerLowLatency:
+        layer->set_low_latency(args[0] != 0);
+        break;
+      case kDrmHwcCommandSetLayerFrontBuffer:
+        layer->set_front_buffer(args[0] != 0);
+        break;
+      case kDrmHwcCommandFlushLayerDamage: {
+        std::vector<hwc_rect_t> damage(length / 4);
+        for (size_t i = 0; i < damage.size(); ++i)
+          damage[i] = {int32_t(args[i * 4]), int32_t(args[i * 4 + 1]),
+                       int32_t(args[i * 4 + 2]), int32_t(args[i * 4 + 3])};
+        ret = display->FlushFrontBuffer(layer, damage);
+        break;
+      }
+      default:
+        return HWC2::Error::Unsupported;
+    }
+    if (ret != HWC2::Error::None)
+      return ret;
+
+    pos += length + 1;
+  }
+
+  return HWC2::Error::None;
+}
+
 uint32_t DrmHwcTwo::GetMaxVirtualDisplayCount() {
   // TODO(nobody): Implement virtual display
   unsupported(__func__);
@@ -226,6 +455,11 @@ HWC2::Error DrmHwcTwo::RegisterCallback(int32_t descriptor,
       vsync_2_4_callback_ = std::make_pair(HWC2_PFN_VSYNC_2_4(function), data);
       break;
     }
+    case HWC2::Callback::VsyncPeriodTimingChanged: {
+      period_timing_changed_callback_ = std::make_pair(
+          HWC2_PFN_VSYNC_PERIOD_TIMING_CHANGED(function), data);
+      break;
+    }
 #endif
     default:
       break;
@@ -253,50 +487,63 @@ DrmHwcTwo::HwcDisplay::HwcDisplay(ResourceManager *resource_manager,
 }
 
 void DrmHwcTwo::HwcDisplay::ClearDisplay() {
+  SetSidebandStream(nullptr);
   compositor_.ClearDisplay();
 }
 
-HWC2::Error DrmHwcTwo::HwcDisplay::Init(std::vector<DrmPlane *> *planes) {
+/* New stream frames are committed on top of the active composition without
+ * going through SurfaceFlinger */
+void DrmHwcTwo::HwcDisplay::SetSidebandStream(const native_handle_t *stream) {
+  if (stream == sideband_stream_)
+    return;
+
+  auto *provider = SidebandStreamProvider::GetInstance();
+  if (sideband_stream_ != nullptr)
+    provider->SetFrameCallback(sideband_stream_, nullptr);
+
+  sideband_stream_ = stream;
+  if (stream == nullptr)
+    return;
+
+  provider->SetFrameCallback(stream, [this]() {
+    if (compositor_.CommitSidebandFrame() != -ENOENT)
+      return;
+
+    /* The layer isn't on screen before its first frame, present it */
+    const std::lock_guard<std::mutex> lock(hwc2_->callback_lock_);
+    if (hwc2_->refresh_callback_.first != nullptr &&
+        hwc2_->refresh_callback_.second != nullptr)
+      hwc2_->refresh_callback_.first(hwc2_->refresh_callback_.second, handle_);
+  });
+}
+
+HWC2::Error DrmHwcTwo::HwcDisplay::Init() {
   supported(__func__);
+  int display = static_cast<int>(handle_);
+  pipeline_ = DrmDisplayPipeline::CreatePipeline(drm_, display);
+  if (!pipeline_)
+    return HWC2::Error::BadDisplay;
+
   planner_ = Planner::CreateInstance(drm_);
   if (!planner_) {
     ALOGE("Failed to create planner instance for composition");
     return HWC2::Error::NoResources;
   }
+  planner_->SetTiles(&pipeline_->tiles);
 
-  int display = static_cast<int>(handle_);
-  int ret = compositor_.Init(resource_manager_, display);
+  int ret = compositor_.Init(pipeline_.get());
   if (ret) {
     ALOGE("Failed display compositor init for display %d (%d)", display, ret);
     return HWC2::Error::NoResources;
   }
 
-  // Split up the given display planes into primary and overlay to properly
-  // interface with the composition
-  char use_overlay_planes_prop[PROPERTY_VALUE_MAX];
-  property_get("vendor.hwc.drm.use_overlay_planes", use_overlay_planes_prop,
-               "1");
-  bool use_overlay_planes = strtol(use_overlay_planes_prop, nullptr, 10);
-  for (auto &plane : *planes) {
-    if (plane->type() == DRM_PLANE_TYPE_PRIMARY)
-      primary_planes_.push_back(plane);
-    else if (use_overlay_planes && (plane)->type() == DRM_PLANE_TYPE_OVERLAY)
-      overlay_planes_.push_back(plane);
-  }
+  SplitPlanes();
 
-  crtc_ = drm_->GetCrtcForDisplay(display);
-  if (!crtc_) {
-    ALOGE("Failed to get crtc for display %d", display);
-    return HWC2::Error::BadDisplay;
-  }
+  char vrr_prop[PROPERTY_VALUE_MAX];
+  property_get("vendor.hwc.drm.vrr", vrr_prop, "1");
+  vrr_allowed_ = strtol(vrr_prop, nullptr, 10) != 0;
 
-  connector_ = drm_->GetConnectorForDisplay(display);
-  if (!connector_) {
-    ALOGE("Failed to get connector for display %d", display);
-    return HWC2::Error::BadDisplay;
-  }
-
-  ret = vsync_worker_.Init(drm_, display, [this](int64_t timestamp) {
+  ret = vsync_worker_.Init(pipeline_.get(), [this](int64_t timestamp) {
     const std::lock_guard<std::mutex> lock(hwc2_->callback_lock_);
     /* vsync callback */
 #if PLATFORM_SDK_VERSION > 29
@@ -319,18 +566,21 @@ HWC2::Error DrmHwcTwo::HwcDisplay::Init(std::vector<DrmPlane *> *planes) {
     return HWC2::Error::BadDisplay;
   }
 
-  ret = flattening_vsync_worker_.Init(drm_, display, [this](int64_t /*timestamp*/) {
-    const std::lock_guard<std::mutex> lock(hwc2_->callback_lock_);
-    /* Frontend flattening */
-    if (flattenning_state_ > ClientFlattenningState::ClientRefreshRequested &&
-        --flattenning_state_ ==
-            ClientFlattenningState::ClientRefreshRequested &&
-        hwc2_->refresh_callback_.first != nullptr &&
-        hwc2_->refresh_callback_.second != nullptr) {
-      hwc2_->refresh_callback_.first(hwc2_->refresh_callback_.second, handle_);
-      flattening_vsync_worker_.VSyncControl(false);
-    }
-  });
+  ret = flattening_vsync_worker_.Init(
+      pipeline_.get(), [this](int64_t /*timestamp*/) {
+        const std::lock_guard<std::mutex> lock(hwc2_->callback_lock_);
+        /* Frontend flattening */
+        if (flattenning_state_ >
+                ClientFlattenningState::ClientRefreshRequested &&
+            --flattenning_state_ ==
+                ClientFlattenningState::ClientRefreshRequested &&
+            hwc2_->refresh_callback_.first != nullptr &&
+            hwc2_->refresh_callback_.second != nullptr) {
+          hwc2_->refresh_callback_.first(hwc2_->refresh_callback_.second,
+                                         handle_);
+          flattening_vsync_worker_.VSyncControl(false);
+        }
+      });
   if (ret) {
     ALOGE("Failed to create event worker for d=%d %d\n", display, ret);
     return HWC2::Error::BadDisplay;
@@ -342,9 +592,79 @@ HWC2::Error DrmHwcTwo::HwcDisplay::Init(std::vector<DrmPlane *> *planes) {
     return HWC2::Error::BadDisplay;
   }
 
+  char async_flip_prop[PROPERTY_VALUE_MAX];
+  property_get("vendor.hwc.drm.async_flip", async_flip_prop, "0");
+  async_flip_allowed_ = strtol(async_flip_prop, nullptr, 10) != 0 &&
+                        drm_->HasAtomicAsyncPageFlipSupport();
+
+  char speculative_validate_prop[PROPERTY_VALUE_MAX];
+  property_get("vendor.hwc.drm.speculative_validate",
+               speculative_validate_prop, "0");
+  if (strtol(speculative_validate_prop, nullptr, 10) != 0) {
+    ret = speculative_validator_.Init(pipeline_.get(), &compositor_,
+                                      primary_planes_, overlay_planes_);
+    if (ret)
+      ALOGE("Failed to create speculative validator for d=%d %d\n", display,
+            ret);
+    speculation_enabled_ = ret == 0;
+  }
+
   return ChosePreferredConfig();
 }
 
+void DrmHwcTwo::HwcDisplay::SplitPlanes() {
+  // Split up the given display planes into primary and overlay to properly
+  // interface with the composition
+  char use_overlay_planes_prop[PROPERTY_VALUE_MAX];
+  property_get("vendor.hwc.drm.use_overlay_planes", use_overlay_planes_prop,
+               "1");
+  bool use_overlay_planes = strtol(use_overlay_planes_prop, nullptr, 10);
+  primary_planes_.clear();
+  overlay_planes_.clear();
+  for (auto &plane : pipeline_->planes) {
+    if (plane->type() == DRM_PLANE_TYPE_PRIMARY)
+      primary_planes_.push_back(plane);
+    else if (use_overlay_planes && (plane)->type() == DRM_PLANE_TYPE_OVERLAY)
+      overlay_planes_.push_back(plane);
+  }
+}
+
+void DrmHwcTwo::HwcDisplay::ApplyPendingRebind() {
+  if (!rebind_pending_.exchange(false))
+    return;
+
+  DrmCrtc *crtc = pipeline_->crtc;
+  size_t num_tiles = pipeline_->tiles.size();
+  {
+    /* Every other thread reading the pipeline is held off meanwhile */
+    auto tests_lock = speculative_validator_.LockTests();
+    vsync_worker_.Lock();
+    flattening_vsync_worker_.Lock();
+    int ret = compositor_.RebindPipeline();
+    flattening_vsync_worker_.Unlock();
+    vsync_worker_.Unlock();
+    if (ret != 0 ||
+        (pipeline_->crtc == crtc && pipeline_->tiles.size() == num_tiles))
+      return;
+  }
+
+  ALOGI("Display %d moved to crtc %u with %zu tiles",
+        static_cast<int>(handle_), pipeline_->crtc->id(),
+        pipeline_->tiles.size());
+  SplitPlanes();
+  if (speculation_enabled_)
+    speculative_validator_.SetPlanes(primary_planes_, overlay_planes_);
+  presented_stack_hash_.reset();
+  upscale_tests_.clear();
+
+  /* A tile joining or dropping changes the size of the display, which
+   * SurfaceFlinger only reads again on hotplug */
+  if ((num_tiles == 0) != pipeline_->tiles.empty()) {
+    ChosePreferredConfig();
+    hwc2_->HandleDisplayHotplug(handle_, DRM_MODE_CONNECTED);
+  }
+}
+
 HWC2::Error DrmHwcTwo::HwcDisplay::ChosePreferredConfig() {
   // Fetch the number of modes from the display
   uint32_t num_configs = 0;
@@ -352,36 +672,36 @@ HWC2::Error DrmHwcTwo::HwcDisplay::ChosePreferredConfig() {
   if (err != HWC2::Error::None || !num_configs)
     return err;
 
-  return SetActiveConfig(connector_->get_preferred_mode_id());
+  return SetActiveConfig(pipeline_->connector->get_preferred_mode_id());
 }
 
 HWC2::Error DrmHwcTwo::HwcDisplay::AcceptDisplayChanges() {
   supported(__func__);
-  for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_)
-    l.second.accept_type_change();
+  for (auto [handle, layer] : layers_)
+    layer.accept_type_change();
   return HWC2::Error::None;
 }
 
 HWC2::Error DrmHwcTwo::HwcDisplay::CreateLayer(hwc2_layer_t *layer) {
   supported(__func__);
-  layers_.emplace(static_cast<hwc2_layer_t>(layer_idx_), HwcLayer());
-  *layer = static_cast<hwc2_layer_t>(layer_idx_);
-  ++layer_idx_;
+  *layer = layers_.Emplace();
+  layers_.Get(*layer)->set_z_order_dirty_flag(&z_order_dirty_);
+  z_order_dirty_ = true;
   return HWC2::Error::None;
 }
 
 HWC2::Error DrmHwcTwo::HwcDisplay::DestroyLayer(hwc2_layer_t layer) {
   supported(__func__);
-  if (!get_layer(layer))
+  if (!layers_.Erase(layer))
     return HWC2::Error::BadLayer;
 
-  layers_.erase(layer);
+  z_order_dirty_ = true;
   return HWC2::Error::None;
 }
 
 HWC2::Error DrmHwcTwo::HwcDisplay::GetActiveConfig(hwc2_config_t *config) {
   supported(__func__);
-  DrmMode const &mode = connector_->active_mode();
+  DrmMode const &mode = pipeline_->connector->active_mode();
   if (mode.id() == 0)
     return HWC2::Error::BadConfig;
 
@@ -393,12 +713,12 @@ HWC2::Error DrmHwcTwo::HwcDisplay::GetChangedCompositionTypes(
     uint32_t *num_elements, hwc2_layer_t *layers, int32_t *types) {
   supported(__func__);
   uint32_t num_changes = 0;
-  for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_) {
-    if (l.second.type_changed()) {
+  for (auto [handle, layer] : layers_) {
+    if (layer.type_changed()) {
       if (layers && num_changes < *num_elements)
-        layers[num_changes] = l.first;
+        layers[num_changes] = handle;
       if (types && num_changes < *num_elements)
-        types[num_changes] = static_cast<int32_t>(l.second.validated_type());
+        types[num_changes] = static_cast<int32_t>(layer.validated_type());
       ++num_changes;
     }
   }
@@ -409,9 +729,14 @@ HWC2::Error DrmHwcTwo::HwcDisplay::GetChangedCompositionTypes(
 
 HWC2::Error DrmHwcTwo::HwcDisplay::GetClientTargetSupport(uint32_t width,
                                                           uint32_t height,
-                                                          int32_t /*format*/,
+                                                          int32_t format,
                                                           int32_t dataspace) {
   supported(__func__);
+  /* Upscaling 1080p to 2160p is as far as common scalers go */
+  constexpr uint32_t kMaxClientTargetUpscale = 2;
+  /* Percent, only rounding is allowed to change the aspect ratio */
+  constexpr uint64_t kMaxAspectErrorPercent = 1;
+
   std::pair<uint32_t, uint32_t> min = drm_->min_resolution();
   std::pair<uint32_t, uint32_t> max = drm_->max_resolution();
 
@@ -424,6 +749,29 @@ HWC2::Error DrmHwcTwo::HwcDisplay::GetClientTargetSupport(uint32_t width,
   if (dataspace != HAL_DATASPACE_UNKNOWN)
     return HWC2::Error::Unsupported;
 
+  /* A smaller target is rendered faster and upscaled by the plane */
+  auto [mode_w, mode_h] = pipeline_->connector->GetDisplaySize(
+      pipeline_->connector->active_mode());
+  if (width < mode_w || height < mode_h) {
+    if (resource_manager_->ForcedScalingWithGpu())
+      return HWC2::Error::Unsupported;
+
+    if (width * kMaxClientTargetUpscale < mode_w ||
+        height * kMaxClientTargetUpscale < mode_h)
+      return HWC2::Error::Unsupported;
+
+    uint64_t target_aspect = uint64_t(width) * mode_h;
+    uint64_t mode_aspect = uint64_t(height) * mode_w;
+    uint64_t aspect_error = target_aspect > mode_aspect
+                                ? target_aspect - mode_aspect
+                                : mode_aspect - target_aspect;
+    if (aspect_error * 100 > mode_aspect * kMaxAspectErrorPercent)
+      return HWC2::Error::Unsupported;
+
+    if (!TestClientTargetUpscale(width, height, format))
+      return HWC2::Error::Unsupported;
+  }
+
   // TODO(nobody): Validate format can be handled by either GL or planes
   return HWC2::Error::None;
 }
@@ -444,46 +792,36 @@ HWC2::Error DrmHwcTwo::HwcDisplay::GetDisplayAttribute(hwc2_config_t config,
                                                        int32_t attribute_in,
                                                        int32_t *value) {
   supported(__func__);
-  auto mode = std::find_if(connector_->modes().begin(),
-                           connector_->modes().end(),
-                           [config](DrmMode const &m) {
-                             return m.id() == config;
-                           });
-  if (mode == connector_->modes().end()) {
+  const DrmConnector::Config *drm_config = pipeline_->connector->GetConfig(
+      config);
+  if (!drm_config) {
     ALOGE("Could not find active mode for %d", config);
     return HWC2::Error::BadConfig;
   }
 
-  static const int32_t kUmPerInch = 25400;
-  uint32_t mm_width = connector_->mm_width();
-  uint32_t mm_height = connector_->mm_height();
   auto attribute = static_cast<HWC2::Attribute>(attribute_in);
   switch (attribute) {
     case HWC2::Attribute::Width:
-      *value = static_cast<int>(mode->h_display());
+      *value = drm_config->width;
       break;
     case HWC2::Attribute::Height:
-      *value = static_cast<int>(mode->v_display());
+      *value = drm_config->height;
       break;
     case HWC2::Attribute::VsyncPeriod:
       // in nanoseconds
-      *value = static_cast<int>(1E9 / mode->v_refresh());
+      *value = drm_config->vsync_period_ns;
       break;
     case HWC2::Attribute::DpiX:
       // Dots per 1000 inches
-      *value = mm_width
-                   ? static_cast<int>(mode->h_display() * kUmPerInch / mm_width)
-                   : -1;
+      *value = drm_config->dpi_x;
       break;
     case HWC2::Attribute::DpiY:
       // Dots per 1000 inches
-      *value = mm_height ? static_cast<int>(mode->v_display() * kUmPerInch /
-                                            mm_height)
-                         : -1;
+      *value = drm_config->dpi_y;
       break;
 #if PLATFORM_SDK_VERSION > 29
     case HWC2::Attribute::ConfigGroup:
-      *value = 0; /* TODO: Add support for config groups */
+      *value = drm_config->group;
       break;
 #endif
     default:
@@ -502,7 +840,7 @@ HWC2::Error DrmHwcTwo::HwcDisplay::GetDisplayConfigs(uint32_t *num_configs,
   // it's possible this will result in stale modes, it'll all come out in the
   // wash when we try to set the active config later.
   if (!configs) {
-    int ret = connector_->UpdateModes();
+    int ret = pipeline_->connector->UpdateModes();
     if (ret) {
       ALOGE("Failed to update display modes %d", ret);
       return HWC2::Error::BadDisplay;
@@ -519,54 +857,51 @@ HWC2::Error DrmHwcTwo::HwcDisplay::GetDisplayConfigs(uint32_t *num_configs,
 
   // TODO(nobody): Remove the following block of code until AOSP handles all
   // modes
-  std::vector<DrmMode> sel_modes;
+  std::vector<hwc2_config_t> sel_modes;
+  std::set<std::tuple<uint32_t, uint32_t, float>> sel_rates;
+  auto select = [&](const DrmMode &m) {
+    sel_modes.push_back(m.id());
+    sel_rates.emplace(m.h_display(), m.v_display(), m.v_refresh());
+  };
 
   // Add the preferred mode first to be sure it's not dropped
-  auto mode = std::find_if(connector_->modes().begin(),
-                           connector_->modes().end(), [&](DrmMode const &m) {
-                             return m.id() ==
-                                    connector_->get_preferred_mode_id();
-                           });
-  if (mode != connector_->modes().end())
-    sel_modes.push_back(*mode);
+  const DrmConnector::Config *preferred = pipeline_->connector->GetConfig(
+      pipeline_->connector->get_preferred_mode_id());
+  if (preferred)
+    select(preferred->mode);
 
   // Add the active mode if different from preferred mode
-  if (connector_->active_mode().id() != connector_->get_preferred_mode_id())
-    sel_modes.push_back(connector_->active_mode());
+  const DrmMode &active_mode = pipeline_->connector->active_mode();
+  if (active_mode.id() != pipeline_->connector->get_preferred_mode_id())
+    select(active_mode);
+
+  std::set<std::pair<uint32_t, uint32_t>> progressive;
+  for (const DrmMode &mode : pipeline_->connector->modes()) {
+    if (!(mode.flags() & DRM_MODE_FLAG_INTERLACE))
+      progressive.emplace(mode.h_display(), mode.v_display());
+  }
 
   // Cycle over the modes and filter out "similar" modes, keeping only the
   // first ones in the order given by DRM (from CEA ids and timings order)
-  for (const DrmMode &mode : connector_->modes()) {
+  for (const DrmMode &mode : pipeline_->connector->modes()) {
     // TODO(nobody): Remove this when 3D Attributes are in AOSP
     if (mode.flags() & DRM_MODE_FLAG_3D_MASK)
       continue;
 
     // TODO(nobody): Remove this when the Interlaced attribute is in AOSP
     if (mode.flags() & DRM_MODE_FLAG_INTERLACE) {
-      auto m = std::find_if(connector_->modes().begin(),
-                            connector_->modes().end(),
-                            [&mode](DrmMode const &m) {
-                              return !(m.flags() & DRM_MODE_FLAG_INTERLACE) &&
-                                     m.h_display() == mode.h_display() &&
-                                     m.v_display() == mode.v_display();
-                            });
-      if (m == connector_->modes().end())
-        sel_modes.push_back(mode);
+      if (progressive.count({mode.h_display(), mode.v_display()}) == 0)
+        select(mode);
 
       continue;
     }
 
-    // Search for a similar WxH@R mode in the filtered list and drop it if
-    // another mode with the same WxH@R has already been selected
+    // Drop the mode if another mode with the same WxH@R has already been
+    // selected
     // TODO(nobody): Remove this when AOSP handles duplicates modes
-    auto m = std::find_if(sel_modes.begin(), sel_modes.end(),
-                          [&mode](DrmMode const &m) {
-                            return m.h_display() == mode.h_display() &&
-                                   m.v_display() == mode.v_display() &&
-                                   m.v_refresh() == mode.v_refresh();
-                          });
-    if (m == sel_modes.end())
-      sel_modes.push_back(mode);
+    if (sel_rates.count({mode.h_display(), mode.v_display(),
+                         mode.v_refresh()}) == 0)
+      select(mode);
   }
 
   auto num_modes = static_cast<uint32_t>(sel_modes.size());
@@ -576,10 +911,10 @@ HWC2::Error DrmHwcTwo::HwcDisplay::GetDisplayConfigs(uint32_t *num_configs,
   }
 
   uint32_t idx = 0;
-  for (const DrmMode &mode : sel_modes) {
+  for (hwc2_config_t id : sel_modes) {
     if (idx >= *num_configs)
       break;
-    configs[idx++] = mode.id();
+    configs[idx++] = id;
   }
   *num_configs = idx;
   return HWC2::Error::None;
@@ -588,7 +923,7 @@ HWC2::Error DrmHwcTwo::HwcDisplay::GetDisplayConfigs(uint32_t *num_configs,
 HWC2::Error DrmHwcTwo::HwcDisplay::GetDisplayName(uint32_t *size, char *name) {
   supported(__func__);
   std::ostringstream stream;
-  stream << "display-" << connector_->id();
+  stream << "display-" << pipeline_->connector->id();
   std::string string = stream.str();
   size_t length = string.length();
   if (!name) {
@@ -621,15 +956,43 @@ HWC2::Error DrmHwcTwo::HwcDisplay::GetDisplayType(int32_t *type) {
 
 HWC2::Error DrmHwcTwo::HwcDisplay::GetDozeSupport(int32_t *support) {
   supported(__func__);
-  *support = 0;
+  *support = 1;
   return HWC2::Error::None;
 }
 
+bool DrmHwcTwo::HwcDisplay::IsHdrTransferSupported(
+    DrmHwcTransfer transfer) const {
+  if (transfer == DrmHwcTransfer::kUndefined)
+    return true;
+
+  const auto &hdr = pipeline_->connector->edid_info().hdr;
+  if (!pipeline_->connector->hdr_output_metadata_property() || !hdr)
+    return false;
+
+  return transfer == DrmHwcTransfer::kSt2084 ? hdr->hdr10 : hdr->hlg;
+}
+
 HWC2::Error DrmHwcTwo::HwcDisplay::GetHdrCapabilities(
-    uint32_t *num_types, int32_t * /*types*/, float * /*max_luminance*/,
-    float * /*max_average_luminance*/, float * /*min_luminance*/) {
+    uint32_t *num_types, int32_t *types, float *max_luminance,
+    float *max_average_luminance, float *min_luminance) {
   supported(__func__);
-  *num_types = 0;
+  std::vector<int32_t> hdr_types;
+  if (IsHdrTransferSupported(DrmHwcTransfer::kSt2084))
+    hdr_types.emplace_back(HAL_HDR_HDR10);
+  if (IsHdrTransferSupported(DrmHwcTransfer::kHlg))
+    hdr_types.emplace_back(HAL_HDR_HLG);
+
+  if (types == nullptr) {
+    *num_types = hdr_types.size();
+  } else {
+    *num_types = std::min<uint32_t>(*num_types, hdr_types.size());
+    std::copy_n(hdr_types.begin(), *num_types, types);
+  }
+
+  const auto &hdr = pipeline_->connector->edid_info().hdr;
+  *max_luminance = hdr ? hdr->max_luminance : 0.0F;
+  *max_average_luminance = hdr ? hdr->max_average_luminance : 0.0F;
+  *min_luminance = hdr ? hdr->min_luminance : 0.0F;
   return HWC2::Error::None;
 }
 
@@ -642,7 +1005,7 @@ HWC2::Error DrmHwcTwo::HwcDisplay::GetReleaseFences(uint32_t *num_elements,
   supported(__func__);
   uint32_t num_layers = 0;
 
-  for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_) {
+  for (auto [handle, layer] : layers_) {
     ++num_layers;
     if (layers == nullptr || fences == nullptr)
       continue;
@@ -652,8 +1015,8 @@ HWC2::Error DrmHwcTwo::HwcDisplay::GetReleaseFences(uint32_t *num_elements,
       return HWC2::Error::None;
     }
 
-    layers[num_layers - 1] = l.first;
-    fences[num_layers - 1] = l.second.release_fence_.Release();
+    layers[num_layers - 1] = handle;
+    fences[num_layers - 1] = layer.release_fence_.Release();
   }
   *num_elements = num_layers;
   return HWC2::Error::None;
@@ -673,78 +1036,89 @@ void DrmHwcTwo::HwcDisplay::AddFenceToPresentFence(UniqueFd fd) {
 }
 
 HWC2::Error DrmHwcTwo::HwcDisplay::CreateComposition(bool test) {
-  // order the layers by z-order
   bool use_client_layer = false;
-  uint32_t client_z_order = UINT32_MAX;
-  std::map<uint32_t, DrmHwcTwo::HwcLayer *> z_map;
-  for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_) {
-    switch (l.second.validated_type()) {
+  bool use_device_layer = false;
+
+  composition_layers_.clear();
+  for (HwcLayer *hwc_layer : GetOrderLayersByZPos()) {
+    switch (hwc_layer->validated_type()) {
       case HWC2::Composition::Device:
-        z_map.emplace(std::make_pair(l.second.z_order(), &l.second));
+      case HWC2::Composition::Sideband:
+        use_device_layer = true;
         break;
       case HWC2::Composition::Client:
         // Place it at the z_order of the lowest client layer
+        if (use_client_layer)
+          continue;
         use_client_layer = true;
-        client_z_order = std::min(client_z_order, l.second.z_order());
+        hwc_layer = &client_layer_;
         break;
       default:
         continue;
     }
-  }
-  if (use_client_layer)
-    z_map.emplace(std::make_pair(client_z_order, &client_layer_));
-
-  if (z_map.empty())
-    return HWC2::Error::BadLayer;
 
-  std::vector<DrmHwcLayer> composition_layers;
-
-  // now that they're ordered by z, add them to the composition
-  for (std::pair<const uint32_t, DrmHwcTwo::HwcLayer *> &l : z_map) {
-    DrmHwcLayer layer;
-    l.second->PopulateDrmLayer(&layer);
-    int ret = layer.ImportBuffer(drm_);
+    DrmHwcLayer &layer = composition_layers_.emplace_back();
+    hwc_layer->PopulateDrmLayer(&layer);
+    int ret = layer.ImportBuffer(drm_, test);
+    if (ret == -EAGAIN && layer.sideband_stream != nullptr) {
+      /* Nothing queued on the stream yet */
+      composition_layers_.pop_back();
+      continue;
+    }
     if (ret) {
       ALOGE("Failed to import layer, ret=%d", ret);
+      composition_layers_.clear();
       return HWC2::Error::NoResources;
     }
-    composition_layers.emplace_back(std::move(layer));
   }
 
-  auto composition = std::make_unique<DrmDisplayComposition>(crtc_,
-                                                             planner_.get());
+  if (!use_client_layer && !use_device_layer)
+    return HWC2::Error::BadLayer;
+
+  auto composition = compositor_.AcquireComposition(pipeline_->crtc,
+                                                    planner_.get());
+
+  if (!test)
+    composition->SetAsyncFlip(UseAsyncFlip());
 
   // TODO(nobody): Don't always assume geometry changed
-  int ret = composition->SetLayers(composition_layers.data(),
-                                   composition_layers.size(), true);
+  int ret = composition->SetLayers(composition_layers_.data(),
+                                   composition_layers_.size(), true);
+  composition_layers_.clear();
   if (ret) {
     ALOGE("Failed to set layers in the composition ret=%d", ret);
     return HWC2::Error::BadLayer;
   }
+  composition->SetOutputState(GetOutputState(), use_client_layer);
 
-  std::vector<DrmPlane *> primary_planes(primary_planes_);
-  std::vector<DrmPlane *> overlay_planes(overlay_planes_);
-  ret = composition->Plan(&primary_planes, &overlay_planes);
+  plan_primary_planes_.assign(primary_planes_.begin(), primary_planes_.end());
+  plan_overlay_planes_.assign(overlay_planes_.begin(), overlay_planes_.end());
+  ret = composition->Plan(&plan_primary_planes_, &plan_overlay_planes_);
   if (ret) {
     ALOGV("Failed to plan the composition ret=%d", ret);
+    compositor_.RecycleComposition(std::move(composition));
     return HWC2::Error::BadConfig;
   }
 
   // Disable the planes we're not using
-  for (auto i = primary_planes.begin(); i != primary_planes.end();) {
-    composition->AddPlaneDisable(*i);
-    i = primary_planes.erase(i);
-  }
-  for (auto i = overlay_planes.begin(); i != overlay_planes.end();) {
-    composition->AddPlaneDisable(*i);
-    i = overlay_planes.erase(i);
-  }
+  for (DrmPlane *plane : plan_primary_planes_)
+    composition->AddPlaneDisable(plane);
+  for (DrmPlane *plane : plan_overlay_planes_)
+    composition->AddPlaneDisable(plane);
 
   if (test) {
     ret = compositor_.TestComposition(composition.get());
+    compositor_.RecycleComposition(std::move(composition));
   } else {
     ret = compositor_.ApplyComposition(std::move(composition));
     AddFenceToPresentFence(compositor_.TakeOutFence());
+
+    const native_handle_t *sideband_stream = nullptr;
+    for (const HwcLayer *layer : z_ordered_layers_) {
+      if (layer->validated_type() == HWC2::Composition::Sideband)
+        sideband_stream = layer->sideband_stream();
+    }
+    SetSidebandStream(sideband_stream);
   }
   if (ret) {
     if (!test)
@@ -761,11 +1135,55 @@ HWC2::Error DrmHwcTwo::HwcDisplay::PresentDisplay(int32_t *present_fence) {
   supported(__func__);
   HWC2::Error ret;
 
+  ApplyPendingRebind();
+
+  if (power_mode_ == HWC2::PowerMode::DozeSuspend) {
+    /* No commits until the framework leaves DozeSuspend */
+    *present_fence = -1;
+    return HWC2::Error::None;
+  }
+
+  uint64_t stack_hash = StackHash(true);
+  bool validated = validated_;
+  validated_ = false;
+  if (!validated) {
+    /* A due config change is applied by validate, the plan of the last
+     * present is for the old mode */
+    if (StagedConfigDue() || !CanSkipValidate(stack_hash))
+      return HWC2::Error::NotValidated;
+    ++total_stats_.validations_skipped_;
+  }
+
   ++total_stats_.total_frames_;
 
+  UpdateVrrState(GetTimeNs());
+
   ret = CreateComposition(false);
-  if (ret != HWC2::Error::None)
+  auto mode_commit = compositor_.TakeModeCommit();
+  if (mode_commit && period_timing_pending_) {
+    period_timing_pending_ = false;
+    hwc2_vsync_period_t period_ns = 0;
+    GetDisplayVsyncPeriod(&period_ns);
+    /* The new period starts with the flip on the next vblank */
+    NotifyVsyncPeriodTiming(mode_commit->applied
+                                ? mode_commit->time_ns + period_ns
+                                : mode_commit->time_ns);
+  }
+  if (ret != HWC2::Error::None) {
     ++total_stats_.failed_kms_present_;
+    presented_stack_hash_.reset();
+    /* Fall back to test commits for this stack */
+    if (speculative_plan_)
+      speculative_validator_.Reject(StackHash(false));
+    speculative_plan_ = false;
+  } else {
+    presented_stack_hash_ = stack_hash;
+    if (speculation_enabled_ && !speculative_plan_) {
+      uint64_t client_stack_hash = StackHash(false);
+      if (speculated_stack_hash_ != client_stack_hash)
+        SubmitSpeculation(client_stack_hash);
+    }
+  }
 
   if (ret == HWC2::Error::BadLayer) {
     // Can we really have no client or device layers?
@@ -783,19 +1201,25 @@ HWC2::Error DrmHwcTwo::HwcDisplay::PresentDisplay(int32_t *present_fence) {
 
 HWC2::Error DrmHwcTwo::HwcDisplay::SetActiveConfig(hwc2_config_t config) {
   supported(__func__);
-  auto mode = std::find_if(connector_->modes().begin(),
-                           connector_->modes().end(),
-                           [config](DrmMode const &m) {
-                             return m.id() == config;
-                           });
-  if (mode == connector_->modes().end()) {
+  staged_config_.reset();
+  period_timing_pending_ = false;
+  doze_restore_config_.reset();
+  return SetActiveConfigInternal(config, false);
+}
+
+HWC2::Error DrmHwcTwo::HwcDisplay::SetActiveConfigInternal(
+    hwc2_config_t config, bool seamless, bool modeset_fallback) {
+  const DrmConnector::Config *drm_config = pipeline_->connector->GetConfig(
+      config);
+  if (!drm_config) {
     ALOGE("Could not find active mode for %d", config);
     return HWC2::Error::BadConfig;
   }
+  const DrmMode &mode = drm_config->mode;
 
-  auto composition = std::make_unique<DrmDisplayComposition>(crtc_,
+  auto composition = std::make_unique<DrmDisplayComposition>(pipeline_->crtc,
                                                              planner_.get());
-  int ret = composition->SetDisplayMode(*mode);
+  int ret = composition->SetDisplayMode(mode, seamless, modeset_fallback);
   if (ret) {
     return HWC2::Error::BadConfig;
   }
@@ -805,18 +1229,234 @@ HWC2::Error DrmHwcTwo::HwcDisplay::SetActiveConfig(hwc2_config_t config) {
     return HWC2::Error::BadConfig;
   }
 
-  connector_->set_active_mode(*mode);
+  pipeline_->connector->set_active_mode(mode);
 
   // Setup the client layer's dimensions
+  auto [width, height] = pipeline_->connector->GetDisplaySize(mode);
   hwc_rect_t display_frame = {.left = 0,
                               .top = 0,
-                              .right = static_cast<int>(mode->h_display()),
-                              .bottom = static_cast<int>(mode->v_display())};
+                              .right = static_cast<int>(width),
+                              .bottom = static_cast<int>(height)};
   client_layer_.SetLayerDisplayFrame(display_frame);
 
   return HWC2::Error::None;
 }
 
+bool DrmHwcTwo::HwcDisplay::IsClientTargetUpscaled() {
+  hwc_rect_t df = client_layer_.display_frame();
+  hwc_frect_t crop = client_layer_.source_crop();
+  return crop.right - crop.left < float(df.right - df.left) ||
+         crop.bottom - crop.top < float(df.bottom - df.top);
+}
+
+/* Bytes per pixel of the single-plane formats a client target comes in */
+static uint32_t ClientTargetBytesPerPixel(uint32_t drm_format) {
+  switch (drm_format) {
+    case DRM_FORMAT_ABGR16161616F:
+      return 8;
+    case DRM_FORMAT_BGR888:
+      return 3;
+    case DRM_FORMAT_BGR565:
+      return 2;
+    default:
+      return 4;
+  }
+}
+
+/* SurfaceFlinger queries the client target size once and all-client frames
+ * aren't test-committed in validate, so a plane has to prove it can upscale
+ * the target before the size is accepted */
+bool DrmHwcTwo::HwcDisplay::TestClientTargetUpscale(uint32_t width,
+                                                    uint32_t height,
+                                                    int32_t format) {
+  const DrmMode &mode = pipeline_->connector->active_mode();
+  for (const UpscaleTest &test : upscale_tests_) {
+    if (test.width == width && test.height == height &&
+        test.format == format && test.mode_id == mode.id())
+      return test.passed;
+  }
+
+  uint32_t drm_format = format == HAL_PIXEL_FORMAT_RGBA_FP16
+                            ? DRM_FORMAT_ABGR16161616F
+                            : LegacyBufferInfoGetter::ConvertHalFormatToDrm(
+                                  format);
+  if (drm_format != DRM_FORMAT_ABGR16161616F &&
+      !BufferInfoGetter::IsDrmFormatRgb(drm_format))
+    return false;
+
+  /* Nothing is cached until the display is on, see IsScanningOut() */
+  if (!compositor_.IsScanningOut())
+    return false;
+
+  DrmHwcLayer layer;
+  layer.buffer_info.width = width;
+  layer.buffer_info.height = height;
+  layer.buffer_info.format = drm_format;
+  layer.buffer_info.pitches[0] = width * ClientTargetBytesPerPixel(drm_format);
+  layer.FbIdHandle = drm_->GetDrmFbImporter().CreateTestFbId(
+      layer.buffer_info);
+  if (!layer.FbIdHandle)
+    return false;
+
+  constexpr size_t kMaxUpscaleTests = 4;
+  if (upscale_tests_.size() == kMaxUpscaleTests)
+    upscale_tests_.erase(upscale_tests_.begin());
+  UpscaleTest &test = upscale_tests_.emplace_back(
+      UpscaleTest{width, height, format, mode.id(), false});
+
+  auto [mode_w, mode_h] = pipeline_->connector->GetDisplaySize(mode);
+  layer.blending = DrmHwcBlending::kPreMult;
+  layer.source_crop = {0.0F, 0.0F, float(width), float(height)};
+  layer.display_frame = {0, 0, int(mode_w), int(mode_h)};
+
+  auto composition = compositor_.AcquireComposition(pipeline_->crtc,
+                                                    planner_.get());
+  if (composition->SetLayers(&layer, 1, true) != 0) {
+    compositor_.RecycleComposition(std::move(composition));
+    return false;
+  }
+  composition->SetOutputState(GetOutputState(), true);
+
+  plan_primary_planes_.assign(primary_planes_.begin(), primary_planes_.end());
+  plan_overlay_planes_.assign(overlay_planes_.begin(), overlay_planes_.end());
+  if (composition->Plan(&plan_primary_planes_, &plan_overlay_planes_) == 0) {
+    for (DrmPlane *plane : plan_primary_planes_)
+      composition->AddPlaneDisable(plane);
+    for (DrmPlane *plane : plan_overlay_planes_)
+      composition->AddPlaneDisable(plane);
+    test.passed = compositor_.TestComposition(composition.get()) == 0;
+  }
+  compositor_.RecycleComposition(std::move(composition));
+
+  if (!test.passed)
+    ALOGI("No plane upscales a %ux%u client target on display %d", width,
+          height, static_cast<int>(handle_));
+  return test.passed;
+}
+
+HWC2::Error DrmHwcTwo::HwcDisplay::FlushFrontBuffer(
+    HwcLayer *layer, const std::vector<hwc_rect_t> &damage) {
+  if (!layer->front_buffer())
+    return HWC2::Error::BadLayer;
+
+  /* The buffer stays latched until the next present, which is validated as
+   * usual */
+  int ret = compositor_.FlushFrontBuffer(layer->buffer(), damage);
+  if (ret == -ENOENT)
+    return HWC2::Error::BadLayer;
+  if (ret == -EBUSY)
+    return HWC2::Error::None;
+  if (ret)
+    return HWC2::Error::NoResources;
+
+  ++total_stats_.front_buffer_flushes_;
+  return HWC2::Error::None;
+}
+
+bool DrmHwcTwo::HwcDisplay::UseAsyncFlip() {
+  if (!async_flip_allowed_)
+    return false;
+
+  /* A single device layer covering the mode, so that the plane state stays
+   * the same from frame to frame and only the buffer is flipped. The
+   * compositor flips it asynchronously once it is on the primary plane. */
+  HwcLayer *device_layer = nullptr;
+  for (HwcLayer *layer : z_ordered_layers_) {
+    if (layer->validated_type() != HWC2::Composition::Device ||
+        device_layer != nullptr)
+      return false;
+    device_layer = layer;
+  }
+  if (device_layer == nullptr)
+    return false;
+
+  bool game = allm_enabled_ || content_type_ == DrmHwcContentType::kGame;
+  if (!game && !device_layer->low_latency())
+    return false;
+
+  auto [width, height] = pipeline_->connector->GetDisplaySize(
+      pipeline_->connector->active_mode());
+  hwc_rect_t df = device_layer->display_frame();
+  return df.left == 0 && df.top == 0 && df.right == int(width) &&
+         df.bottom == int(height);
+}
+
+bool DrmHwcTwo::HwcDisplay::VrrSupported() const {
+  return vrr_allowed_ && pipeline_->connector->vrr_capable() &&
+         pipeline_->crtc->vrr_enabled_property();
+}
+
+void DrmHwcTwo::HwcDisplay::UpdateVrrState(int64_t present_time_ns) {
+  /* Irregular frames raise the score faster than regular ones lower it, so
+   * VRR is left enabled through short runs of regular frames */
+  constexpr int32_t kIrregularStep = 2;
+  constexpr int32_t kEnableScore = 8;
+  constexpr int32_t kMaxScore = 16;
+  /* Longer gaps are idle periods rather than content cadence */
+  constexpr int64_t kMaxCadencePeriods = 4;
+
+  int64_t interval = present_time_ns - last_present_ns_;
+  last_present_ns_ = present_time_ns;
+
+  float refresh = pipeline_->connector->active_mode().v_refresh();
+  if (!VrrSupported() || refresh <= 0.0F) {
+    vrr_active_ = false;
+    vrr_score_ = 0;
+  } else {
+    auto period_ns = static_cast<int64_t>(1E9 / refresh);
+    if (interval < period_ns * kMaxCadencePeriods) {
+      /* Regular content presents close to a multiple of the vsync period */
+      int64_t phase = interval % period_ns;
+      bool irregular = phase > period_ns / 4 && phase < period_ns * 3 / 4;
+      vrr_score_ = irregular
+                       ? std::min(vrr_score_ + kIrregularStep, kMaxScore)
+                       : std::max(vrr_score_ - 1, 0);
+    }
+    if (vrr_score_ >= kEnableScore)
+      vrr_active_ = true;
+    else if (vrr_score_ == 0)
+      vrr_active_ = false;
+  }
+
+  vsync_worker_.VrrControl(vrr_active_);
+  flattening_vsync_worker_.VrrControl(vrr_active_);
+}
+
+bool DrmHwcTwo::HwcDisplay::StagedConfigDue() const {
+  return staged_config_ && GetTimeNs() >= staged_config_->apply_time_ns;
+}
+
+void DrmHwcTwo::HwcDisplay::ApplyStagedConfig() {
+  if (!StagedConfigDue())
+    return;
+
+  StagedConfig staged = *staged_config_;
+  staged_config_.reset();
+  if (SetActiveConfigInternal(staged.config, staged.seamless,
+                              staged.modeset_fallback) != HWC2::Error::None) {
+    ALOGE("Failed to apply staged config %u", staged.config);
+    period_timing_pending_ = false;
+    NotifyVsyncPeriodTiming(GetTimeNs());
+    return;
+  }
+  period_timing_pending_ = true;
+}
+
+void DrmHwcTwo::HwcDisplay::NotifyVsyncPeriodTiming(
+    [[maybe_unused]] int64_t applied_time_ns) {
+#if PLATFORM_SDK_VERSION > 29
+  const std::lock_guard<std::mutex> lock(hwc2_->callback_lock_);
+  auto [callback, data] = hwc2_->period_timing_changed_callback_;
+  if (callback == nullptr || data == nullptr)
+    return;
+
+  hwc_vsync_period_change_timeline_t timeline{};
+  timeline.newVsyncAppliedTimeNanos = applied_time_ns;
+  timeline.refreshRequired = 0;
+  callback(data, handle_, &timeline);
+#endif
+}
+
 /* Find API details at:
  * https://cs.android.com/android/platform/superproject/+/android-11.0.0_r3:hardware/libhardware/include/hardware/hwcomposer2.h;l=1861
  */
@@ -868,9 +1508,15 @@ HWC2::Error DrmHwcTwo::HwcDisplay::SetColorTransform(const float *matrix,
     return HWC2::Error::BadParameter;
 
   color_transform_hint_ = static_cast<android_color_transform_t>(hint);
-  if (color_transform_hint_ == HAL_COLOR_TRANSFORM_ARBITRARY_MATRIX)
+  if (matrix)
     std::copy(matrix, matrix + MATRIX_SIZE, color_transform_matrix_.begin());
 
+  /* CRTC CTM is a 3x3 matrix, it can't apply the offset row */
+  const auto &m = color_transform_matrix_;
+  ctm_supported_ = matrix && pipeline_->crtc->ctm_property() && m[3] == 0.0F &&
+                   m[7] == 0.0F && m[11] == 0.0F && m[12] == 0.0F &&
+                   m[13] == 0.0F && m[14] == 0.0F && m[15] == 1.0F;
+
   return HWC2::Error::None;
 }
 
@@ -890,30 +1536,85 @@ HWC2::Error DrmHwcTwo::HwcDisplay::SetPowerMode(int32_t mode_in) {
       dpms_value = DRM_MODE_DPMS_OFF;
       break;
     case HWC2::PowerMode::On:
+    case HWC2::PowerMode::Doze:
       dpms_value = DRM_MODE_DPMS_ON;
       break;
-    case HWC2::PowerMode::Doze:
     case HWC2::PowerMode::DozeSuspend:
-      return HWC2::Error::Unsupported;
+      /* Keep scanning out the last frame without touching the hardware */
+      break;
     default:
       ALOGI("Power mode %d is unsupported\n", mode);
       return HWC2::Error::BadParameter;
   };
 
-  auto composition = std::make_unique<DrmDisplayComposition>(crtc_,
-                                                             planner_.get());
-  composition->SetDpmsMode(dpms_value);
-  int ret = compositor_.ApplyComposition(std::move(composition));
-  if (ret) {
-    ALOGE("Failed to apply the dpms composition ret=%d", ret);
-    return HWC2::Error::BadParameter;
+  if (mode != HWC2::PowerMode::DozeSuspend) {
+    auto composition = std::make_unique<DrmDisplayComposition>(pipeline_->crtc,
+                                                               planner_.get());
+    composition->SetDpmsMode(dpms_value);
+    int ret = compositor_.ApplyComposition(std::move(composition));
+    if (ret) {
+      ALOGE("Failed to apply the dpms composition ret=%d", ret);
+      return HWC2::Error::BadParameter;
+    }
+  }
+
+  power_mode_ = mode;
+  compositor_.SetSidebandCommitsSuspended(mode ==
+                                          HWC2::PowerMode::DozeSuspend);
+  if (mode != HWC2::PowerMode::DozeSuspend)
+    SetDozeRefreshRate(mode == HWC2::PowerMode::Doze);
+
+  /* Nothing changes on screen while dozing, stop vsync and flattening */
+  if (IsInDoze()) {
+    flattening_vsync_worker_.VSyncControl(false);
+    if (flattenning_state_ != ClientFlattenningState::Disabled)
+      flattenning_state_ = ClientFlattenningState::NotRequired;
   }
+  vsync_worker_.VSyncControl(vsync_enabled_ && !IsInDoze());
+
   return HWC2::Error::None;
 }
 
+void DrmHwcTwo::HwcDisplay::SetDozeRefreshRate(bool doze) {
+  if (!doze) {
+    /* The low rate was only tested with the always-on frame, the first
+     * frame after doze may need a full modeset to go back */
+    const DrmConnector::Config *restore =
+        doze_restore_config_
+            ? pipeline_->connector->GetConfig(*doze_restore_config_)
+            : nullptr;
+    if (restore) {
+      bool seamless = compositor_.TestSeamlessModeset(restore->mode) == 0;
+      SetActiveConfigInternal(*doze_restore_config_, seamless, true);
+    }
+    doze_restore_config_.reset();
+    return;
+  }
+
+  const DrmConnector::Config *active = pipeline_->connector->GetConfig(
+      pipeline_->connector->active_mode().id());
+  if (doze_restore_config_ || !active)
+    return;
+
+  const DrmConnector::Config *lowest = active;
+  for (const auto &[id, config] : pipeline_->connector->configs()) {
+    if (config.group == active->group &&
+        config.vsync_period_ns > lowest->vsync_period_ns)
+      lowest = &config;
+  }
+
+  /* A modeset would blank the always-on display, keep the current rate */
+  if (lowest == active || compositor_.TestSeamlessModeset(lowest->mode) != 0)
+    return;
+
+  doze_restore_config_ = active->mode.id();
+  SetActiveConfigInternal(lowest->mode.id(), true);
+}
+
 HWC2::Error DrmHwcTwo::HwcDisplay::SetVsyncEnabled(int32_t enabled) {
   supported(__func__);
-  vsync_worker_.VSyncControl(HWC2_VSYNC_ENABLE == enabled);
+  vsync_enabled_ = HWC2_VSYNC_ENABLE == enabled;
+  vsync_worker_.VSyncControl(vsync_enabled_ && !IsInDoze());
   return HWC2::Error::None;
 }
 
@@ -921,31 +1622,137 @@ HWC2::Error DrmHwcTwo::HwcDisplay::ValidateDisplay(uint32_t *num_types,
                                                    uint32_t *num_requests) {
   supported(__func__);
 
+  ApplyPendingRebind();
+  ApplyStagedConfig();
+  validated_ = true;
+  speculative_plan_ = false;
   return backend_->ValidateDisplay(this, num_types, num_requests);
 }
 
-std::vector<DrmHwcTwo::HwcLayer *>
-DrmHwcTwo::HwcDisplay::GetOrderLayersByZPos() {
-  std::vector<DrmHwcTwo::HwcLayer *> ordered_layers;
-  ordered_layers.reserve(layers_.size());
+uint64_t DrmHwcTwo::HwcDisplay::StackHash(bool include_plan) {
+  constexpr uint64_t kFnvOffsetBasis = 0xcbf29ce484222325;
+  uint64_t hash = kFnvOffsetBasis;
+  hash = HashMix(hash, layers_.size());
+  hash = HashMix(hash, pipeline_->connector->active_mode().id());
+  hash = HashMix(hash, power_mode_);
+  hash = HashMix(hash, color_mode_);
+  hash = HashMix(hash, color_transform_hint_);
+  hash = HashMix(hash, color_transform_matrix_);
+  hash = HashMix(hash, content_type_);
+  hash = HashMix(hash, allm_enabled_);
+  for (const HwcLayer *layer : GetOrderLayersByZPos()) {
+    hash = layer->HashStackState(hash);
+    if (include_plan)
+      hash = HashMix(hash, layer->validated_type());
+  }
+  return hash;
+}
 
-  for (auto &[handle, layer] : layers_) {
-    ordered_layers.emplace_back(&layer);
+bool DrmHwcTwo::HwcDisplay::CanSkipValidate(uint64_t stack_hash) {
+  if (!presented_stack_hash_ || *presented_stack_hash_ != stack_hash)
+    return false;
+
+  /* A better plan for the stack is ready, let validate pick it up */
+  if (speculation_enabled_ && !speculative_plan_ &&
+      speculative_validator_.GetClientRange(StackHash(false)))
+    return false;
+
+  /* Flattening switches the composition, which needs a validate */
+  int flattenning_state = flattenning_state_;
+  if (flattenning_state == ClientFlattenningState::ClientRefreshRequested ||
+      flattenning_state == ClientFlattenningState::Flattened)
+    return false;
+
+  /* The stack is still being updated, restart the countdown */
+  if (flattenning_state > ClientFlattenningState::ClientRefreshRequested &&
+      layers_.size() > 1)
+    flattenning_state_ = ClientFlattenningState::VsyncCountdownMax;
+
+  return true;
+}
+
+std::optional<std::pair<int, size_t>>
+DrmHwcTwo::HwcDisplay::GetSpeculativeClientRange() {
+  if (!speculation_enabled_)
+    return {};
+
+  return speculative_validator_.GetClientRange(StackHash(false));
+}
+
+auto DrmHwcTwo::HwcDisplay::GetOutputState()
+    -> DrmDisplayComposition::OutputState {
+  DrmDisplayComposition::OutputState state;
+  if (color_transform_hint_ != HAL_COLOR_TRANSFORM_IDENTITY)
+    state.color_transform = color_transform_matrix_;
+  state.content_type = allm_enabled_ ? DrmHwcContentType::kGame
+                                     : content_type_;
+  state.vrr_enabled = vrr_active_;
+  return state;
+}
+
+void DrmHwcTwo::HwcDisplay::SubmitSpeculation(uint64_t stack_hash) {
+  /* Flattened and doze frames are all client composed on purpose */
+  if (IsInDoze() || flattenning_state_ == ClientFlattenningState::Flattened)
+    return;
+
+  speculated_stack_hash_ = stack_hash;
+
+  SpeculativeValidator::Frame frame;
+  frame.stack_hash = stack_hash;
+  for (int z = 0; z < z_ordered_layers_.size(); ++z) {
+    if (z_ordered_layers_[z]->validated_type() != HWC2::Composition::Client)
+      continue;
+    if (frame.client_start < 0)
+      frame.client_start = z;
+    frame.client_size = z - frame.client_start + 1;
   }
+  if (frame.client_size == 0)
+    return;
+
+  /* Buffers are imported here, the worker can't rely on the handles staying
+   * valid. It only test-commits, so shadows aren't filled. */
+  for (HwcLayer *layer : z_ordered_layers_) {
+    frame.must_client.push_back(backend_->IsClientLayer(this, layer));
+    DrmHwcLayer &drm_layer = frame.layers.emplace_back();
+    layer->PopulateDrmLayer(&drm_layer);
+    drm_layer.acquire_fence = UniqueFd();
+    if (drm_layer.ImportBuffer(drm_, true) != 0)
+      return;
+  }
+
+  frame.output_state = GetOutputState();
+  client_layer_.PopulateDrmLayer(&frame.client_target);
+  frame.client_target.acquire_fence = UniqueFd();
+  if (frame.client_target.ImportBuffer(drm_, true) != 0)
+    return;
+
+  speculative_validator_.Submit(std::move(frame));
+}
 
-  std::sort(std::begin(ordered_layers), std::end(ordered_layers),
+std::vector<DrmHwcTwo::HwcLayer *> &
+DrmHwcTwo::HwcDisplay::GetOrderLayersByZPos() {
+  if (!z_order_dirty_)
+    return z_ordered_layers_;
+
+  /* Layer addresses may have changed as well, rebuild from scratch */
+  z_ordered_layers_.clear();
+  for (auto [handle, layer] : layers_)
+    z_ordered_layers_.emplace_back(&layer);
+
+  std::sort(std::begin(z_ordered_layers_), std::end(z_ordered_layers_),
             [](const DrmHwcTwo::HwcLayer *lhs, const DrmHwcTwo::HwcLayer *rhs) {
               return lhs->z_order() < rhs->z_order();
             });
 
-  return ordered_layers;
+  z_order_dirty_ = false;
+  return z_ordered_layers_;
 }
 
 #if PLATFORM_SDK_VERSION > 29
 HWC2::Error DrmHwcTwo::HwcDisplay::GetDisplayConnectionType(uint32_t *outType) {
-  if (connector_->internal())
+  if (pipeline_->connector->internal())
     *outType = static_cast<uint32_t>(HWC2::DisplayConnectionType::Internal);
-  else if (connector_->external())
+  else if (pipeline_->connector->external())
     *outType = static_cast<uint32_t>(HWC2::DisplayConnectionType::External);
   else
     return HWC2::Error::BadConfig;
@@ -956,7 +1763,7 @@ HWC2::Error DrmHwcTwo::HwcDisplay::GetDisplayConnectionType(uint32_t *outType) {
 HWC2::Error DrmHwcTwo::HwcDisplay::GetDisplayVsyncPeriod(
     hwc2_vsync_period_t *outVsyncPeriod /* ns */) {
   supported(__func__);
-  DrmMode const &mode = connector_->active_mode();
+  DrmMode const &mode = pipeline_->connector->active_mode();
   if (mode.id() == 0)
     return HWC2::Error::BadConfig;
 
@@ -965,7 +1772,7 @@ HWC2::Error DrmHwcTwo::HwcDisplay::GetDisplayVsyncPeriod(
 }
 
 HWC2::Error DrmHwcTwo::HwcDisplay::SetActiveConfigWithConstraints(
-    hwc2_config_t /*config*/,
+    hwc2_config_t config,
     hwc_vsync_period_change_constraints_t *vsyncPeriodChangeConstraints,
     hwc_vsync_period_change_timeline_t *outTimeline) {
   supported(__func__);
@@ -974,18 +1781,75 @@ HWC2::Error DrmHwcTwo::HwcDisplay::SetActiveConfigWithConstraints(
     return HWC2::Error::BadParameter;
   }
 
-  return HWC2::Error::BadConfig;
+  const DrmConnector::Config *drm_config = pipeline_->connector->GetConfig(
+      config);
+  if (!drm_config) {
+    ALOGE("Could not find mode for config %d", config);
+    return HWC2::Error::BadConfig;
+  }
+
+  const DrmConnector::Config *active_config = pipeline_->connector->GetConfig(
+      pipeline_->connector->active_mode().id());
+  bool seamless_required = vsyncPeriodChangeConstraints->seamlessRequired != 0;
+
+  /* Only a refresh rate change within a config group can be seamless */
+  bool seamless = active_config && drm_config->group == active_config->group;
+  if (!seamless && seamless_required)
+    return HWC2::Error::SeamlessNotAllowed;
+
+  if (seamless && compositor_.TestSeamlessModeset(drm_config->mode) != 0) {
+    if (seamless_required)
+      return HWC2::Error::SeamlessNotPossible;
+    seamless = false;
+  }
+
+  int64_t apply_time_ns = std::max(vsyncPeriodChangeConstraints
+                                       ->desiredTimeNanos,
+                                   GetTimeNs());
+  staged_config_ = {config, apply_time_ns, seamless, !seamless_required};
+
+  /* The new mode is committed together with the first frame validated after
+   * apply_time_ns and takes effect on the following vblank. The actual time
+   * is reported through the period timing callback. */
+  hwc2_vsync_period_t period_ns = 0;
+  GetDisplayVsyncPeriod(&period_ns);
+  outTimeline->refreshRequired = 1;
+  outTimeline->refreshTimeNanos = apply_time_ns;
+  outTimeline->newVsyncAppliedTimeNanos = apply_time_ns + period_ns;
+
+  return HWC2::Error::None;
 }
 
-HWC2::Error DrmHwcTwo::HwcDisplay::SetAutoLowLatencyMode(bool /*on*/) {
-  return HWC2::Error::Unsupported;
+HWC2::Error DrmHwcTwo::HwcDisplay::SetAutoLowLatencyMode(bool on) {
+  supported(__func__);
+
+  if (!pipeline_->connector->IsAllmSupported())
+    return HWC2::Error::Unsupported;
+
+  allm_enabled_ = on;
+  return HWC2::Error::None;
 }
 
 HWC2::Error DrmHwcTwo::HwcDisplay::GetSupportedContentTypes(
     uint32_t *outNumSupportedContentTypes,
-    const uint32_t *outSupportedContentTypes) {
-  if (outSupportedContentTypes == nullptr)
-    *outNumSupportedContentTypes = 0;
+    uint32_t *outSupportedContentTypes) {
+  supported(__func__);
+
+  uint32_t num_types = 0;
+  for (uint32_t type = HWC2_CONTENT_TYPE_GRAPHICS;
+       type <= HWC2_CONTENT_TYPE_GAME; type++) {
+    if (!pipeline_->connector->IsContentTypeSupported(
+            static_cast<DrmHwcContentType>(type)))
+      continue;
+
+    if (outSupportedContentTypes != nullptr) {
+      if (num_types >= *outNumSupportedContentTypes)
+        break;
+      outSupportedContentTypes[num_types] = type;
+    }
+    num_types++;
+  }
+  *outNumSupportedContentTypes = num_types;
 
   return HWC2::Error::None;
 }
@@ -993,13 +1857,16 @@ HWC2::Error DrmHwcTwo::HwcDisplay::GetSupportedContentTypes(
 HWC2::Error DrmHwcTwo::HwcDisplay::SetContentType(int32_t contentType) {
   supported(__func__);
 
-  if (contentType != HWC2_CONTENT_TYPE_NONE)
-    return HWC2::Error::Unsupported;
+  if (contentType < HWC2_CONTENT_TYPE_NONE ||
+      contentType > HWC2_CONTENT_TYPE_GAME)
+    return HWC2::Error::BadParameter;
 
-  /* TODO: Map to the DRM Connector property:
-   * https://elixir.bootlin.com/linux/v5.4-rc5/source/drivers/gpu/drm/drm_connector.c#L809
-   */
+  auto content_type = static_cast<DrmHwcContentType>(contentType);
+  if (content_type != DrmHwcContentType::kNone &&
+      !pipeline_->connector->IsContentTypeSupported(content_type))
+    return HWC2::Error::Unsupported;
 
+  content_type_ = content_type;
   return HWC2::Error::None;
 }
 #endif
@@ -1009,33 +1876,45 @@ HWC2::Error DrmHwcTwo::HwcDisplay::GetDisplayIdentificationData(
     uint8_t *outPort, uint32_t *outDataSize, uint8_t *outData) {
   supported(__func__);
 
-  auto blob = connector_->GetEdidBlob();
-
-  if (!blob) {
+  const std::vector<uint8_t> &edid = pipeline_->connector->edid();
+  if (edid.empty()) {
     ALOGE("Failed to get edid property value.");
     return HWC2::Error::Unsupported;
   }
 
   if (outData) {
-    *outDataSize = std::min(*outDataSize, blob->length);
-    memcpy(outData, blob->data, *outDataSize);
+    *outDataSize = std::min<uint32_t>(*outDataSize, edid.size());
+    memcpy(outData, edid.data(), *outDataSize);
   } else {
-    *outDataSize = blob->length;
+    *outDataSize = edid.size();
   }
-  *outPort = connector_->id();
+  *outPort = pipeline_->connector->id();
 
   return HWC2::Error::None;
 }
 
 HWC2::Error DrmHwcTwo::HwcDisplay::GetDisplayCapabilities(
     uint32_t *outNumCapabilities, uint32_t *outCapabilities) {
-  unsupported(__func__, outCapabilities);
+  supported(__func__);
 
   if (outNumCapabilities == nullptr) {
     return HWC2::Error::BadParameter;
   }
 
-  *outNumCapabilities = 0;
+  std::vector<uint32_t> capabilities = {HWC2_DISPLAY_CAPABILITY_DOZE};
+#if PLATFORM_SDK_VERSION > 29
+  if (pipeline_->connector->IsAllmSupported())
+    capabilities.emplace_back(HWC2_DISPLAY_CAPABILITY_AUTO_LOW_LATENCY_MODE);
+#endif
+
+  if (outCapabilities == nullptr) {
+    *outNumCapabilities = capabilities.size();
+    return HWC2::Error::None;
+  }
+
+  *outNumCapabilities = std::min<uint32_t>(*outNumCapabilities,
+                                           capabilities.size());
+  std::copy_n(capabilities.begin(), *outNumCapabilities, outCapabilities);
 
   return HWC2::Error::None;
 }
@@ -1090,6 +1969,83 @@ HWC2::Error DrmHwcTwo::HwcDisplay::SetColorModeWithIntent(int32_t mode,
   return HWC2::Error::None;
 }
 
+static const std::array<int32_t, 12> kPerFrameMetadataKeys = {
+    HWC2_DISPLAY_RED_PRIMARY_X,   HWC2_DISPLAY_RED_PRIMARY_Y,
+    HWC2_DISPLAY_GREEN_PRIMARY_X, HWC2_DISPLAY_GREEN_PRIMARY_Y,
+    HWC2_DISPLAY_BLUE_PRIMARY_X,  HWC2_DISPLAY_BLUE_PRIMARY_Y,
+    HWC2_WHITE_POINT_X,           HWC2_WHITE_POINT_Y,
+    HWC2_MAX_LUMINANCE,           HWC2_MIN_LUMINANCE,
+    HWC2_MAX_CONTENT_LIGHT_LEVEL, HWC2_MAX_FRAME_AVERAGE_LIGHT_LEVEL,
+};
+
+HWC2::Error DrmHwcTwo::HwcDisplay::GetPerFrameMetadataKeys(
+    uint32_t *outNumKeys, int32_t *outKeys) {
+  supported(__func__);
+  if (!IsHdrTransferSupported(DrmHwcTransfer::kSt2084) &&
+      !IsHdrTransferSupported(DrmHwcTransfer::kHlg)) {
+    *outNumKeys = 0;
+    return HWC2::Error::None;
+  }
+
+  if (outKeys == nullptr) {
+    *outNumKeys = kPerFrameMetadataKeys.size();
+    return HWC2::Error::None;
+  }
+
+  *outNumKeys = std::min<uint32_t>(*outNumKeys, kPerFrameMetadataKeys.size());
+  std::copy_n(kPerFrameMetadataKeys.begin(), *outNumKeys, outKeys);
+  return HWC2::Error::None;
+}
+
+HWC2::Error DrmHwcTwo::HwcLayer::SetLayerPerFrameMetadata(
+    uint32_t num_elements, const int32_t *keys, const float *metadata) {
+  supported(__func__);
+  for (uint32_t i = 0; i < num_elements; i++) {
+    float value = metadata[i];
+    switch (keys[i]) {
+      case HWC2_DISPLAY_RED_PRIMARY_X:
+        hdr_metadata_.red[0] = value;
+        break;
+      case HWC2_DISPLAY_RED_PRIMARY_Y:
+        hdr_metadata_.red[1] = value;
+        break;
+      case HWC2_DISPLAY_GREEN_PRIMARY_X:
+        hdr_metadata_.green[0] = value;
+        break;
+      case HWC2_DISPLAY_GREEN_PRIMARY_Y:
+        hdr_metadata_.green[1] = value;
+        break;
+      case HWC2_DISPLAY_BLUE_PRIMARY_X:
+        hdr_metadata_.blue[0] = value;
+        break;
+      case HWC2_DISPLAY_BLUE_PRIMARY_Y:
+        hdr_metadata_.blue[1] = value;
+        break;
+      case HWC2_WHITE_POINT_X:
+        hdr_metadata_.white[0] = value;
+        break;
+      case HWC2_WHITE_POINT_Y:
+        hdr_metadata_.white[1] = value;
+        break;
+      case HWC2_MAX_LUMINANCE:
+        hdr_metadata_.max_luminance = value;
+        break;
+      case HWC2_MIN_LUMINANCE:
+        hdr_metadata_.min_luminance = value;
+        break;
+      case HWC2_MAX_CONTENT_LIGHT_LEVEL:
+        hdr_metadata_.max_cll = value;
+        break;
+      case HWC2_MAX_FRAME_AVERAGE_LIGHT_LEVEL:
+        hdr_metadata_.max_fall = value;
+        break;
+      default:
+        return HWC2::Error::Unsupported;
+    }
+  }
+  return HWC2::Error::None;
+}
+
 #endif /* PLATFORM_SDK_VERSION > 27 */
 
 HWC2::Error DrmHwcTwo::HwcLayer::SetCursorPosition(int32_t /*x*/,
@@ -1125,6 +2081,17 @@ HWC2::Error DrmHwcTwo::HwcLayer::SetLayerBuffer(buffer_handle_t buffer,
                                                 int32_t acquire_fence) {
   supported(__func__);
 
+  if (buffer != buffer_) {
+    /* Same as BufferInfoGetter::IsHandleUsable() */
+    hwc_drm_bo_t bo{};
+    int ret = buffer != nullptr
+                  ? BufferInfoGetter::GetInstance()->ConvertBoInfo(buffer, &bo)
+                  : -EINVAL;
+    buffer_usable_ = ret == 0 && bo.prime_fds[0] != 0;
+    buffer_format_ = bo.format;
+    buffer_usage_ = bo.usage;
+    buffer_modifier_ = bo.modifiers[0];
+  }
   set_buffer(buffer);
   acquire_fence_ = UniqueFd(acquire_fence);
   return HWC2::Error::None;
@@ -1171,6 +2138,17 @@ HWC2::Error DrmHwcTwo::HwcLayer::SetLayerDataspace(int32_t dataspace) {
     default:
       sample_range_ = DrmHwcSampleRange::kUndefined;
   }
+
+  switch (dataspace & HAL_DATASPACE_TRANSFER_MASK) {
+    case HAL_DATASPACE_TRANSFER_ST2084:
+      transfer_ = DrmHwcTransfer::kSt2084;
+      break;
+    case HAL_DATASPACE_TRANSFER_HLG:
+      transfer_ = DrmHwcTransfer::kHlg;
+      break;
+    default:
+      transfer_ = DrmHwcTransfer::kUndefined;
+  }
   return HWC2::Error::None;
 }
 
@@ -1189,8 +2167,11 @@ HWC2::Error DrmHwcTwo::HwcLayer::SetLayerPlaneAlpha(float alpha) {
 HWC2::Error DrmHwcTwo::HwcLayer::SetLayerSidebandStream(
     const native_handle_t *stream) {
   supported(__func__);
-  // TODO(nobody): We don't support sideband
-  return unsupported(__func__, stream);
+  if (SidebandStreamProvider::GetInstance() == nullptr)
+    return HWC2::Error::Unsupported;
+
+  sideband_stream_ = stream;
+  return HWC2::Error::None;
 }
 
 HWC2::Error DrmHwcTwo::HwcLayer::SetLayerSourceCrop(hwc_frect_t crop) {
@@ -1241,13 +2222,38 @@ HWC2::Error DrmHwcTwo::HwcLayer::SetLayerVisibleRegion(hwc_region_t visible) {
 
 HWC2::Error DrmHwcTwo::HwcLayer::SetLayerZOrder(uint32_t order) {
   supported(__func__);
+  if (order != z_order_ && z_order_dirty_ != nullptr)
+    *z_order_dirty_ = true;
   z_order_ = order;
   return HWC2::Error::None;
 }
 
+uint64_t DrmHwcTwo::HwcLayer::HashStackState(uint64_t hash) const {
+  hash = HashMix(hash, sf_type_);
+  hash = HashMix(hash, display_frame_);
+  hash = HashMix(hash, source_crop_);
+  hash = HashMix(hash, alpha_);
+  hash = HashMix(hash, transform_);
+  hash = HashMix(hash, z_order_);
+  hash = HashMix(hash, blending_);
+  hash = HashMix(hash, color_space_);
+  hash = HashMix(hash, sample_range_);
+  hash = HashMix(hash, transfer_);
+  hash = HashMix(hash, hdr_metadata_);
+  hash = HashMix(hash, sideband_stream_);
+  /* A new buffer only keeps the plan if it can go where the last one did */
+  hash = HashMix(hash, buffer_format_);
+  hash = HashMix(hash, buffer_usage_);
+  hash = HashMix(hash, buffer_modifier_);
+  hash = HashMix(hash, buffer_usable_);
+  return hash;
+}
+
 void DrmHwcTwo::HwcLayer::PopulateDrmLayer(DrmHwcLayer *layer) {
   supported(__func__);
   layer->sf_handle = buffer_;
+  if (sf_type_ == HWC2::Composition::Sideband)
+    layer->sideband_stream = sideband_stream_;
   // TODO(rsglobal): Avoid extra fd duplication
   layer->acquire_fence = UniqueFd(fcntl(acquire_fence_.Get(), F_DUPFD_CLOEXEC));
   layer->display_frame = display_frame_;
@@ -1257,6 +2263,8 @@ void DrmHwcTwo::HwcLayer::PopulateDrmLayer(DrmHwcLayer *layer) {
   layer->transform = transform_;
   layer->color_space = color_space_;
   layer->sample_range = sample_range_;
+  layer->transfer = transfer_;
+  layer->hdr_metadata = hdr_metadata_;
 }
 
 void DrmHwcTwo::HandleDisplayHotplug(hwc2_display_t displayid, int state) {
@@ -1273,7 +2281,7 @@ void DrmHwcTwo::HandleDisplayHotplug(hwc2_display_t displayid, int state) {
 
 void DrmHwcTwo::HandleInitialHotplugState(DrmDevice *drmDevice) {
   for (const auto &conn : drmDevice->connectors()) {
-    if (conn->state() != DRM_MODE_CONNECTED)
+    if (conn->state() != DRM_MODE_CONNECTED || conn->tile_leader() != nullptr)
       continue;
     HandleDisplayHotplug(conn->display(), conn->state());
   }
@@ -1294,8 +2302,17 @@ void DrmHwcTwo::DrmHotplugHandler::HandleEvent(uint64_t timestamp_us) {
           conn->id(), conn->display());
 
     int display_id = conn->display();
+    /* A tile coming or going only changes how its display is driven, the
+     * configs follow once the pipeline is rebound */
+    if (conn->tile_leader() != nullptr) {
+      if (conn->tile_leader()->state() == DRM_MODE_CONNECTED)
+        hwc2_->displays_.at(display_id).RequestRebind();
+      continue;
+    }
+
     if (cur_state == DRM_MODE_CONNECTED) {
       auto &display = hwc2_->displays_.at(display_id);
+      display.RequestRebind();
       display.ChosePreferredConfig();
     } else {
       auto &display = hwc2_->displays_.at(display_id);
@@ -1315,15 +2332,31 @@ int DrmHwcTwo::HookDevClose(hw_device_t * /*dev*/) {
 // static
 void DrmHwcTwo::HookDevGetCapabilities(hwc2_device_t * /*dev*/,
                                        uint32_t *out_count,
-                                       int32_t * /*out_capabilities*/) {
+                                       int32_t *out_capabilities) {
   supported(__func__);
-  *out_count = 0;
+  /* Frames with an unchanged layer stack are presented without validate */
+  static const std::array<int32_t, 1> kCapabilities = {
+      HWC2_CAPABILITY_SKIP_VALIDATE};
+
+  if (out_capabilities == nullptr) {
+    *out_count = kCapabilities.size();
+    return;
+  }
+
+  *out_count = std::min<uint32_t>(*out_count, kCapabilities.size());
+  std::copy_n(kCapabilities.begin(), *out_count, out_capabilities);
 }
 
 // static
 hwc2_function_pointer_t DrmHwcTwo::HookDevGetFunction(
     struct hwc2_device * /*dev*/, int32_t descriptor) {
   supported(__func__);
+  if (descriptor == HWC2_FUNCTION_DRM_EXECUTE_COMMANDS)
+    return ToHook<HWC2_PFN_DRM_EXECUTE_COMMANDS>(
+        DeviceHook<int32_t, decltype(&DrmHwcTwo::ExecuteCommands),
+                   &DrmHwcTwo::ExecuteCommands, uint32_t, const uint32_t *,
+                   uint32_t, const native_handle_t *const *, uint32_t *>);
+
   auto func = static_cast<HWC2::FunctionDescriptor>(descriptor);
   switch (func) {
     // Device functions
@@ -1465,6 +2498,11 @@ hwc2_function_pointer_t DrmHwcTwo::HookDevGetFunction(
       return ToHook<HWC2_PFN_SET_COLOR_MODE_WITH_RENDER_INTENT>(
           DisplayHook<decltype(&HwcDisplay::SetColorModeWithIntent),
                       &HwcDisplay::SetColorModeWithIntent, int32_t, int32_t>);
+    case HWC2::FunctionDescriptor::GetPerFrameMetadataKeys:
+      return ToHook<HWC2_PFN_GET_PER_FRAME_METADATA_KEYS>(
+          DisplayHook<decltype(&HwcDisplay::GetPerFrameMetadataKeys),
+                      &HwcDisplay::GetPerFrameMetadataKeys, uint32_t *,
+                      int32_t *>);
 #endif
 #if PLATFORM_SDK_VERSION > 28
     case HWC2::FunctionDescriptor::GetDisplayIdentificationData:
@@ -1574,6 +2612,13 @@ hwc2_function_pointer_t DrmHwcTwo::HookDevGetFunction(
       return ToHook<HWC2_PFN_SET_LAYER_Z_ORDER>(
           LayerHook<decltype(&HwcLayer::SetLayerZOrder),
                     &HwcLayer::SetLayerZOrder, uint32_t>);
+#if PLATFORM_SDK_VERSION > 27
+    case HWC2::FunctionDescriptor::SetLayerPerFrameMetadata:
+      return ToHook<HWC2_PFN_SET_LAYER_PER_FRAME_METADATA>(
+          LayerHook<decltype(&HwcLayer::SetLayerPerFrameMetadata),
+                    &HwcLayer::SetLayerPerFrameMetadata, uint32_t,
+                    const int32_t *, const float *>);
+#endif
     case HWC2::FunctionDescriptor::Invalid:
     default:
       return nullptr;
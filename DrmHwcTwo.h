@@ -21,13 +21,19 @@
 #include <math.h>
 
 #include <array>
+#include <atomic>
 #include <map>
+#include <optional>
 
 #include "compositor/DrmDisplayCompositor.h"
 #include "compositor/Planner.h"
+#include "compositor/SpeculativeValidator.h"
+#include "drm/DrmDisplayPipeline.h"
 #include "drm/ResourceManager.h"
 #include "drm/VSyncWorker.h"
+#include "drmhwccommands.h"
 #include "drmhwcomposer.h"
+#include "utils/SlotMap.h"
 
 namespace android {
 
@@ -46,6 +52,8 @@ class DrmHwcTwo : public hwc2_device_t {
   std::pair<HWC2_PFN_VSYNC, hwc2_callback_data_t> vsync_callback_{};
 #if PLATFORM_SDK_VERSION > 29
   std::pair<HWC2_PFN_VSYNC_2_4, hwc2_callback_data_t> vsync_2_4_callback_{};
+  std::pair<HWC2_PFN_VSYNC_PERIOD_TIMING_CHANGED, hwc2_callback_data_t>
+      period_timing_changed_callback_{};
 #endif
   std::pair<HWC2_PFN_REFRESH, hwc2_callback_data_t> refresh_callback_{};
 
@@ -72,6 +80,10 @@ class DrmHwcTwo : public hwc2_device_t {
     uint32_t z_order() const {
       return z_order_;
     }
+    /* Raised when the z-order changes, owned by the display */
+    void set_z_order_dirty_flag(bool *flag) {
+      z_order_dirty_ = flag;
+    }
 
     buffer_handle_t buffer() {
       return buffer_;
@@ -84,7 +96,13 @@ class DrmHwcTwo : public hwc2_device_t {
       return display_frame_;
     }
 
+    hwc_frect_t source_crop() const {
+      return source_crop_;
+    }
+
     void PopulateDrmLayer(DrmHwcLayer *layer);
+    /* Mixes in everything but the buffer content that affects validation */
+    uint64_t HashStackState(uint64_t hash) const;
 
     bool RequireScalingOrPhasing() {
       float src_width = source_crop_.right - source_crop_.left;
@@ -114,6 +132,39 @@ class DrmHwcTwo : public hwc2_device_t {
     HWC2::Error SetLayerTransform(int32_t transform);
     HWC2::Error SetLayerVisibleRegion(hwc_region_t visible);
     HWC2::Error SetLayerZOrder(uint32_t order);
+#if PLATFORM_SDK_VERSION > 27
+    HWC2::Error SetLayerPerFrameMetadata(uint32_t num_elements,
+                                         const int32_t *keys,
+                                         const float *metadata);
+#endif
+
+    DrmHwcTransfer transfer() const {
+      return transfer_;
+    }
+
+    const native_handle_t *sideband_stream() const {
+      return sideband_stream_;
+    }
+
+    const DrmHwcHdrMetadata &hdr_metadata() const {
+      return hdr_metadata_;
+    }
+
+    /* Hint that tearing is preferred over a frame of latency */
+    bool low_latency() const {
+      return low_latency_;
+    }
+    void set_low_latency(bool low_latency) {
+      low_latency_ = low_latency;
+    }
+
+    /* The producer keeps drawing into the buffer while it is scanned out */
+    bool front_buffer() const {
+      return front_buffer_;
+    }
+    void set_front_buffer(bool front_buffer) {
+      front_buffer_ = front_buffer;
+    }
 
     UniqueFd acquire_fence_;
 
@@ -132,14 +183,25 @@ class DrmHwcTwo : public hwc2_device_t {
     HWC2::Composition validated_type_ = HWC2::Composition::Invalid;
 
     buffer_handle_t buffer_ = NULL;
+    /* What validation depends on of the buffer, read when it changes */
+    uint32_t buffer_format_ = 0;
+    uint32_t buffer_usage_ = 0;
+    uint64_t buffer_modifier_ = 0;
+    bool buffer_usable_ = false;
+    const native_handle_t *sideband_stream_ = nullptr;
     hwc_rect_t display_frame_;
     float alpha_ = 1.0f;
     hwc_frect_t source_crop_;
     DrmHwcTransform transform_ = DrmHwcTransform::kIdentity;
     uint32_t z_order_ = 0;
+    bool *z_order_dirty_ = nullptr;
     DrmHwcBlending blending_ = DrmHwcBlending::kNone;
     DrmHwcColorSpace color_space_ = DrmHwcColorSpace::kUndefined;
     DrmHwcSampleRange sample_range_ = DrmHwcSampleRange::kUndefined;
+    DrmHwcTransfer transfer_ = DrmHwcTransfer::kUndefined;
+    DrmHwcHdrMetadata hdr_metadata_;
+    bool low_latency_ = false;
+    bool front_buffer_ = false;
   };
 
   class HwcDisplay {
@@ -147,12 +209,24 @@ class DrmHwcTwo : public hwc2_device_t {
     HwcDisplay(ResourceManager *resource_manager, DrmDevice *drm,
                hwc2_display_t handle, HWC2::DisplayType type, DrmHwcTwo *hwc2);
     HwcDisplay(const HwcDisplay &) = delete;
-    HWC2::Error Init(std::vector<DrmPlane *> *planes);
+    HWC2::Error Init();
 
     HWC2::Error CreateComposition(bool test);
-    std::vector<DrmHwcTwo::HwcLayer *> GetOrderLayersByZPos();
+    /* State of the display that goes into every composition */
+    auto GetOutputState() -> DrmDisplayComposition::OutputState;
+    /* Re-sorted only after layers are added, removed or restacked */
+    std::vector<DrmHwcTwo::HwcLayer *> &GetOrderLayersByZPos();
 
     void ClearDisplay();
+    /* Resolves the pipeline again after hotplug. Requested from the hotplug
+     * thread, applied on the next validate or present. */
+    void RequestRebind() {
+      rebind_pending_ = true;
+    }
+    void ApplyPendingRebind();
+    /* Flushes damage of a front buffer layer without a new frame */
+    HWC2::Error FlushFrontBuffer(HwcLayer *layer,
+                                 const std::vector<hwc_rect_t> &damage);
 
     std::string Dump();
 
@@ -180,6 +254,8 @@ class DrmHwcTwo : public hwc2_device_t {
     HWC2::Error GetRenderIntents(int32_t mode, uint32_t *outNumIntents,
                                  int32_t *outIntents);
     HWC2::Error SetColorModeWithIntent(int32_t mode, int32_t intent);
+    HWC2::Error GetPerFrameMetadataKeys(uint32_t *outNumKeys,
+                                        int32_t *outKeys);
 #endif
 #if PLATFORM_SDK_VERSION > 28
     HWC2::Error GetDisplayIdentificationData(uint8_t *outPort,
@@ -199,9 +275,8 @@ class DrmHwcTwo : public hwc2_device_t {
         hwc_vsync_period_change_constraints_t *vsyncPeriodChangeConstraints,
         hwc_vsync_period_change_timeline_t *outTimeline);
     HWC2::Error SetAutoLowLatencyMode(bool on);
-    HWC2::Error GetSupportedContentTypes(
-        uint32_t *outNumSupportedContentTypes,
-        const uint32_t *outSupportedContentTypes);
+    HWC2::Error GetSupportedContentTypes(uint32_t *outNumSupportedContentTypes,
+                                         uint32_t *outSupportedContentTypes);
 
     HWC2::Error SetContentType(int32_t contentType);
 #endif
@@ -215,6 +290,8 @@ class DrmHwcTwo : public hwc2_device_t {
                                  int32_t *fences);
     HWC2::Error PresentDisplay(int32_t *present_fence);
     HWC2::Error SetActiveConfig(hwc2_config_t config);
+    HWC2::Error SetActiveConfigInternal(hwc2_config_t config, bool seamless,
+                                        bool modeset_fallback = false);
     HWC2::Error ChosePreferredConfig();
     HWC2::Error SetClientTarget(buffer_handle_t target, int32_t acquire_fence,
                                 int32_t dataspace, hwc_region_t damage);
@@ -225,10 +302,7 @@ class DrmHwcTwo : public hwc2_device_t {
     HWC2::Error SetVsyncEnabled(int32_t enabled);
     HWC2::Error ValidateDisplay(uint32_t *num_types, uint32_t *num_requests);
     HwcLayer *get_layer(hwc2_layer_t layer) {
-      auto it = layers_.find(layer);
-      if (it == layers_.end())
-        return nullptr;
-      return &it->second;
+      return layers_.Get(layer);
     }
 
     /* Statistics */
@@ -239,7 +313,10 @@ class DrmHwcTwo : public hwc2_device_t {
                 gpu_pixops_ - b.gpu_pixops_,
                 failed_kms_validate_ - b.failed_kms_validate_,
                 failed_kms_present_ - b.failed_kms_present_,
-                frames_flattened_ - b.frames_flattened_};
+                frames_flattened_ - b.frames_flattened_,
+                validations_skipped_ - b.validations_skipped_,
+                speculative_plans_ - b.speculative_plans_,
+                front_buffer_flushes_ - b.front_buffer_flushes_};
       }
 
       uint32_t total_frames_ = 0;
@@ -248,6 +325,9 @@ class DrmHwcTwo : public hwc2_device_t {
       uint32_t failed_kms_validate_ = 0;
       uint32_t failed_kms_present_ = 0;
       uint32_t frames_flattened_ = 0;
+      uint32_t validations_skipped_ = 0;
+      uint32_t speculative_plans_ = 0;
+      uint32_t front_buffer_flushes_ = 0;
     };
 
     const Backend *backend() const {
@@ -265,7 +345,7 @@ class DrmHwcTwo : public hwc2_device_t {
       return overlay_planes_;
     }
 
-    std::map<hwc2_layer_t, HwcLayer> &layers() {
+    SlotMap<HwcLayer> &layers() {
       return layers_;
     }
 
@@ -278,7 +358,12 @@ class DrmHwcTwo : public hwc2_device_t {
     }
 
     const DrmConnector *connector() const {
-      return connector_;
+      return pipeline_->connector;
+    }
+
+    /* Null if the display has no connector or CRTC to run on */
+    const DrmDisplayPipeline *pipeline() const {
+      return pipeline_.get();
     }
 
     ResourceManager *resource_manager() const {
@@ -289,10 +374,37 @@ class DrmHwcTwo : public hwc2_device_t {
       return color_transform_hint_;
     }
 
+    /* The color transform is applied by the CRTC when planes are in use */
+    bool IsColorTransformSupported() const {
+      return color_transform_hint_ == HAL_COLOR_TRANSFORM_IDENTITY ||
+             ctm_supported_;
+    }
+
+    /* Everything but the buffer contents that affects validation.
+     * include_plan adds the validated composition types, which are left out
+     * of keys for plans of the stack as they change with the plan picked */
+    uint64_t StackHash(bool include_plan);
+
+    /* Client range tested in the background for the current stack, if it is
+     * smaller than the one presented with it last time */
+    std::optional<std::pair<int, size_t>> GetSpeculativeClientRange();
+    void set_speculative_plan(bool speculative_plan) {
+      speculative_plan_ = speculative_plan;
+    }
+
+    /* HDR layers stay on planes when the sink accepts their EOTF */
+    bool IsHdrTransferSupported(DrmHwcTransfer transfer) const;
+
     Stats &total_stats() {
       return total_stats_;
     }
 
+    /* In doze modes the display shows only the client target on one plane */
+    bool IsInDoze() const {
+      return power_mode_ == HWC2::PowerMode::Doze ||
+             power_mode_ == HWC2::PowerMode::DozeSuspend;
+    }
+
     /* returns true if composition should be sent to client */
     bool ProcessClientFlatteningState(bool skip) {
       int flattenning_state = flattenning_state_;
@@ -316,6 +428,12 @@ class DrmHwcTwo : public hwc2_device_t {
     }
 
    private:
+    /* Declared first, the workers below use it until they are destroyed */
+    std::unique_ptr<DrmDisplayPipeline> pipeline_;
+    /* Splits the pipeline's planes into primary and overlay planes */
+    void SplitPlanes();
+    std::atomic_bool rebind_pending_ = false;
+
     enum ClientFlattenningState : int32_t {
       Disabled = -3,
       NotRequired = -2,
@@ -329,6 +447,79 @@ class DrmHwcTwo : public hwc2_device_t {
 
     void AddFenceToPresentFence(UniqueFd fd);
 
+    /* Config change requested by SetActiveConfigWithConstraints(), applied
+     * by the first validate after apply_time_ns */
+    struct StagedConfig {
+      hwc2_config_t config;
+      int64_t apply_time_ns;
+      bool seamless;
+      /* Unless seamlessRequired was set */
+      bool modeset_fallback;
+    };
+    std::optional<StagedConfig> staged_config_;
+    bool StagedConfigDue() const;
+    void ApplyStagedConfig();
+    /* The framework learns when the staged config actually took effect
+     * once the frame carrying it is committed */
+    bool period_timing_pending_ = false;
+    void NotifyVsyncPeriodTiming(int64_t applied_time_ns);
+
+    /* Variable refresh rate is enabled while the present cadence doesn't
+     * match the vsync period, e.g. for games or video */
+    bool VrrSupported() const;
+    void UpdateVrrState(int64_t present_time_ns);
+    /* A frame may be presented without validate when the layer stack is the
+     * one of the last successful present */
+    bool CanSkipValidate(uint64_t stack_hash);
+    bool validated_ = false;
+    std::optional<uint64_t> presented_stack_hash_;
+
+    /* Optionally, smaller client ranges of a presented stack are tested in
+     * the background and used by the following validates of that stack */
+    void SubmitSpeculation(uint64_t stack_hash);
+    bool speculation_enabled_ = false;
+    bool speculative_plan_ = false;
+    std::optional<uint64_t> speculated_stack_hash_;
+
+    /* A client target smaller than the mode is upscaled by its plane. The
+     * size is only accepted after a test commit of such a target passed. */
+    bool IsClientTargetUpscaled();
+    bool TestClientTargetUpscale(uint32_t width, uint32_t height,
+                                 int32_t format);
+    struct UpscaleTest {
+      uint32_t width;
+      uint32_t height;
+      int32_t format;
+      uint32_t mode_id;
+      bool passed;
+    };
+    std::vector<UpscaleTest> upscale_tests_;
+
+    /* Optionally, a single fullscreen plane of game content or of a low
+     * latency layer is flipped without waiting for vblank */
+    bool UseAsyncFlip();
+    bool async_flip_allowed_ = false;
+
+    /* One sideband stream per display is updated out-of-band */
+    void SetSidebandStream(const native_handle_t *stream);
+    const native_handle_t *sideband_stream_ = nullptr;
+
+    /* Drops to the lowest refresh rate of the active config group while
+     * dozing, if that can be done without a modeset */
+    void SetDozeRefreshRate(bool doze);
+    std::optional<hwc2_config_t> doze_restore_config_;
+    HWC2::PowerMode power_mode_ = HWC2::PowerMode::Off;
+
+    /* ALLM is signalled to the sink as the Game content type */
+    DrmHwcContentType content_type_ = DrmHwcContentType::kNone;
+    bool allm_enabled_ = false;
+    bool vsync_enabled_ = false;
+
+    bool vrr_allowed_ = false;
+    bool vrr_active_ = false;
+    int32_t vrr_score_ = 0;
+    int64_t last_present_ns_ = 0;
+
     constexpr static size_t MATRIX_SIZE = 16;
 
     DrmHwcTwo *hwc2_;
@@ -344,17 +535,23 @@ class DrmHwcTwo : public hwc2_device_t {
     std::unique_ptr<Backend> backend_;
 
     VSyncWorker vsync_worker_;
-    DrmConnector *connector_ = NULL;
-    DrmCrtc *crtc_ = NULL;
+    /* Tests with the compositor, so it must be destroyed first */
+    SpeculativeValidator speculative_validator_;
     hwc2_display_t handle_;
     HWC2::DisplayType type_;
-    uint32_t layer_idx_ = 0;
-    std::map<hwc2_layer_t, HwcLayer> layers_;
+    SlotMap<HwcLayer> layers_;
+    std::vector<HwcLayer *> z_ordered_layers_;
+    bool z_order_dirty_ = false;
     HwcLayer client_layer_;
+    /* Reused across frames to keep allocations off the present path */
+    std::vector<DrmHwcLayer> composition_layers_;
+    std::vector<DrmPlane *> plan_primary_planes_;
+    std::vector<DrmPlane *> plan_overlay_planes_;
     UniqueFd present_fence_;
     int32_t color_mode_{};
     std::array<float, MATRIX_SIZE> color_transform_matrix_{};
     android_color_transform_t color_transform_hint_;
+    bool ctm_supported_ = false;
 
     uint32_t frame_no_ = 0;
     Stats total_stats_;
@@ -435,6 +632,10 @@ class DrmHwcTwo : public hwc2_device_t {
                                    int32_t *format, hwc2_display_t *display);
   HWC2::Error DestroyVirtualDisplay(hwc2_display_t display);
   void Dump(uint32_t *outSize, char *outBuffer);
+  HWC2::Error ExecuteCommands(uint32_t num_words, const uint32_t *words,
+                              uint32_t num_handles,
+                              const native_handle_t *const *handles,
+                              uint32_t *out_error_offset);
   uint32_t GetMaxVirtualDisplayCount();
   HWC2::Error RegisterCallback(int32_t descriptor, hwc2_callback_data_t data,
                                hwc2_function_pointer_t function);
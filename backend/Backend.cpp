@@ -16,6 +16,7 @@
 
 #include "Backend.h"
 
+#include <algorithm>
 #include <climits>
 
 #include "BackendManager.h"
@@ -29,12 +30,16 @@ HWC2::Error Backend::ValidateDisplay(DrmHwcTwo::HwcDisplay *display,
   *num_types = 0;
   *num_requests = 0;
 
-  auto layers = display->GetOrderLayersByZPos();
+  auto &layers = display->GetOrderLayersByZPos();
 
   int client_start = -1;
   size_t client_size = 0;
 
-  if (display->ProcessClientFlatteningState(layers.size() <= 1)) {
+  if (display->IsInDoze()) {
+    client_start = 0;
+    client_size = layers.size();
+    MarkValidated(layers, client_start, client_size);
+  } else if (display->ProcessClientFlatteningState(layers.size() <= 1)) {
     display->total_stats().frames_flattened_++;
     client_start = 0;
     client_size = layers.size();
@@ -42,16 +47,41 @@ HWC2::Error Backend::ValidateDisplay(DrmHwcTwo::HwcDisplay *display,
   } else {
     std::tie(client_start, client_size) = GetClientLayers(display, layers);
 
-    MarkValidated(layers, client_start, client_size);
-
     bool testing_needed = !(client_start == 0 && client_size == layers.size());
 
+    /* The speculative range has been tested with the same stack already,
+     * only the buffers may have become unusable since then */
+    auto speculative = display->GetSpeculativeClientRange();
+    if (speculative && speculative->second < client_size &&
+        !HasClientLayerOutside(display, layers, speculative->first,
+                               speculative->second)) {
+      std::tie(client_start, client_size) = *speculative;
+      display->set_speculative_plan(true);
+      ++display->total_stats().speculative_plans_;
+      testing_needed = false;
+    }
+
+    /* A stack that failed before starts at the range found for it then */
+    uint64_t stack_hash = 0;
+    if (testing_needed) {
+      stack_hash = display->StackHash(false);
+      const FallbackEntry *fallback = FindFallback(stack_hash);
+      if (fallback != nullptr && fallback->client_size > client_size) {
+        client_start = fallback->client_start;
+        client_size = fallback->client_size;
+        testing_needed = client_size != layers.size();
+      }
+    }
+
+    MarkValidated(layers, client_start, client_size);
+
     if (testing_needed &&
         display->CreateComposition(true) != HWC2::Error::None) {
       ++display->total_stats().failed_kms_validate_;
-      client_start = 0;
-      client_size = layers.size();
-      MarkValidated(layers, 0, client_size);
+      std::tie(client_start, client_size) = SearchClientRange(display, layers,
+                                                              client_start,
+                                                              client_size);
+      StoreFallback(stack_hash, client_start, client_size);
     }
   }
 
@@ -83,13 +113,136 @@ std::tuple<int, size_t> Backend::GetClientLayers(
 
 bool Backend::IsClientLayer(DrmHwcTwo::HwcDisplay *display,
                             DrmHwcTwo::HwcLayer *layer) {
+  /* Sideband content never reaches the client target */
+  if (layer->sf_type() == HWC2::Composition::Sideband)
+    return false;
+
   return !HardwareSupportsLayerType(layer->sf_type()) ||
          !BufferInfoGetter::GetInstance()->IsHandleUsable(layer->buffer()) ||
-         display->color_transform_hint() != HAL_COLOR_TRANSFORM_IDENTITY ||
+         !display->IsColorTransformSupported() ||
+         !display->IsHdrTransferSupported(layer->transfer()) ||
          (layer->RequireScalingOrPhasing() &&
           display->resource_manager()->ForcedScalingWithGpu());
 }
 
+/*
+ * Grows the client range one layer at a time until a test commit passes,
+ * with the range left marked as validated. Layers that were the last ones
+ * added to passing ranges before are added first, then layers that need
+ * scaling, then the smallest ones.
+ */
+std::tuple<int, size_t> Backend::SearchClientRange(
+    DrmHwcTwo::HwcDisplay *display,
+    std::vector<DrmHwcTwo::HwcLayer *> &layers, int client_start,
+    size_t client_size) {
+  for (size_t tests = 0; tests < kMaxFallbackTests; ++tests) {
+    if (client_size == layers.size())
+      break;
+
+    int client_end = client_size != 0 ? client_start + int(client_size) : 0;
+    int grow_z = -1;
+    int64_t grow_score = 0;
+    for (int z_order = 0; z_order < layers.size(); ++z_order) {
+      bool inside = client_size != 0 && z_order >= client_start &&
+                    z_order < client_end;
+      bool adjacent = client_size == 0 || z_order == client_start - 1 ||
+                      z_order == client_end;
+      if (inside)
+        continue;
+
+      /* Rejected layers are pulled in from any distance */
+      int64_t score = 0;
+      if (IsRejectedLayer(layers[z_order]))
+        score = INT64_MAX - z_order;
+      else if (!adjacent)
+        continue;
+      else if (layers[z_order]->RequireScalingOrPhasing())
+        score = INT64_MAX / 2 - CalcPixOps(layers, z_order, 1);
+      else
+        score = INT64_MAX / 4 - CalcPixOps(layers, z_order, 1);
+
+      if (grow_z < 0 || score > grow_score) {
+        grow_z = z_order;
+        grow_score = score;
+      }
+    }
+
+    int grow_first = grow_z;
+    int grow_last = grow_z;
+    if (client_size != 0) {
+      grow_first = std::min(grow_z, client_start);
+      grow_last = std::max(grow_z, client_end - 1);
+    }
+    int prev_start = client_start;
+    int prev_end = client_end;
+    client_start = grow_first;
+    client_size = grow_last - grow_first + 1;
+
+    MarkValidated(layers, client_start, client_size);
+    if (display->CreateComposition(true) == HWC2::Error::None) {
+      for (int z_order = client_start; z_order <= grow_last; ++z_order) {
+        if (prev_end == 0 || z_order < prev_start || z_order >= prev_end)
+          RememberRejectedLayer(layers[z_order]);
+      }
+      return std::make_tuple(client_start, client_size);
+    }
+  }
+
+  MarkValidated(layers, 0, layers.size());
+  return std::make_tuple(0, layers.size());
+}
+
+auto Backend::FindFallback(uint64_t stack_hash) -> const FallbackEntry * {
+  for (const FallbackEntry &entry : fallbacks_) {
+    if (entry.stack_hash == stack_hash)
+      return &entry;
+  }
+  return nullptr;
+}
+
+void Backend::StoreFallback(uint64_t stack_hash, int client_start,
+                            size_t client_size) {
+  auto it = std::find_if(fallbacks_.begin(), fallbacks_.end(),
+                         [stack_hash](const FallbackEntry &entry) {
+                           return entry.stack_hash == stack_hash;
+                         });
+  if (it != fallbacks_.end())
+    fallbacks_.erase(it);
+  else if (fallbacks_.size() == kMaxFallbacks)
+    fallbacks_.erase(fallbacks_.begin());
+
+  fallbacks_.push_back({stack_hash, client_start, client_size});
+}
+
+bool Backend::IsRejectedLayer(const DrmHwcTwo::HwcLayer *layer) const {
+  uint64_t signature = layer->HashStackState(0);
+  return std::find(rejected_layers_.begin(), rejected_layers_.end(),
+                   signature) != rejected_layers_.end();
+}
+
+void Backend::RememberRejectedLayer(const DrmHwcTwo::HwcLayer *layer) {
+  if (IsRejectedLayer(layer))
+    return;
+
+  if (rejected_layers_.size() == kMaxRejectedLayers)
+    rejected_layers_.erase(rejected_layers_.begin());
+  rejected_layers_.push_back(layer->HashStackState(0));
+}
+
+bool Backend::HasClientLayerOutside(
+    DrmHwcTwo::HwcDisplay *display,
+    const std::vector<DrmHwcTwo::HwcLayer *> &layers, int client_start,
+    size_t client_size) {
+  for (int z_order = 0; z_order < layers.size(); ++z_order) {
+    if (client_size != 0 && z_order >= client_start &&
+        z_order < client_start + client_size)
+      continue;
+    if (IsClientLayer(display, layers[z_order]))
+      return true;
+  }
+  return false;
+}
+
 bool Backend::HardwareSupportsLayerType(HWC2::Composition comp_type) {
   return comp_type == HWC2::Composition::Device ||
          comp_type == HWC2::Composition::Cursor;
@@ -112,6 +265,8 @@ void Backend::MarkValidated(std::vector<DrmHwcTwo::HwcLayer *> &layers,
   for (int z_order = 0; z_order < layers.size(); ++z_order) {
     if (z_order >= client_first_z && z_order < client_first_z + client_size)
       layers[z_order]->set_validated_type(HWC2::Composition::Client);
+    else if (layers[z_order]->sf_type() == HWC2::Composition::Sideband)
+      layers[z_order]->set_validated_type(HWC2::Composition::Sideband);
     else
       layers[z_order]->set_validated_type(HWC2::Composition::Device);
   }
@@ -34,6 +34,9 @@ class Backend {
                              DrmHwcTwo::HwcLayer *layer);
 
  protected:
+  bool HasClientLayerOutside(DrmHwcTwo::HwcDisplay *display,
+                             const std::vector<DrmHwcTwo::HwcLayer *> &layers,
+                             int client_start, size_t client_size);
   bool HardwareSupportsLayerType(HWC2::Composition comp_type);
   uint32_t CalcPixOps(const std::vector<DrmHwcTwo::HwcLayer *> &layers,
                       size_t first_z, size_t size);
@@ -43,6 +46,34 @@ class Backend {
       DrmHwcTwo::HwcDisplay *display,
       const std::vector<DrmHwcTwo::HwcLayer *> &layers, int client_start,
       size_t client_size);
+  std::tuple<int, size_t> SearchClientRange(
+      DrmHwcTwo::HwcDisplay *display,
+      std::vector<DrmHwcTwo::HwcLayer *> &layers, int client_start,
+      size_t client_size);
+
+ private:
+  /* Test commits after the failed one before giving up on planes */
+  static constexpr size_t kMaxFallbackTests = 3;
+  static constexpr size_t kMaxFallbacks = 8;
+  static constexpr size_t kMaxRejectedLayers = 16;
+
+  /* Client range found for a stack whose first test commit failed */
+  struct FallbackEntry {
+    uint64_t stack_hash;
+    int client_start;
+    size_t client_size;
+  };
+
+  auto FindFallback(uint64_t stack_hash) -> const FallbackEntry *;
+  void StoreFallback(uint64_t stack_hash, int client_start,
+                     size_t client_size);
+  bool IsRejectedLayer(const DrmHwcTwo::HwcLayer *layer) const;
+  void RememberRejectedLayer(const DrmHwcTwo::HwcLayer *layer);
+
+  /* Oldest first */
+  std::vector<FallbackEntry> fallbacks_;
+  /* Signatures of layers a passing range had to be grown by */
+  std::vector<uint64_t> rejected_layers_;
 };
 }  // namespace android
 
@@ -23,7 +23,7 @@ namespace android {
 HWC2::Error BackendClient::ValidateDisplay(DrmHwcTwo::HwcDisplay *display,
                                            uint32_t *num_types,
                                            uint32_t * /*num_requests*/) {
-  for (auto & [ layer_handle, layer ] : display->layers()) {
+  for (auto [layer_handle, layer] : display->layers()) {
     layer.set_validated_type(HWC2::Composition::Client);
     ++*num_types;
   }
@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwc-sideband-stream-provider"
+
+#include "SidebandStreamProvider.h"
+
+#include "utils/log.h"
+
+namespace android {
+
+SidebandStreamProvider *SidebandStreamProvider::GetInstance() {
+  static std::unique_ptr<SidebandStreamProvider> inst = CreateInstance();
+  return inst.get();
+}
+
+__attribute__((weak)) std::unique_ptr<SidebandStreamProvider>
+SidebandStreamProvider::CreateInstance() {
+  ALOGI("No sideband stream provider available");
+  return nullptr;
+}
+
+}  // namespace android
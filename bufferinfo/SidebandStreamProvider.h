@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_SIDEBANDSTREAMPROVIDER_H_
+#define ANDROID_SIDEBANDSTREAMPROVIDER_H_
+
+#include <cutils/native_handle.h>
+
+#include <functional>
+#include <memory>
+
+#include "drmhwcgralloc.h"
+#include "utils/UniqueFd.h"
+
+namespace android {
+
+/* Resolves sideband stream handles (tuners, HDMI-in, secure decoders) to the
+ * dma-bufs their producer updates outside of the buffer queues. Platforms plug
+ * their provider in by defining CreateInstance(). */
+class SidebandStreamProvider {
+ public:
+  using FrameCallback = std::function<void()>;
+
+  virtual ~SidebandStreamProvider() {
+  }
+
+  /* Fills bo with the latest frame of the stream, acquire_fence signals once
+   * it is ready. Returns -EAGAIN until the first frame is queued. */
+  virtual int GetFrame(const native_handle_t *stream, hwc_drm_bo_t *bo,
+                       UniqueFd *acquire_fence) = 0;
+
+  /* The callback runs on the provider's thread for every new frame, an empty
+   * callback unregisters the stream */
+  virtual int SetFrameCallback(const native_handle_t *stream,
+                               FrameCallback callback) = 0;
+
+  /* nullptr if the platform has no provider */
+  static SidebandStreamProvider *GetInstance();
+
+  static std::unique_ptr<SidebandStreamProvider> CreateInstance();
+};
+
+}  // namespace android
+#endif
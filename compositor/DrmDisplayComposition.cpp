@@ -37,6 +37,27 @@ DrmDisplayComposition::DrmDisplayComposition(DrmCrtc *crtc, Planner *planner)
       planner_(planner) {
 }
 
+void DrmDisplayComposition::Reset(DrmCrtc *crtc, Planner *planner) {
+  crtc_ = crtc;
+  planner_ = planner;
+  type_ = DRM_COMPOSITION_TYPE_EMPTY;
+  dpms_mode_ = DRM_MODE_DPMS_ON;
+  display_mode_ = DrmMode();
+  seamless_modeset_ = false;
+  modeset_fallback_ = false;
+  vrr_enabled_ = false;
+  content_type_ = DrmHwcContentType::kNone;
+  async_flip_ = false;
+  color_transform_.reset();
+  hdr_transfer_ = DrmHwcTransfer::kUndefined;
+  hdr_metadata_ = DrmHwcHdrMetadata();
+  geometry_changed_ = true;
+  layers_.clear();
+  composition_planes_.clear();
+  plan_layers_.clear();
+  out_fence_ = UniqueFd();
+}
+
 bool DrmDisplayComposition::validate_composition_type(DrmCompositionType des) {
   return type_ == DRM_COMPOSITION_TYPE_EMPTY || type_ == des;
 }
@@ -56,6 +77,43 @@ int DrmDisplayComposition::SetLayers(DrmHwcLayer *layers, size_t num_layers,
   return 0;
 }
 
+void DrmDisplayComposition::SetOutputState(const OutputState &state,
+                                           bool has_client_target) {
+  vrr_enabled_ = state.vrr_enabled;
+  content_type_ = state.content_type;
+
+  /* The client applies the color transform itself when it composes all
+   * layers, otherwise the CRTC applies it on top of everything */
+  bool has_device_layer = layers_.size() > (has_client_target ? 1 : 0);
+  color_transform_.reset();
+  if (state.color_transform && has_device_layer)
+    color_transform_ = state.color_transform;
+
+  /* The largest HDR layer selects the EOTF sent to the sink. Planes aren't
+   * converted, so that is only done while no layer of another transfer, the
+   * client target included, is on screen. */
+  hdr_transfer_ = DrmHwcTransfer::kUndefined;
+  if (has_client_target)
+    return;
+
+  const DrmHwcLayer *hdr_layer = nullptr;
+  int64_t hdr_area = 0;
+  for (const DrmHwcLayer &layer : layers_) {
+    if (layer.transfer == DrmHwcTransfer::kUndefined ||
+        (hdr_layer != nullptr && layer.transfer != hdr_layer->transfer))
+      return;
+
+    const hwc_rect_t &df = layer.display_frame;
+    int64_t area = int64_t(df.right - df.left) * (df.bottom - df.top);
+    if (hdr_layer == nullptr || area > hdr_area) {
+      hdr_layer = &layer;
+      hdr_area = area;
+    }
+  }
+  if (hdr_layer != nullptr)
+    SetHdrOutput(hdr_layer->transfer, hdr_layer->hdr_metadata);
+}
+
 int DrmDisplayComposition::SetDpmsMode(uint32_t dpms_mode) {
   if (!validate_composition_type(DRM_COMPOSITION_TYPE_DPMS))
     return -EINVAL;
@@ -64,12 +122,16 @@ int DrmDisplayComposition::SetDpmsMode(uint32_t dpms_mode) {
   return 0;
 }
 
-int DrmDisplayComposition::SetDisplayMode(const DrmMode &display_mode) {
+int DrmDisplayComposition::SetDisplayMode(const DrmMode &display_mode,
+                                          bool seamless,
+                                          bool modeset_fallback) {
   if (!validate_composition_type(DRM_COMPOSITION_TYPE_MODESET)) {
     ALOGE("SetDisplayMode() Failed to validate composition type");
     return -EINVAL;
   }
   display_mode_ = display_mode;
+  seamless_modeset_ = seamless;
+  modeset_fallback_ = modeset_fallback;
   dpms_mode_ = DRM_MODE_DPMS_ON;
   type_ = DRM_COMPOSITION_TYPE_MODESET;
   return 0;
@@ -90,16 +152,12 @@ int DrmDisplayComposition::Plan(std::vector<DrmPlane *> *primary_planes,
   if (type_ != DRM_COMPOSITION_TYPE_FRAME)
     return 0;
 
-  std::map<size_t, DrmHwcLayer *> to_composite;
-
+  plan_layers_.clear();
   for (size_t i = 0; i < layers_.size(); ++i)
-    to_composite.emplace(std::make_pair(i, &layers_[i]));
+    plan_layers_.emplace_back(i, &layers_[i]);
 
-  int ret = 0;
-  std::tie(ret,
-           composition_planes_) = planner_->ProvisionPlanes(to_composite, crtc_,
-                                                            primary_planes,
-                                                            overlay_planes);
+  int ret = planner_->ProvisionPlanes(plan_layers_, crtc_, primary_planes,
+                                      overlay_planes, &composition_planes_);
   if (ret) {
     ALOGV("Planner failed provisioning planes ret=%d", ret);
     return ret;
@@ -111,9 +169,6 @@ int DrmDisplayComposition::Plan(std::vector<DrmPlane *> *primary_planes,
     if (!i.plane())
       continue;
 
-    // make sure that source layers are ordered based on zorder
-    std::sort(i.source_layers().begin(), i.source_layers().end());
-
     std::vector<DrmPlane *> *container = nullptr;
     if (i.plane()->type() == DRM_PLANE_TYPE_PRIMARY)
       container = primary_planes;
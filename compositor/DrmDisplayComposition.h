@@ -20,6 +20,8 @@
 #include <hardware/hardware.h>
 #include <hardware/hwcomposer.h>
 
+#include <array>
+#include <optional>
 #include <sstream>
 #include <vector>
 
@@ -32,6 +34,11 @@ namespace android {
 class Importer;
 class Planner;
 
+using ColorTransformMatrix = std::array<float, 16>;
+
+/* index:layer pairs in z-order, consumed by the plan stages */
+using PlanLayers = std::vector<std::pair<size_t, DrmHwcLayer *>>;
+
 enum DrmCompositionType {
   DRM_COMPOSITION_TYPE_EMPTY,
   DRM_COMPOSITION_TYPE_FRAME,
@@ -52,7 +59,7 @@ class DrmCompositionPlane {
   DrmCompositionPlane(Type type, DrmPlane *plane) : type_(type), plane_(plane) {
   }
   DrmCompositionPlane(Type type, DrmPlane *plane, size_t source_layer)
-      : type_(type), plane_(plane), source_layers_(1, source_layer) {
+      : type_(type), plane_(plane), source_layer_(source_layer) {
   }
 
   Type type() const {
@@ -66,18 +73,37 @@ class DrmCompositionPlane {
     plane_ = plane;
   }
 
-  std::vector<size_t> &source_layers() {
-    return source_layers_;
+  /* Index of the layer scanned out by a kLayer plane */
+  size_t source_layer() const {
+    return source_layer_;
+  }
+
+  /* Part of a layer that is split across planes, the whole layer if unset */
+  struct Region {
+    hwc_frect_t source_crop;
+    hwc_rect_t display_frame;
+  };
+  const std::optional<Region> &region() const {
+    return region_;
+  }
+  void set_region(const Region &region) {
+    region_ = region;
   }
 
-  const std::vector<size_t> &source_layers() const {
-    return source_layers_;
+  /* CRTC of the tile the plane scans out on, the composition's if NULL */
+  DrmCrtc *crtc() const {
+    return crtc_;
+  }
+  void set_crtc(DrmCrtc *crtc) {
+    crtc_ = crtc;
   }
 
  private:
   Type type_ = Type::kDisable;
   DrmPlane *plane_ = NULL;
-  std::vector<size_t> source_layers_;
+  size_t source_layer_ = 0;
+  std::optional<Region> region_;
+  DrmCrtc *crtc_ = NULL;
 };
 
 class DrmDisplayComposition {
@@ -86,11 +112,18 @@ class DrmDisplayComposition {
   DrmDisplayComposition(DrmCrtc *crtc, Planner *planner);
   ~DrmDisplayComposition() = default;
 
+  /* Returns a recycled composition to the initial state, keeping the
+   * capacity of its containers */
+  void Reset(DrmCrtc *crtc, Planner *planner);
+
   int SetLayers(DrmHwcLayer *layers, size_t num_layers, bool geometry_changed);
   int AddPlaneComposition(DrmCompositionPlane plane);
   int AddPlaneDisable(DrmPlane *plane);
   int SetDpmsMode(uint32_t dpms_mode);
-  int SetDisplayMode(const DrmMode &display_mode);
+  /* A seamless change the driver refuses on commit is done as a full
+   * modeset with modeset_fallback, otherwise it is dropped */
+  int SetDisplayMode(const DrmMode &display_mode, bool seamless = false,
+                     bool modeset_fallback = false);
 
   int Plan(std::vector<DrmPlane *> *primary_planes,
            std::vector<DrmPlane *> *overlay_planes);
@@ -119,6 +152,74 @@ class DrmDisplayComposition {
     return display_mode_;
   }
 
+  bool seamless_modeset() const {
+    return seamless_modeset_;
+  }
+
+  bool modeset_fallback() const {
+    return modeset_fallback_;
+  }
+
+  bool vrr_enabled() const {
+    return vrr_enabled_;
+  }
+
+  void SetVrrEnabled(bool enabled) {
+    vrr_enabled_ = enabled;
+  }
+
+  /* Row-major 4x4 affine matrix as given to SetColorTransform() */
+  const std::optional<ColorTransformMatrix> &color_transform() const {
+    return color_transform_;
+  }
+
+  void SetColorTransform(const ColorTransformMatrix &matrix) {
+    color_transform_ = matrix;
+  }
+
+  DrmHwcContentType content_type() const {
+    return content_type_;
+  }
+
+  void SetContentType(DrmHwcContentType content_type) {
+    content_type_ = content_type;
+  }
+
+  /* Flip without waiting for vblank, at the cost of tearing */
+  bool async_flip() const {
+    return async_flip_;
+  }
+
+  void SetAsyncFlip(bool async_flip) {
+    async_flip_ = async_flip;
+  }
+
+  /* EOTF signalled to the sink, kUndefined for SDR output */
+  DrmHwcTransfer hdr_transfer() const {
+    return hdr_transfer_;
+  }
+
+  const DrmHwcHdrMetadata &hdr_metadata() const {
+    return hdr_metadata_;
+  }
+
+  void SetHdrOutput(DrmHwcTransfer transfer,
+                    const DrmHwcHdrMetadata &metadata) {
+    hdr_transfer_ = transfer;
+    hdr_metadata_ = metadata;
+  }
+
+  /* Display state the layers are scanned out with */
+  struct OutputState {
+    std::optional<ColorTransformMatrix> color_transform;
+    DrmHwcContentType content_type = DrmHwcContentType::kNone;
+    bool vrr_enabled = false;
+  };
+
+  /* Applies the state to the layers set before. Test and real commits of a
+   * frame must go through here to test the same atomic state. */
+  void SetOutputState(const OutputState &state, bool has_client_target);
+
   DrmCrtc *crtc() const {
     return crtc_;
   }
@@ -138,10 +239,19 @@ class DrmDisplayComposition {
   DrmCompositionType type_ = DRM_COMPOSITION_TYPE_EMPTY;
   uint32_t dpms_mode_ = DRM_MODE_DPMS_ON;
   DrmMode display_mode_;
+  bool seamless_modeset_ = false;
+  bool modeset_fallback_ = false;
+  bool vrr_enabled_ = false;
+  DrmHwcContentType content_type_ = DrmHwcContentType::kNone;
+  bool async_flip_ = false;
+  std::optional<ColorTransformMatrix> color_transform_;
+  DrmHwcTransfer hdr_transfer_ = DrmHwcTransfer::kUndefined;
+  DrmHwcHdrMetadata hdr_metadata_;
 
   bool geometry_changed_ = true;
   std::vector<DrmHwcLayer> layers_;
   std::vector<DrmCompositionPlane> composition_planes_;
+  PlanLayers plan_layers_;
 };
 }  // namespace android
 
@@ -25,24 +25,102 @@
 #include <sync/sync.h>
 #include <utils/Trace.h>
 
+#include <algorithm>
 #include <array>
+#include <cinttypes>
+#include <cmath>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <sstream>
 #include <vector>
 
 #include "drm/DrmCrtc.h"
 #include "drm/DrmDevice.h"
+#include "drm/DrmFbImporter.h"
 #include "drm/DrmPlane.h"
 #include "drm/DrmUnique.h"
 #include "utils/autolock.h"
+#include "utils/clock.h"
 #include "utils/log.h"
 
 namespace android {
 
+/* One composition is scanned out while the next one is built or tested */
+constexpr size_t kMaxPooledCompositions = 3;
+
+/* DRM color coefficients are S31.32 sign-magnitude fixed point */
+static uint64_t ToS3132(float value) {
+  constexpr double kOne = 4294967296.0; /* 1 << 32 */
+  auto magnitude = static_cast<uint64_t>(std::fabs(double(value)) * kOne);
+  return value < 0 ? (magnitude | (1ULL << 63)) : magnitude;
+}
+
+static auto CreateLutBlob(DrmDevice *drm, const DrmProperty &size_property,
+                          bool to_linear) -> DrmModeUserPropertyBlobUnique {
+  auto [ret, size] = size_property.value();
+  if (ret != 0 || size < 2)
+    return DrmModeUserPropertyBlobUnique();
+
+  /* sRGB transfer function */
+  std::vector<drm_color_lut> lut(size);
+  for (size_t i = 0; i < size; i++) {
+    double x = double(i) / double(size - 1);
+    double y = 0;
+    if (to_linear)
+      y = x <= 0.04045 ? x / 12.92 : std::pow((x + 0.055) / 1.055, 2.4);
+    else
+      y = x <= 0.0031308 ? x * 12.92 : 1.055 * std::pow(x, 1.0 / 2.4) - 0.055;
+
+    auto value = static_cast<uint16_t>(std::lround(y * 0xffff));
+    lut[i].red = lut[i].green = lut[i].blue = value;
+  }
+
+  return drm->RegisterUserPropertyBlob(lut.data(),
+                                       sizeof(drm_color_lut) * lut.size());
+}
+
+/* CTA-861.3 static metadata, in the HDMI infoframe encoding */
+static hdr_output_metadata ToHdrOutputMetadata(
+    DrmHwcTransfer transfer, const DrmHwcHdrMetadata &metadata) {
+  constexpr uint8_t kEotfSt2084 = 2;
+  constexpr uint8_t kEotfHlg = 3;
+  constexpr uint32_t kStaticMetadataType1 = 0;
+  /* Chromaticity unit is 0.00002, min luminance unit is 0.0001 cd/m2 */
+  auto chroma = [](float v) {
+    return static_cast<uint16_t>(std::lround(std::clamp(v, 0.0F, 1.0F) *
+                                             50000.0F));
+  };
+  auto lum = [](float v, float scale) {
+    return static_cast<uint16_t>(
+        std::lround(std::clamp(v * scale, 0.0F, 65535.0F)));
+  };
+
+  hdr_output_metadata out;
+  memset(&out, 0, sizeof(out));
+  out.metadata_type = kStaticMetadataType1;
+  auto &frame = out.hdmi_metadata_type1;
+  frame.eotf = transfer == DrmHwcTransfer::kHlg ? kEotfHlg : kEotfSt2084;
+  frame.metadata_type = kStaticMetadataType1;
+  /* Primaries are sent in green, blue, red order */
+  const std::array<const std::array<float, 2> *, 3> primaries = {
+      &metadata.green, &metadata.blue, &metadata.red};
+  for (size_t i = 0; i < primaries.size(); i++) {
+    frame.display_primaries[i].x = chroma((*primaries[i])[0]);
+    frame.display_primaries[i].y = chroma((*primaries[i])[1]);
+  }
+  frame.white_point.x = chroma(metadata.white[0]);
+  frame.white_point.y = chroma(metadata.white[1]);
+  frame.max_display_mastering_luminance = lum(metadata.max_luminance, 1.0F);
+  frame.min_display_mastering_luminance = lum(metadata.min_luminance,
+                                              10000.0F);
+  frame.max_cll = lum(metadata.max_cll, 1.0F);
+  frame.max_fall = lum(metadata.max_fall, 1.0F);
+  return out;
+}
+
 DrmDisplayCompositor::DrmDisplayCompositor()
-    : resource_manager_(nullptr),
-      display_(-1),
+    : pipeline_(nullptr),
       initialized_(false),
       active_(false),
       use_hw_overlays_(true) {
@@ -55,16 +133,12 @@ DrmDisplayCompositor::~DrmDisplayCompositor() {
   active_composition_.reset();
 }
 
-auto DrmDisplayCompositor::Init(ResourceManager *resource_manager, int display)
-    -> int {
-  resource_manager_ = resource_manager;
-  display_ = display;
-  DrmDevice *drm = resource_manager_->GetDrmDevice(display);
-  if (!drm) {
-    ALOGE("Could not find drmdevice for display");
-    return -EINVAL;
-  }
-  planner_ = Planner::CreateInstance(drm);
+auto DrmDisplayCompositor::Init(DrmDisplayPipeline *pipeline) -> int {
+  pipeline_ = pipeline;
+  planner_ = Planner::CreateInstance(pipeline_->device);
+  if (planner_)
+    planner_->SetTiles(&pipeline_->tiles);
+  composition_pool_.reserve(kMaxPooledCompositions);
 
   initialized_ = true;
   return 0;
@@ -72,28 +146,43 @@ auto DrmDisplayCompositor::Init(ResourceManager *resource_manager, int display)
 
 std::unique_ptr<DrmDisplayComposition>
 DrmDisplayCompositor::CreateInitializedComposition() const {
-  DrmDevice *drm = resource_manager_->GetDrmDevice(display_);
-  DrmCrtc *crtc = drm->GetCrtcForDisplay(display_);
-  if (!crtc) {
-    ALOGE("Failed to find crtc for display = %d", display_);
-    return std::unique_ptr<DrmDisplayComposition>();
-  }
+  return std::make_unique<DrmDisplayComposition>(pipeline_->crtc,
+                                                 planner_.get());
+}
 
-  return std::make_unique<DrmDisplayComposition>(crtc, planner_.get());
+auto DrmDisplayCompositor::AcquireComposition(DrmCrtc *crtc, Planner *planner)
+    -> std::unique_ptr<DrmDisplayComposition> {
+  const std::lock_guard<std::mutex> lock(lock_);
+  if (composition_pool_.empty())
+    return std::make_unique<DrmDisplayComposition>(crtc, planner);
+
+  auto composition = std::move(composition_pool_.back());
+  composition_pool_.pop_back();
+  composition->Reset(crtc, planner);
+  return composition;
+}
+
+void DrmDisplayCompositor::RecycleComposition(
+    std::unique_ptr<DrmDisplayComposition> composition) {
+  const std::lock_guard<std::mutex> lock(lock_);
+  ReturnToPool(std::move(composition));
+}
+
+void DrmDisplayCompositor::ReturnToPool(
+    std::unique_ptr<DrmDisplayComposition> composition) {
+  if (!composition || composition_pool_.size() >= kMaxPooledCompositions)
+    return;
+
+  /* Drop buffer references right away, keep the containers */
+  composition->Reset(nullptr, nullptr);
+  composition_pool_.emplace_back(std::move(composition));
 }
 
 std::tuple<uint32_t, uint32_t, int>
 DrmDisplayCompositor::GetActiveModeResolution() {
-  DrmDevice *drm = resource_manager_->GetDrmDevice(display_);
-  DrmConnector *connector = drm->GetConnectorForDisplay(display_);
-  if (connector == nullptr) {
-    ALOGE("Failed to determine display mode: no connector for display %d",
-          display_);
-    return std::make_tuple(0, 0, -ENODEV);
-  }
-
-  const DrmMode &mode = connector->active_mode();
-  return std::make_tuple(mode.h_display(), mode.v_display(), 0);
+  auto [width, height] = pipeline_->connector->GetDisplaySize(
+      pipeline_->connector->active_mode());
+  return std::make_tuple(width, height, 0);
 }
 
 int DrmDisplayCompositor::DisablePlanes(DrmDisplayComposition *display_comp) {
@@ -111,78 +200,223 @@ int DrmDisplayCompositor::DisablePlanes(DrmDisplayComposition *display_comp) {
       return -EINVAL;
     }
   }
-  DrmDevice *drm = resource_manager_->GetDrmDevice(display_);
+  DrmDevice *drm = pipeline_->device;
   ret = drmModeAtomicCommit(drm->fd(), pset.get(), 0, drm);
   if (ret) {
     ALOGE("Failed to commit pset ret=%d\n", ret);
     return ret;
   }
 
+  flip_state_.reset();
   return 0;
 }
 
+bool DrmDisplayCompositor::FlipState::operator==(
+    const FlipState &other) const {
+  return plane == other.plane && source_layer == other.source_layer &&
+         source_crop.left == other.source_crop.left &&
+         source_crop.top == other.source_crop.top &&
+         source_crop.right == other.source_crop.right &&
+         source_crop.bottom == other.source_crop.bottom &&
+         display_frame.left == other.display_frame.left &&
+         display_frame.top == other.display_frame.top &&
+         display_frame.right == other.display_frame.right &&
+         display_frame.bottom == other.display_frame.bottom &&
+         transform == other.transform && blending == other.blending &&
+         alpha == other.alpha && color_space == other.color_space &&
+         sample_range == other.sample_range &&
+         vrr_enabled == other.vrr_enabled &&
+         color_transform == other.color_transform;
+}
+
+auto DrmDisplayCompositor::GetFlipState(DrmDisplayComposition *display_comp)
+    -> std::optional<FlipState> {
+  std::vector<DrmHwcLayer> &layers = display_comp->layers();
+  const DrmCompositionPlane *flip_plane = nullptr;
+  for (const DrmCompositionPlane &comp_plane :
+       display_comp->composition_planes()) {
+    if (comp_plane.type() == DrmCompositionPlane::Type::kDisable)
+      continue;
+    if (flip_plane != nullptr ||
+        comp_plane.plane()->type() != DRM_PLANE_TYPE_PRIMARY ||
+        comp_plane.crtc() != nullptr ||
+        comp_plane.source_layer() >= layers.size())
+      return {};
+    flip_plane = &comp_plane;
+  }
+  if (flip_plane == nullptr)
+    return {};
+
+  const DrmHwcLayer &layer = layers[flip_plane->source_layer()];
+  const auto &region = flip_plane->region();
+  return FlipState{flip_plane->plane(),
+                   flip_plane->source_layer(),
+                   region ? region->source_crop : layer.source_crop,
+                   region ? region->display_frame : layer.display_frame,
+                   layer.transform,
+                   layer.blending,
+                   layer.alpha,
+                   layer.color_space,
+                   layer.sample_range,
+                   display_comp->vrr_enabled(),
+                   display_comp->color_transform()};
+}
+
+/* The kernel takes nothing but the new framebuffer in an asynchronous
+ * commit. OUT_FENCE_PTR can't be part of it either, so the frame has no
+ * present fence. */
+auto DrmDisplayCompositor::CommitAsyncFlip(DrmDisplayComposition *display_comp,
+                                           const FlipState &flip_state)
+    -> int {
+  if (flip_pset_)
+    drmModeAtomicSetCursor(flip_pset_.get(), 0);
+  else
+    flip_pset_ = MakeDrmModeAtomicReqUnique();
+  if (!flip_pset_) {
+    ALOGE("Failed to allocate property set");
+    return -ENOMEM;
+  }
+
+  DrmHwcLayer &layer = display_comp->layers()[flip_state.source_layer];
+  int ret = flip_state.plane->AtomicSetFlip(*flip_pset_, layer);
+  if (ret)
+    return ret;
+
+  DrmDevice *drm = pipeline_->device;
+  return drmModeAtomicCommit(drm->fd(), flip_pset_.get(),
+                             DRM_MODE_PAGE_FLIP_ASYNC, drm);
+}
+
+/* A mode of the tile's connector with the timing of the first tile's mode */
+static const DrmMode *FindTileMode(const DrmConnector &connector,
+                                   const DrmMode &mode) {
+  for (const DrmMode &tile_mode : connector.modes()) {
+    if (tile_mode.h_display() == mode.h_display() &&
+        tile_mode.v_display() == mode.v_display() &&
+        tile_mode.v_refresh() == mode.v_refresh())
+      return &tile_mode;
+  }
+  return nullptr;
+}
+
 int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
-                                      bool test_only) {
+                                      bool test_only, ModeState *mode_state) {
   ATRACE_CALL();
 
   int ret = 0;
+  ModeState &mode = mode_state ? *mode_state : mode_;
 
   std::vector<DrmHwcLayer> &layers = display_comp->layers();
   std::vector<DrmCompositionPlane> &comp_planes = display_comp
                                                       ->composition_planes();
-  DrmDevice *drm = resource_manager_->GetDrmDevice(display_);
-  uint64_t out_fences[drm->crtcs().size()];
-
-  DrmConnector *connector = drm->GetConnectorForDisplay(display_);
-  if (!connector) {
-    ALOGE("Could not locate connector for display %d", display_);
-    return -ENODEV;
-  }
-  DrmCrtc *crtc = drm->GetCrtcForDisplay(display_);
-  if (!crtc) {
-    ALOGE("Could not locate crtc for display %d", display_);
-    return -ENODEV;
-  }
-
-  auto pset = MakeDrmModeAtomicReqUnique();
-  if (!pset) {
+  DrmDevice *drm = pipeline_->device;
+  DrmConnector *connector = pipeline_->connector;
+  DrmCrtc *crtc = pipeline_->crtc;
+  /* The kernel writes an s32 */
+  int32_t out_fence = -1;
+
+  if (pset_)
+    drmModeAtomicSetCursor(pset_.get(), 0);
+  else
+    pset_ = MakeDrmModeAtomicReqUnique();
+  if (!pset_) {
     ALOGE("Failed to allocate property set");
     return -ENOMEM;
   }
+  DrmModeAtomicReqUnique &pset = pset_;
 
   if (crtc->out_fence_ptr_property() &&
-      !crtc->out_fence_ptr_property()
-           .AtomicSet(*pset, (uint64_t)&out_fences[crtc->pipe()])) {
+      !crtc->out_fence_ptr_property().AtomicSet(*pset,
+                                                (uint64_t)&out_fence)) {
+    return -EINVAL;
+  }
+
+  bool power_up = power_up_pending_ && !mode_state;
+  if ((mode.blob_id || power_up) &&
+      !crtc->active_property().AtomicSet(*pset, 1)) {
     return -EINVAL;
   }
 
-  if (mode_.blob &&
-      (!crtc->active_property().AtomicSet(*pset, 1) ||
-       !crtc->mode_property().AtomicSet(*pset, *mode_.blob) ||
+  /* The other tiles of a tiled display are committed along */
+  const auto &tiles = pipeline_->tiles;
+  tile_out_fences_.assign(tiles.size(), -1);
+  for (size_t i = 1; i < tiles.size(); ++i) {
+    ret = AtomicSetTile(*pset, display_comp, tiles[i], mode, power_up,
+                        &tile_out_fences_[i]);
+    if (ret)
+      return ret;
+  }
+
+  if (mode.blob_id &&
+      (!crtc->mode_property().AtomicSet(*pset, mode.blob_id) ||
        !connector->crtc_id_property().AtomicSet(*pset, crtc->id()))) {
     return -EINVAL;
   }
 
+  /* i915 takes a content type change for a modeset, so it's only written
+   * when it changes */
+  DrmHwcContentType content_type = display_comp->content_type();
+  bool content_type_changed = active_content_type_ != content_type;
+  if (content_type_changed) {
+    if (!connector->AtomicSetContentType(*pset, content_type))
+      return -EINVAL;
+    for (size_t i = 1; i < tiles.size(); ++i) {
+      if (!tiles[i].connector->AtomicSetContentType(*pset, content_type))
+        return -EINVAL;
+    }
+  }
+
+  ret = AtomicSetColorTransform(*pset, display_comp, crtc);
+  if (ret)
+    return ret;
+
+  uint32_t hdr_blob_id = 0;
+  ret = AtomicSetHdrOutputMetadata(*pset, display_comp, connector,
+                                   &hdr_blob_id);
+  if (ret)
+    return ret;
+  bool hdr_changed = hdr_blob_id != hdr_.active_blob_id;
+
+  /* Each tile connector sends the infoframe for its part of the panel */
+  for (size_t i = 1; i < tiles.size(); ++i) {
+    const DrmProperty &property =
+        tiles[i].connector->hdr_output_metadata_property();
+    if (!property) {
+      if (hdr_blob_id != 0)
+        return -EINVAL;
+      continue;
+    }
+    if (!property.AtomicSet(*pset, hdr_blob_id))
+      return -EINVAL;
+  }
+
+  if (crtc->vrr_enabled_property() &&
+      !crtc->vrr_enabled_property().AtomicSet(*pset,
+                                              display_comp->vrr_enabled())) {
+    return -EINVAL;
+  }
+
   for (DrmCompositionPlane &comp_plane : comp_planes) {
     DrmPlane *plane = comp_plane.plane();
-    std::vector<size_t> &source_layers = comp_plane.source_layers();
+    size_t source_layer = comp_plane.source_layer();
 
     if (comp_plane.type() != DrmCompositionPlane::Type::kDisable) {
-      if (source_layers.size() > 1) {
-        ALOGE("Can't handle more than one source layer sz=%zu type=%d",
-              source_layers.size(), comp_plane.type());
-        continue;
-      }
-
-      if (source_layers.empty() || source_layers.front() >= layers.size()) {
-        ALOGE("Source layer index %zu out of bounds %zu type=%d",
-              source_layers.front(), layers.size(), comp_plane.type());
+      if (source_layer >= layers.size()) {
+        ALOGE("Source layer index %zu out of bounds %zu type=%d", source_layer,
+              layers.size(), comp_plane.type());
         return -EINVAL;
       }
-      DrmHwcLayer &layer = layers[source_layers.front()];
-
-      if (plane->AtomicSetState(*pset, layer, source_layers.front(),
-                                crtc->id()) != 0) {
+      DrmHwcLayer &layer = layers[source_layer];
+
+      const auto &region = comp_plane.region();
+      uint32_t crtc_id = comp_plane.crtc() != nullptr ? comp_plane.crtc()->id()
+                                                      : crtc->id();
+      ret = region ? plane->AtomicSetState(*pset, layer, region->source_crop,
+                                           region->display_frame,
+                                           source_layer, crtc_id)
+                   : plane->AtomicSetState(*pset, layer, source_layer,
+                                           crtc_id);
+      if (ret != 0) {
         return -EINVAL;
       }
     } else {
@@ -192,74 +426,334 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
     }
   }
 
+  /* The kernel only flips asynchronously when nothing but the buffer of
+   * the primary plane changes, everything else goes through a regular
+   * commit. Tiles have to flip together. */
+  std::optional<FlipState> flip_state;
+  if (!test_only)
+    flip_state = GetFlipState(display_comp);
+  bool async_flip = false;
+  if (display_comp->async_flip() && flip_state && flip_state == flip_state_ &&
+      !mode.blob_id && !power_up && !hdr_changed && !content_type_changed &&
+      tiles.empty()) {
+    if (async_flip_backoff_ == 0)
+      async_flip = true;
+    else
+      --async_flip_backoff_;
+  }
+
+  /* Shadow copies ran while the frame was planned, they have to be done
+   * before the kernel scans them out */
+  for (DrmHwcLayer &layer : layers) {
+    if (test_only || !layer.FbIdHandle)
+      continue;
+    ret = layer.FbIdHandle->WaitCopy();
+    if (ret) {
+      ALOGE("Failed to copy a layer into its shadow buffer ret=%d", ret);
+      return ret;
+    }
+  }
+
   if (!ret) {
-    uint32_t flags = DRM_MODE_ATOMIC_ALLOW_MODESET;
+    /* Plain frames must not trigger a modeset, let them fail instead */
+    uint32_t flags = 0;
+    /* Some drivers retrain the link to switch the HDR infoframe */
+    if ((mode.blob_id && !mode.seamless) || power_up || hdr_changed ||
+        content_type_changed)
+      flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
     if (test_only)
       flags |= DRM_MODE_ATOMIC_TEST_ONLY;
 
-    ret = drmModeAtomicCommit(drm->fd(), pset.get(), flags, drm);
+    if (async_flip) {
+      ret = CommitAsyncFlip(display_comp, *flip_state);
+      if (ret == 0) {
+        ++async_flips_;
+      } else {
+        ALOGV("Async flip refused ret=%d, committing with vblank", ret);
+        ++async_flip_failures_;
+        async_flip_backoff_ = kAsyncFlipBackoffFrames;
+      }
+    }
+
+    if (!async_flip || ret)
+      ret = drmModeAtomicCommit(drm->fd(), pset.get(), flags, drm);
+
+    /* The seamless change was tested against another frame. Left pending,
+     * it would fail every following frame as well. */
+    if (ret && !test_only && mode.blob_id && mode.seamless) {
+      if (mode.modeset_fallback || committed_mode_.id() == 0) {
+        ALOGW("Seamless switch to %s refused ret=%d, doing a full modeset",
+              mode.mode.name().c_str(), ret);
+        ret = drmModeAtomicCommit(drm->fd(), pset.get(),
+                                  flags | DRM_MODE_ATOMIC_ALLOW_MODESET, drm);
+      } else {
+        ALOGW("Seamless switch to %s refused ret=%d, keeping %s",
+              mode.mode.name().c_str(), ret, committed_mode_.name().c_str());
+        mode.mode = committed_mode_;
+        mode.blob_id = 0;
+        connector->set_active_mode(committed_mode_);
+        mode_commit_ = ModeCommit{false, GetTimeNs()};
+        return CommitFrame(display_comp, false, mode_state);
+      }
+    }
+
     if (ret) {
-      if (!test_only)
+      if (!test_only) {
         ALOGE("Failed to commit pset ret=%d\n", ret);
+        flip_state_.reset();
+      }
       return ret;
     }
   }
 
-  if (!test_only && mode_.blob) {
-    /* TODO: Add dpms to the pset when the kernel supports it */
-    ret = ApplyDpms(display_comp);
-    if (ret) {
-      ALOGE("Failed to apply DPMS after modeset %d\n", ret);
-      return ret;
+  if (!test_only)
+    flip_state_ = flip_state;
+
+  if (!test_only && mode.blob_id) {
+    connector->set_active_mode(mode.mode);
+    committed_mode_ = mode.mode;
+    mode_commit_ = ModeCommit{true, GetTimeNs()};
+    for (size_t i = 1; i < tiles.size(); ++i) {
+      const DrmMode *tile_mode = FindTileMode(*tiles[i].connector, mode.mode);
+      if (tile_mode != nullptr)
+        tiles[i].connector->set_active_mode(*tile_mode);
     }
+    mode.blob_id = 0;
+  }
+
+  if (!test_only && hdr_changed)
+    hdr_.active_blob_id = hdr_blob_id;
+
+  if (!test_only)
+    active_content_type_ = content_type;
+
+  /* A full frame flushes all pending front buffer damage */
+  if (!test_only)
+    front_buffer_damage_.clear();
+
+  if (!test_only && power_up) {
+    power_up_pending_ = false;
+    last_resume_latency_ns_ = GetTimeNs() - power_up_time_ns_;
+    ALOGI("Display %d resumed, first frame after %" PRId64 " us",
+          pipeline_->display, last_resume_latency_ns_ / 1000);
+  }
 
-    connector->set_active_mode(mode_.mode);
-    mode_.old_blob = std::move(mode_.blob);
+  /* TEST_ONLY commits don't create out fences */
+  if (!test_only && crtc->out_fence_ptr_property()) {
+    display_comp->out_fence_ = UniqueFd(out_fence);
   }
 
-  if (crtc->out_fence_ptr_property()) {
-    display_comp->out_fence_ = UniqueFd((int)out_fences[crtc->pipe()]);
+  /* The frame is done once every tile has flipped */
+  for (size_t i = 1; i < tiles.size() && !test_only; ++i) {
+    UniqueFd tile_fence(tile_out_fences_[i]);
+    if (!tile_fence)
+      continue;
+    if (!display_comp->out_fence_) {
+      display_comp->out_fence_ = std::move(tile_fence);
+      continue;
+    }
+    display_comp->out_fence_ = UniqueFd(
+        sync_merge("tiles", display_comp->out_fence_.Get(), tile_fence.Get()));
   }
 
   return ret;
 }
 
 int DrmDisplayCompositor::ApplyDpms(DrmDisplayComposition *display_comp) {
-  DrmDevice *drm = resource_manager_->GetDrmDevice(display_);
-  DrmConnector *conn = drm->GetConnectorForDisplay(display_);
-  if (!conn) {
-    ALOGE("Failed to get DrmConnector for display %d", display_);
-    return -ENODEV;
+  if (display_comp->dpms_mode() == DRM_MODE_DPMS_ON) {
+    if (active_)
+      return 0;
+
+    power_up_pending_ = true;
+    power_up_time_ns_ = GetTimeNs();
+    return 0;
   }
+  power_up_pending_ = false;
+
+  DrmDevice *drm = pipeline_->device;
+  DrmCrtc *crtc = pipeline_->crtc;
 
-  const DrmProperty &prop = conn->dpms_property();
-  int ret = drmModeConnectorSetProperty(drm->fd(), conn->id(), prop.id(),
-                                        display_comp->dpms_mode());
+  auto pset = MakeDrmModeAtomicReqUnique();
+  if (!pset) {
+    ALOGE("Failed to allocate property set");
+    return -ENOMEM;
+  }
+
+  /* Planes can't stay enabled on an inactive CRTC */
+  if (active_composition_) {
+    for (DrmCompositionPlane &comp_plane :
+         active_composition_->composition_planes()) {
+      if (comp_plane.plane()->AtomicDisablePlane(*pset) != 0)
+        return -EINVAL;
+    }
+  }
+
+  if (!crtc->active_property().AtomicSet(*pset, 0))
+    return -EINVAL;
+
+  for (size_t i = 1; i < pipeline_->tiles.size(); ++i) {
+    if (!pipeline_->tiles[i].crtc->active_property().AtomicSet(*pset, 0))
+      return -EINVAL;
+  }
+
+  int ret = drmModeAtomicCommit(drm->fd(), pset.get(),
+                                DRM_MODE_ATOMIC_ALLOW_MODESET, drm);
   if (ret) {
-    ALOGE("Failed to set DPMS property for connector %d", conn->id());
+    ALOGE("Failed to power off crtc %d ret=%d", crtc->id(), ret);
     return ret;
   }
+
+  flip_state_.reset();
+  active_composition_.reset();
   return 0;
 }
 
-auto DrmDisplayCompositor::CreateModeBlob(const DrmMode &mode)
-    -> DrmModeUserPropertyBlobUnique {
-  struct drm_mode_modeinfo drm_mode {};
-  mode.ToDrmModeModeInfo(&drm_mode);
+auto DrmDisplayCompositor::AtomicSetTile(drmModeAtomicReq &pset,
+                                         DrmDisplayComposition *display_comp,
+                                         const DrmDisplayPipeline::Tile &tile,
+                                         const ModeState &mode, bool power_up,
+                                         int32_t *out_fence) -> int {
+  DrmCrtc *crtc = tile.crtc;
+  if (crtc->out_fence_ptr_property() &&
+      !crtc->out_fence_ptr_property().AtomicSet(pset, (uint64_t)out_fence))
+    return -EINVAL;
+
+  if ((mode.blob_id || power_up) && !crtc->active_property().AtomicSet(pset, 1))
+    return -EINVAL;
 
-  DrmDevice *drm = resource_manager_->GetDrmDevice(display_);
-  return drm->RegisterUserPropertyBlob(&drm_mode,
-                                       sizeof(struct drm_mode_modeinfo));
+  if (mode.blob_id) {
+    const DrmMode *tile_mode = FindTileMode(*tile.connector, mode.mode);
+    if (tile_mode == nullptr) {
+      ALOGE("Connector %d has no mode for tile %s", tile.connector->id(),
+            mode.mode.name().c_str());
+      return -EINVAL;
+    }
+    uint32_t blob_id = tile.connector->GetModeBlob(*tile_mode);
+    if (blob_id == 0 || !crtc->mode_property().AtomicSet(pset, blob_id) ||
+        !tile.connector->crtc_id_property().AtomicSet(pset, crtc->id()))
+      return -EINVAL;
+  }
+
+  if (crtc->vrr_enabled_property() &&
+      !crtc->vrr_enabled_property().AtomicSet(pset,
+                                              display_comp->vrr_enabled()))
+    return -EINVAL;
+
+  return AtomicSetColorTransform(pset, display_comp, crtc);
+}
+
+/* The matrix is applied in linear light when the CRTC has both LUTs, to match
+ * client composition */
+auto DrmDisplayCompositor::AtomicSetColorTransform(
+    drmModeAtomicReq &pset, DrmDisplayComposition *display_comp, DrmCrtc *crtc)
+    -> int {
+  if (!crtc->ctm_property())
+    return display_comp->color_transform() ? -EINVAL : 0;
+
+  const auto &matrix = display_comp->color_transform();
+  if (!matrix) {
+    if (!crtc->ctm_property().AtomicSet(pset, 0) ||
+        (crtc->degamma_lut_property() &&
+         !crtc->degamma_lut_property().AtomicSet(pset, 0)) ||
+        (crtc->gamma_lut_property() &&
+         !crtc->gamma_lut_property().AtomicSet(pset, 0)))
+      return -EINVAL;
+    return 0;
+  }
+
+  DrmDevice *drm = pipeline_->device;
+  if (!color_.ctm_blob || color_.matrix != *matrix) {
+    struct drm_color_ctm ctm {};
+    for (int i = 0; i < 3; i++) {
+      for (int j = 0; j < 3; j++)
+        ctm.matrix[i * 3 + j] = ToS3132((*matrix)[j * 4 + i]);
+    }
+
+    color_.ctm_blob = drm->RegisterUserPropertyBlob(&ctm, sizeof(ctm));
+    if (!color_.ctm_blob)
+      return -EINVAL;
+    color_.matrix = *matrix;
+  }
+
+  if (!crtc->ctm_property().AtomicSet(pset, *color_.ctm_blob))
+    return -EINVAL;
+
+  if (!crtc->degamma_lut_property() || !crtc->gamma_lut_property())
+    return 0;
+
+  /* Without the LUTs the matrix would apply in gamma space and colors
+   * would differ from client composition, the layers go to the client */
+  if (color_.lut_failed)
+    return -EINVAL;
+
+  if (!color_.degamma_lut_blob)
+    color_.degamma_lut_blob = CreateLutBlob(drm,
+                                            crtc->degamma_lut_size_property(),
+                                            true);
+  if (!color_.gamma_lut_blob)
+    color_.gamma_lut_blob = CreateLutBlob(drm, crtc->gamma_lut_size_property(),
+                                          false);
+  if (!color_.degamma_lut_blob || !color_.gamma_lut_blob) {
+    ALOGE("Failed to create the LUTs for the color transform of crtc %d",
+          crtc->id());
+    color_.lut_failed = true;
+    return -EINVAL;
+  }
+
+  if (!crtc->degamma_lut_property().AtomicSet(pset,
+                                              *color_.degamma_lut_blob) ||
+      !crtc->gamma_lut_property().AtomicSet(pset, *color_.gamma_lut_blob))
+    return -EINVAL;
+
+  return 0;
+}
+
+auto DrmDisplayCompositor::AtomicSetHdrOutputMetadata(
+    drmModeAtomicReq &pset, DrmDisplayComposition *display_comp,
+    DrmConnector *connector, uint32_t *blob_id) -> int {
+  const DrmProperty &property = connector->hdr_output_metadata_property();
+  DrmHwcTransfer transfer = display_comp->hdr_transfer();
+  if (!property)
+    return transfer != DrmHwcTransfer::kUndefined ? -EINVAL : 0;
+
+  *blob_id = 0;
+  if (transfer != DrmHwcTransfer::kUndefined) {
+    hdr_output_metadata metadata =
+        ToHdrOutputMetadata(transfer, display_comp->hdr_metadata());
+    if (!hdr_.blob ||
+        memcmp(&metadata, &hdr_.metadata, sizeof(metadata)) != 0) {
+      DrmDevice *drm = pipeline_->device;
+      hdr_.blob = drm->RegisterUserPropertyBlob(&metadata, sizeof(metadata));
+      if (!hdr_.blob)
+        return -EINVAL;
+      hdr_.metadata = metadata;
+    }
+    *blob_id = *hdr_.blob;
+  }
+
+  if (!property.AtomicSet(pset, *blob_id))
+    return -EINVAL;
+
+  return 0;
+}
+
+uint32_t DrmDisplayCompositor::GetModeBlob(const DrmMode &mode) {
+  return pipeline_->connector->GetModeBlob(mode);
 }
 
 void DrmDisplayCompositor::ClearDisplay() {
+  const std::lock_guard<std::mutex> lock(lock_);
+  ClearActiveComposition();
+}
+
+void DrmDisplayCompositor::ClearActiveComposition() {
   if (!active_composition_)
     return;
 
   if (DisablePlanes(active_composition_.get()))
     return;
 
-  active_composition_.reset(nullptr);
+  ReturnToPool(std::move(active_composition_));
 }
 
 void DrmDisplayCompositor::ApplyFrame(
@@ -271,18 +765,21 @@ void DrmDisplayCompositor::ApplyFrame(
   }
 
   if (ret) {
-    ALOGE("Composite failed for display %d", display_);
+    ALOGE("Composite failed for display %d", pipeline_->display);
     // Disable the hw used by the last active composition. This allows us to
     // signal the release fences from that composition to avoid hanging.
-    ClearDisplay();
+    ClearActiveComposition();
+    ReturnToPool(std::move(composition));
     return;
   }
 
   active_composition_.swap(composition);
+  ReturnToPool(std::move(composition));
 }
 
 int DrmDisplayCompositor::ApplyComposition(
     std::unique_ptr<DrmDisplayComposition> composition) {
+  const std::lock_guard<std::mutex> lock(lock_);
   int ret = 0;
   switch (composition->type()) {
     case DRM_COMPOSITION_TYPE_FRAME:
@@ -291,7 +788,8 @@ int DrmDisplayCompositor::ApplyComposition(
         // is just a test, it won't actually commit the frame.
         ret = CommitFrame(composition.get(), true);
         if (ret) {
-          ALOGE("Commit test failed for display %d, FIXME", display_);
+          ALOGE("Commit test failed for display %d, FIXME",
+                pipeline_->display);
           return ret;
         }
       }
@@ -299,16 +797,21 @@ int DrmDisplayCompositor::ApplyComposition(
       ApplyFrame(std::move(composition), ret);
       break;
     case DRM_COMPOSITION_TYPE_DPMS:
-      active_ = (composition->dpms_mode() == DRM_MODE_DPMS_ON);
       ret = ApplyDpms(composition.get());
-      if (ret)
-        ALOGE("Failed to apply dpms for display %d", display_);
-      return ret;
+      if (ret) {
+        ALOGE("Failed to apply dpms for display %d", pipeline_->display);
+        return ret;
+      }
+      active_ = (composition->dpms_mode() == DRM_MODE_DPMS_ON);
+      return 0;
     case DRM_COMPOSITION_TYPE_MODESET:
       mode_.mode = composition->display_mode();
-      mode_.blob = CreateModeBlob(mode_.mode);
-      if (!mode_.blob) {
-        ALOGE("Failed to create mode blob for display %d", display_);
+      mode_.seamless = composition->seamless_modeset();
+      mode_.modeset_fallback = composition->modeset_fallback();
+      mode_.blob_id = GetModeBlob(mode_.mode);
+      if (!mode_.blob_id) {
+        ALOGE("Failed to create mode blob for display %d",
+              pipeline_->display);
         return -EINVAL;
       }
       return 0;
@@ -321,7 +824,166 @@ int DrmDisplayCompositor::ApplyComposition(
 }
 
 int DrmDisplayCompositor::TestComposition(DrmDisplayComposition *composition) {
+  const std::lock_guard<std::mutex> lock(lock_);
   return CommitFrame(composition, true);
 }
 
+/* Checks whether the driver can switch the currently scanned out frame to
+ * the given mode without a full modeset */
+int DrmDisplayCompositor::TestSeamlessModeset(const DrmMode &mode) {
+  const std::lock_guard<std::mutex> lock(lock_);
+  if (!active_ || !active_composition_)
+    return -EINVAL;
+
+  ModeState mode_state;
+  mode_state.mode = mode;
+  mode_state.seamless = true;
+  mode_state.blob_id = GetModeBlob(mode);
+  if (!mode_state.blob_id)
+    return -EINVAL;
+
+  return CommitFrame(active_composition_.get(), true, &mode_state);
+}
+
+auto DrmDisplayCompositor::CommitSidebandFrame() -> int {
+  const std::lock_guard<std::mutex> lock(lock_);
+  if (!active_composition_)
+    return -ENOENT;
+
+  /* Pending power and mode changes go out with the next regular frame */
+  if (!active_ || sideband_suspended_ || power_up_pending_ ||
+      mode_.blob_id != 0)
+    return -EBUSY;
+
+  /* Scanned out framebuffers stay referenced until the new commit */
+  std::vector<std::shared_ptr<DrmFbIdHandle>> prev_fbs;
+  DrmDevice *drm = pipeline_->device;
+  bool has_sideband = false;
+  for (DrmHwcLayer &layer : active_composition_->layers()) {
+    if (layer.sideband_stream == nullptr)
+      continue;
+
+    has_sideband = true;
+    hwc_drm_bo_t prev_info = layer.buffer_info;
+    prev_fbs.emplace_back(layer.FbIdHandle);
+    if (layer.ImportBuffer(drm) != 0) {
+      /* Keep scanning out the last frame */
+      layer.buffer_info = prev_info;
+      layer.FbIdHandle = prev_fbs.back();
+    }
+  }
+  if (!has_sideband)
+    return -ENOENT;
+
+  int ret = CommitFrame(active_composition_.get(), false);
+  if (ret)
+    ALOGE("Failed to commit sideband frame for display %d",
+          pipeline_->display);
+
+  return ret;
+}
+
+auto DrmDisplayCompositor::FlushFrontBuffer(
+    buffer_handle_t buffer, const std::vector<hwc_rect_t> &damage) -> int {
+  const std::lock_guard<std::mutex> lock(lock_);
+  if (!active_composition_)
+    return -ENOENT;
+
+  /* A layer split across planes is flushed on all of them */
+  DrmHwcLayer *layer = nullptr;
+  std::vector<DrmPlane *> planes;
+  std::vector<DrmHwcLayer> &layers = active_composition_->layers();
+  for (DrmCompositionPlane &comp_plane :
+       active_composition_->composition_planes()) {
+    size_t source_layer = comp_plane.source_layer();
+    if (comp_plane.type() != DrmCompositionPlane::Type::kDisable &&
+        source_layer < layers.size() &&
+        layers[source_layer].sf_handle == buffer) {
+      layer = &layers[source_layer];
+      planes.push_back(comp_plane.plane());
+    }
+  }
+  if (layer == nullptr)
+    return -ENOENT;
+
+  front_buffer_damage_.insert(front_buffer_damage_.end(), damage.begin(),
+                              damage.end());
+  if (front_buffer_damage_.size() > kMaxFrontBufferDamage) {
+    hwc_rect_t bounds = front_buffer_damage_[0];
+    for (const hwc_rect_t &rect : front_buffer_damage_) {
+      bounds.left = std::min(bounds.left, rect.left);
+      bounds.top = std::min(bounds.top, rect.top);
+      bounds.right = std::max(bounds.right, rect.right);
+      bounds.bottom = std::max(bounds.bottom, rect.bottom);
+    }
+    front_buffer_damage_.assign(1, bounds);
+  }
+
+  /* Pending power and mode changes go out with the next regular frame */
+  if (!active_ || power_up_pending_ || mode_.blob_id != 0)
+    return -EBUSY;
+
+  /* Served from the framebuffer cache, shadow buffers are copied again */
+  DrmDevice *drm = pipeline_->device;
+  std::shared_ptr<DrmFbIdHandle> prev_fb = layer->FbIdHandle;
+  hwc_drm_bo_t prev_info = layer->buffer_info;
+  if (layer->ImportBuffer(drm) != 0) {
+    layer->buffer_info = prev_info;
+    layer->FbIdHandle = prev_fb;
+  }
+  uint32_t fb_id = layer->FbIdHandle->GetFbId();
+
+  int ret = 0;
+  bool damage_clips = std::all_of(planes.begin(), planes.end(),
+                                  [](DrmPlane *plane) {
+                                    return plane->HasDamageClips();
+                                  });
+  if (damage_clips) {
+    std::vector<drm_mode_rect> clips;
+    clips.reserve(front_buffer_damage_.size());
+    for (const hwc_rect_t &rect : front_buffer_damage_)
+      clips.push_back({rect.left, rect.top, rect.right, rect.bottom});
+    auto blob = drm->RegisterUserPropertyBlob(clips.data(),
+                                              clips.size() *
+                                                  sizeof(drm_mode_rect));
+    auto pset = MakeDrmModeAtomicReqUnique();
+    if (!blob || !pset)
+      return -ENOMEM;
+
+    for (DrmPlane *plane : planes) {
+      ret = plane->AtomicSetDamage(*pset, fb_id, *blob);
+      if (ret)
+        return ret;
+    }
+
+    /* A flush still waiting for vblank makes this one fail with -EBUSY,
+     * flipping asynchronously gets more than one flush into a frame */
+    uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK;
+    if (drm->HasAtomicAsyncPageFlipSupport()) {
+      ret = drmModeAtomicCommit(drm->fd(), pset.get(),
+                                flags | DRM_MODE_PAGE_FLIP_ASYNC, drm);
+    }
+    if (!drm->HasAtomicAsyncPageFlipSupport() || (ret && ret != -EBUSY))
+      ret = drmModeAtomicCommit(drm->fd(), pset.get(), flags, drm);
+  } else {
+    std::vector<drmModeClip> clips;
+    clips.reserve(front_buffer_damage_.size());
+    for (const hwc_rect_t &rect : front_buffer_damage_)
+      clips.push_back({uint16_t(rect.left), uint16_t(rect.top),
+                       uint16_t(rect.right), uint16_t(rect.bottom)});
+    ret = drmModeDirtyFB(drm->fd(), fb_id, clips.data(), clips.size());
+    /* Drivers that scan out continuously don't need the flush */
+    if (ret == -ENOSYS)
+      ret = 0;
+  }
+
+  if (ret == 0)
+    front_buffer_damage_.clear();
+  else if (ret != -EBUSY)
+    ALOGE("Failed to flush front buffer damage for display %d ret=%d",
+          pipeline_->display, ret);
+
+  return ret;
+}
+
 }  // namespace android
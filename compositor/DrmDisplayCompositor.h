@@ -23,12 +23,16 @@
 
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <sstream>
 #include <tuple>
+#include <utility>
 
 #include "DrmDisplayComposition.h"
 #include "Planner.h"
-#include "drm/ResourceManager.h"
+#include "drm/DrmDisplayPipeline.h"
+#include "drm/DrmUnique.h"
 #include "drm/VSyncWorker.h"
 #include "drmhwcomposer.h"
 
@@ -39,14 +43,41 @@ class DrmDisplayCompositor {
   DrmDisplayCompositor();
   ~DrmDisplayCompositor();
 
-  auto Init(ResourceManager *resource_manager, int display) -> int;
+  auto Init(DrmDisplayPipeline *pipeline) -> int;
 
   std::unique_ptr<DrmDisplayComposition> CreateInitializedComposition() const;
+  /* Frame compositions are recycled to keep presents free of allocations */
+  auto AcquireComposition(DrmCrtc *crtc, Planner *planner)
+      -> std::unique_ptr<DrmDisplayComposition>;
+  void RecycleComposition(std::unique_ptr<DrmDisplayComposition> composition);
   int ApplyComposition(std::unique_ptr<DrmDisplayComposition> composition);
   int TestComposition(DrmDisplayComposition *composition);
+  int TestSeamlessModeset(const DrmMode &mode);
   int Composite();
   void ClearDisplay();
+  /* Re-commits the active composition with the latest sideband stream
+   * frames, -ENOENT if no sideband layer is on screen */
+  auto CommitSidebandFrame() -> int;
+  /* Rebinds the pipeline between commits. Planning against the pipeline
+   * has to be held off by the caller. */
+  auto RebindPipeline() -> int {
+    const std::lock_guard<std::mutex> lock(lock_);
+    flip_state_.reset();
+    return pipeline_->Rebind();
+  }
+  /* Sideband frames wait for the next present while the display must not
+   * be touched, e.g. in DozeSuspend */
+  void SetSidebandCommitsSuspended(bool suspended) {
+    const std::lock_guard<std::mutex> lock(lock_);
+    sideband_suspended_ = suspended;
+  }
+  /* Flushes the damaged rects of a buffer the producer keeps drawing into
+   * while it is scanned out, without a new frame. -ENOENT if the buffer
+   * isn't on a plane, -EBUSY if the damage has to wait for the next flush */
+  auto FlushFrontBuffer(buffer_handle_t buffer,
+                        const std::vector<hwc_rect_t> &damage) -> int;
   UniqueFd TakeOutFence() {
+    const std::lock_guard<std::mutex> lock(lock_);
     if (!active_composition_) {
       return UniqueFd();
     }
@@ -55,34 +86,161 @@ class DrmDisplayCompositor {
 
   std::tuple<uint32_t, uint32_t, int> GetActiveModeResolution();
 
+  /* Planes on a CRTC that is off fail every test commit, so tests only
+   * tell what the display supports while this is true */
+  bool IsScanningOut() {
+    const std::lock_guard<std::mutex> lock(lock_);
+    return active_composition_ != nullptr || power_up_pending_;
+  }
+
+  /* Outcome of the last mode change committed with a frame */
+  struct ModeCommit {
+    bool applied;
+    int64_t time_ns;
+  };
+  auto TakeModeCommit() -> std::optional<ModeCommit> {
+    const std::lock_guard<std::mutex> lock(lock_);
+    return std::exchange(mode_commit_, std::nullopt);
+  }
+
+  /* Time from the power-up request to the completion of the first frame
+   * commit, -1 until the display has been resumed once */
+  int64_t last_resume_latency_ns() const {
+    return last_resume_latency_ns_;
+  }
+
+  /* Frames committed without waiting for vblank, and asynchronous commits
+   * the kernel refused */
+  std::pair<uint32_t, uint32_t> async_flip_stats() const {
+    return {async_flips_, async_flip_failures_};
+  }
+
  private:
   struct ModeState {
     DrmMode mode;
-    DrmModeUserPropertyBlobUnique blob;
-    DrmModeUserPropertyBlobUnique old_blob;
+    /* Pending MODE_ID blob, owned by the connector's blob cache */
+    uint32_t blob_id = 0;
+    /* Mode change must be committed without ALLOW_MODESET */
+    bool seamless = false;
+    /* A refused seamless change is retried as a full modeset, otherwise
+     * the current mode is kept */
+    bool modeset_fallback = false;
   };
 
   DrmDisplayCompositor(const DrmDisplayCompositor &) = delete;
 
-  int CommitFrame(DrmDisplayComposition *display_comp, bool test_only);
+  int CommitFrame(DrmDisplayComposition *display_comp, bool test_only,
+                  ModeState *mode_state = nullptr);
   int ApplyDpms(DrmDisplayComposition *display_comp);
   int DisablePlanes(DrmDisplayComposition *display_comp);
 
   void ApplyFrame(std::unique_ptr<DrmDisplayComposition> composition,
                   int status);
-
-  auto CreateModeBlob(const DrmMode &mode) -> DrmModeUserPropertyBlobUnique;
-
-  ResourceManager *resource_manager_;
-  int display_;
+  void ClearActiveComposition();
+  void ReturnToPool(std::unique_ptr<DrmDisplayComposition> composition);
+
+  uint32_t GetModeBlob(const DrmMode &mode);
+
+  /* Everything an asynchronous flip keeps from the last full commit: a
+   * single layer on the primary plane and the CRTC state around it */
+  struct FlipState {
+    DrmPlane *plane;
+    size_t source_layer;
+    hwc_frect_t source_crop;
+    hwc_rect_t display_frame;
+    DrmHwcTransform transform;
+    DrmHwcBlending blending;
+    uint16_t alpha;
+    DrmHwcColorSpace color_space;
+    DrmHwcSampleRange sample_range;
+    bool vrr_enabled;
+    std::optional<ColorTransformMatrix> color_transform;
+
+    bool operator==(const FlipState &other) const;
+  };
+  static auto GetFlipState(DrmDisplayComposition *display_comp)
+      -> std::optional<FlipState>;
+  auto CommitAsyncFlip(DrmDisplayComposition *display_comp,
+                       const FlipState &flip_state) -> int;
+
+  auto AtomicSetColorTransform(drmModeAtomicReq &pset,
+                               DrmDisplayComposition *display_comp,
+                               DrmCrtc *crtc) -> int;
+  /* Sets the CRTC and connector state of a tile other than the first one */
+  auto AtomicSetTile(drmModeAtomicReq &pset,
+                     DrmDisplayComposition *display_comp,
+                     const DrmDisplayPipeline::Tile &tile,
+                     const ModeState &mode, bool power_up, int32_t *out_fence)
+      -> int;
+  auto AtomicSetHdrOutputMetadata(drmModeAtomicReq &pset,
+                                  DrmDisplayComposition *display_comp,
+                                  DrmConnector *connector, uint32_t *blob_id)
+      -> int;
+
+  DrmDisplayPipeline *pipeline_;
+
+  /* Sideband frames are committed from the stream provider's thread */
+  std::mutex lock_;
 
   std::unique_ptr<DrmDisplayComposition> active_composition_;
+  std::vector<std::unique_ptr<DrmDisplayComposition>> composition_pool_;
+
+  /* Rewound with drmModeAtomicSetCursor() for every frame */
+  DrmModeAtomicReqUnique pset_;
+  /* Written by the kernel for each tile but the first */
+  std::vector<int32_t> tile_out_fences_;
 
   bool initialized_;
   bool active_;
   bool use_hw_overlays_;
+  bool sideband_suspended_ = false;
 
   ModeState mode_;
+  /* Mode of the last committed change, kept when a seamless one fails */
+  DrmMode committed_mode_;
+  std::optional<ModeCommit> mode_commit_;
+
+  /* The CTM blob is only re-created when the matrix changes, the LUT blobs
+   * are created once. If that fails, they aren't tried again. */
+  struct ColorState {
+    ColorTransformMatrix matrix{};
+    DrmModeUserPropertyBlobUnique ctm_blob;
+    DrmModeUserPropertyBlobUnique degamma_lut_blob;
+    DrmModeUserPropertyBlobUnique gamma_lut_blob;
+    bool lut_failed = false;
+  };
+  ColorState color_;
+
+  /* The infoframe blob is only re-created when the metadata changes */
+  struct HdrState {
+    hdr_output_metadata metadata;
+    DrmModeUserPropertyBlobUnique blob;
+    uint32_t active_blob_id = 0;
+  };
+  HdrState hdr_{};
+
+  /* Unset until the first frame, which writes the property */
+  std::optional<DrmHwcContentType> active_content_type_;
+
+  /* Power-up is committed together with the first frame after DPMS on */
+  bool power_up_pending_ = false;
+  int64_t power_up_time_ns_ = 0;
+  int64_t last_resume_latency_ns_ = -1;
+
+  /* Frames committed with vblank after a refused asynchronous commit, before
+   * the next asynchronous one is tried */
+  static constexpr uint32_t kAsyncFlipBackoffFrames = 120;
+  uint32_t async_flip_backoff_ = 0;
+  uint32_t async_flips_ = 0;
+  uint32_t async_flip_failures_ = 0;
+  /* Unset when the last full commit can't be flipped asynchronously */
+  std::optional<FlipState> flip_state_;
+  DrmModeAtomicReqUnique flip_pset_;
+
+  /* Damage of front buffer flushes that didn't get through yet, collapsed
+   * to its bounding rect beyond kMaxFrontBufferDamage rects */
+  static constexpr size_t kMaxFrontBufferDamage = 16;
+  std::vector<hwc_rect_t> front_buffer_damage_;
 
   std::unique_ptr<Planner> planner_;
 };
@@ -19,7 +19,10 @@
 #include "Planner.h"
 
 #include <algorithm>
+#include <array>
+#include <cmath>
 
+#include "bufferinfo/BufferInfoGetter.h"
 #include "drm/DrmDevice.h"
 #include "utils/log.h"
 
@@ -27,50 +30,54 @@ namespace android {
 
 std::unique_ptr<Planner> Planner::CreateInstance(DrmDevice * /*device*/) {
   std::unique_ptr<Planner> planner(new Planner);
+  planner->AddStage<PlanStageSplit>();
+  planner->AddStage<PlanStageVideo>();
   planner->AddStage<PlanStageGreedy>();
   return planner;
 }
 
-std::vector<DrmPlane *> Planner::GetUsablePlanes(
-    DrmCrtc *crtc, std::vector<DrmPlane *> *primary_planes,
-    std::vector<DrmPlane *> *overlay_planes) {
-  std::vector<DrmPlane *> usable_planes;
+void Planner::GetUsablePlanes(DrmCrtc *crtc,
+                              std::vector<DrmPlane *> *primary_planes,
+                              std::vector<DrmPlane *> *overlay_planes) {
+  usable_planes_.clear();
   std::copy_if(primary_planes->begin(), primary_planes->end(),
-               std::back_inserter(usable_planes),
+               std::back_inserter(usable_planes_),
                [=](DrmPlane *plane) { return plane->GetCrtcSupported(*crtc); });
   std::copy_if(overlay_planes->begin(), overlay_planes->end(),
-               std::back_inserter(usable_planes),
+               std::back_inserter(usable_planes_),
                [=](DrmPlane *plane) { return plane->GetCrtcSupported(*crtc); });
-  return usable_planes;
 }
 
-std::tuple<int, std::vector<DrmCompositionPlane>> Planner::ProvisionPlanes(
-    std::map<size_t, DrmHwcLayer *> &layers, DrmCrtc *crtc,
-    std::vector<DrmPlane *> *primary_planes,
-    std::vector<DrmPlane *> *overlay_planes) {
-  std::vector<DrmCompositionPlane> composition;
-  std::vector<DrmPlane *> planes = GetUsablePlanes(crtc, primary_planes,
-                                                   overlay_planes);
-  if (planes.empty()) {
+int Planner::ProvisionPlanes(PlanLayers &layers, DrmCrtc *crtc,
+                             std::vector<DrmPlane *> *primary_planes,
+                             std::vector<DrmPlane *> *overlay_planes,
+                             std::vector<DrmCompositionPlane> *composition) {
+  composition->clear();
+  if (tiles_ != nullptr && !tiles_->empty())
+    return ProvisionTiles(layers, primary_planes, overlay_planes, composition);
+
+  GetUsablePlanes(crtc, primary_planes, overlay_planes);
+  if (usable_planes_.empty()) {
     ALOGE("Display %d has no usable planes", crtc->display());
-    return std::make_tuple(-ENODEV, std::vector<DrmCompositionPlane>());
+    return -ENODEV;
   }
 
   // Go through the provisioning stages and provision planes
   for (auto &i : stages_) {
-    int ret = i->ProvisionPlanes(&composition, layers, &planes);
+    int ret = i->ProvisionPlanes(composition, layers, &usable_planes_);
     if (ret) {
       ALOGV("Failed provision stage with ret %d", ret);
-      return std::make_tuple(ret, std::vector<DrmCompositionPlane>());
+      composition->clear();
+      return ret;
     }
   }
 
-  return std::make_tuple(0, std::move(composition));
+  return 0;
 }
 
 int PlanStageProtected::ProvisionPlanes(
     std::vector<DrmCompositionPlane> *composition,
-    std::map<size_t, DrmHwcLayer *> &layers,
+    PlanLayers &layers,
     std::vector<DrmPlane *> *planes) {
   int ret = 0;
   for (auto i = layers.begin(); i != layers.end();) {
@@ -92,9 +99,279 @@ int PlanStageProtected::ProvisionPlanes(
   return 0;
 }
 
+static bool NeedsScaling(const DrmHwcLayer &layer) {
+  float src_w = layer.source_crop.right - layer.source_crop.left;
+  float src_h = layer.source_crop.bottom - layer.source_crop.top;
+  auto dst_w = float(layer.display_frame.right - layer.display_frame.left);
+  auto dst_h = float(layer.display_frame.bottom - layer.display_frame.top);
+  if (layer.transform & (DrmHwcTransform::kRotate90 |
+                         DrmHwcTransform::kRotate270))
+    std::swap(dst_w, dst_h);
+  return src_w != dst_w || src_h != dst_h;
+}
+
+/* KMS doesn't expose scaling support, but scalers usually sit in the
+ * YUV-capable pipes, so scaled layers are placed like video */
+static bool NeedsCapablePlane(const DrmHwcLayer &layer) {
+  return layer.sideband_stream != nullptr ||
+         !BufferInfoGetter::IsDrmFormatRgb(layer.buffer_info.format) ||
+         layer.transform != DrmHwcTransform::kIdentity || NeedsScaling(layer);
+}
+
+static int PlaneCost(const DrmPlane &plane) {
+  return (plane.HasNonRgbFormat() ? 2 : 0) + (plane.HasRotation() ? 1 : 0);
+}
+
+static uint32_t LayerWidth(const hwc_frect_t &source_crop,
+                           const hwc_rect_t &display_frame) {
+  auto src_w = uint32_t(source_crop.right - source_crop.left);
+  auto dst_w = uint32_t(display_frame.right - display_frame.left);
+  return std::max(src_w, dst_w);
+}
+
+/* Splits at an even source column, whole pixels since SRC_X is set without
+ * the fraction and even for subsampled chroma */
+static bool SplitLayer(const DrmHwcLayer &layer,
+                       DrmCompositionPlane::Region *left,
+                       DrmCompositionPlane::Region *right) {
+  const hwc_frect_t &crop = layer.source_crop;
+  const hwc_rect_t &df = layer.display_frame;
+  float src_w = crop.right - crop.left;
+  int dst_w = df.right - df.left;
+  auto src_split = float(int(crop.left + src_w / 2) & ~1);
+  if (src_split <= crop.left || src_split >= crop.right)
+    return false;
+  int dst_split = df.left + int(std::lround((src_split - crop.left) * dst_w /
+                                            src_w));
+  if (dst_split <= df.left || dst_split >= df.right)
+    return false;
+
+  *left = {{crop.left, crop.top, src_split, crop.bottom},
+           {df.left, df.top, dst_split, df.bottom}};
+  *right = {{src_split, crop.top, crop.right, crop.bottom},
+            {dst_split, df.top, df.right, df.bottom}};
+  return true;
+}
+
+/* Returns the part of the layer on the tile, in tile coordinates. -ENOENT
+ * if the layer is off the tile, -EINVAL if a transformed layer would have to
+ * be cut. */
+static int ClipToTile(const DrmHwcLayer &layer,
+                      const DrmDisplayPipeline::Tile &tile,
+                      DrmCompositionPlane::Region *part) {
+  const hwc_frect_t &crop = layer.source_crop;
+  const hwc_rect_t &df = layer.display_frame;
+  int left = std::max(df.left, tile.x);
+  int top = std::max(df.top, tile.y);
+  int right = std::min(df.right, tile.x + tile.width);
+  int bottom = std::min(df.bottom, tile.y + tile.height);
+  if (left >= right || top >= bottom)
+    return -ENOENT;
+
+  part->display_frame = {left - tile.x, top - tile.y, right - tile.x,
+                         bottom - tile.y};
+  if (left == df.left && top == df.top && right == df.right &&
+      bottom == df.bottom) {
+    part->source_crop = crop;
+    return 0;
+  }
+  if (layer.transform != DrmHwcTransform::kIdentity)
+    return -EINVAL;
+
+  float scale_x = (crop.right - crop.left) / float(df.right - df.left);
+  float scale_y = (crop.bottom - crop.top) / float(df.bottom - df.top);
+  part->source_crop = {crop.left + float(left - df.left) * scale_x,
+                       crop.top + float(top - df.top) * scale_y,
+                       crop.left + float(right - df.left) * scale_x,
+                       crop.top + float(bottom - df.top) * scale_y};
+  return 0;
+}
+
+/* Layers crossing tile borders are cut into one part per tile. Each tile
+ * only has a few planes, so parts are placed greedily in z-order. */
+int Planner::ProvisionTiles(PlanLayers &layers,
+                            std::vector<DrmPlane *> *primary_planes,
+                            std::vector<DrmPlane *> *overlay_planes,
+                            std::vector<DrmCompositionPlane> *composition) {
+  for (const DrmDisplayPipeline::Tile &tile : *tiles_) {
+    usable_planes_.clear();
+    for (DrmPlane *plane : tile.planes) {
+      auto *pool = plane->type() == DRM_PLANE_TYPE_PRIMARY ? primary_planes
+                                                           : overlay_planes;
+      if (std::find(pool->begin(), pool->end(), plane) != pool->end())
+        usable_planes_.push_back(plane);
+    }
+    std::stable_partition(usable_planes_.begin(), usable_planes_.end(),
+                          [](DrmPlane *plane) {
+                            return plane->type() == DRM_PLANE_TYPE_PRIMARY;
+                          });
+
+    for (auto &[z, layer] : layers) {
+      DrmCompositionPlane::Region part{};
+      int ret = ClipToTile(*layer, tile, &part);
+      if (ret == -ENOENT)
+        continue;
+      if (ret) {
+        ALOGV("Layer %zu can't be cut at the tile border", z);
+        composition->clear();
+        return ret;
+      }
+
+      uint32_t width = LayerWidth(part.source_crop, part.display_frame);
+      auto it = usable_planes_.begin();
+      while (it != usable_planes_.end() &&
+             !(*it)->IsValidForLayerPart(layer, width)) {
+        /* Like in Emplace(), planes below can't take upper layers */
+        if ((*it)->zpos_property().is_immutable())
+          it = usable_planes_.erase(it);
+        else
+          ++it;
+      }
+      if (it == usable_planes_.end()) {
+        ALOGV("No plane for layer %zu on tile at %d,%d", z, tile.x, tile.y);
+        composition->clear();
+        return -ENOENT;
+      }
+
+      composition->emplace_back(DrmCompositionPlane::Type::kLayer, *it, z);
+      composition->back().set_region(part);
+      composition->back().set_crtc(tile.crtc);
+      usable_planes_.erase(it);
+    }
+  }
+
+  layers.clear();
+  return 0;
+}
+
+int PlanStageSplit::ProvisionPlanes(
+    std::vector<DrmCompositionPlane> *composition,
+    PlanLayers &layers,
+    std::vector<DrmPlane *> *planes) {
+  /* Like for video, the bottom layer needs the primary plane for its left
+   * half, everything else overlays that can be stacked freely */
+  auto usable = [bottom_z = layers.empty() ? 0 : layers.begin()->first](
+                    size_t z, DrmPlane *plane, bool first_half) {
+    if (z == bottom_z && first_half)
+      return plane->type() == DRM_PLANE_TYPE_PRIMARY;
+    return plane->type() == DRM_PLANE_TYPE_OVERLAY && plane->zpos_property() &&
+           !plane->zpos_property().is_immutable();
+  };
+
+  for (auto it = layers.begin(); it != layers.end();) {
+    auto [z, layer] = *it;
+    uint32_t width = LayerWidth(layer->source_crop, layer->display_frame);
+    bool fits = std::any_of(planes->begin(), planes->end(),
+                            [width](DrmPlane *plane) {
+                              return plane->max_width() == 0 ||
+                                     width <= plane->max_width();
+                            });
+    DrmCompositionPlane::Region halves[2];
+    if (fits || layer->transform != DrmHwcTransform::kIdentity ||
+        !SplitLayer(*layer, &halves[0], &halves[1])) {
+      ++it;
+      continue;
+    }
+
+    std::array<std::vector<DrmPlane *>::iterator, 2> best;
+    best.fill(planes->end());
+    for (int half = 0; half < 2; ++half) {
+      uint32_t half_width = LayerWidth(halves[half].source_crop,
+                                       halves[half].display_frame);
+      for (auto p = planes->begin(); p != planes->end(); ++p) {
+        if (p == best[0] || !usable(z, *p, half == 0) ||
+            !(*p)->IsValidForLayerPart(layer, half_width))
+          continue;
+        if (best[half] == planes->end() ||
+            PlaneCost(**p) < PlaneCost(**best[half]))
+          best[half] = p;
+      }
+      if (best[half] == planes->end())
+        break;
+    }
+    if (best[0] == planes->end() || best[1] == planes->end()) {
+      ++it;
+      continue;
+    }
+
+    for (int half = 0; half < 2; ++half) {
+      composition->emplace_back(DrmCompositionPlane::Type::kLayer, *best[half],
+                                z);
+      composition->back().set_region(halves[half]);
+    }
+    /* Erase the later iterator first to keep the other one valid */
+    if (best[0] < best[1])
+      std::swap(best[0], best[1]);
+    planes->erase(best[0]);
+    planes->erase(best[1]);
+    it = layers.erase(it);
+  }
+
+  return 0;
+}
+
+int PlanStageVideo::ProvisionPlanes(
+    std::vector<DrmCompositionPlane> *composition,
+    PlanLayers &layers,
+    std::vector<DrmPlane *> *planes) {
+  candidates_.clear();
+  for (auto &[z, layer] : layers) {
+    if (NeedsCapablePlane(*layer))
+      candidates_.emplace_back(z, layer);
+  }
+  if (candidates_.empty())
+    return 0;
+
+  auto area = [](const DrmHwcLayer *layer) {
+    const hwc_rect_t &df = layer->display_frame;
+    return int64_t(df.right - df.left) * (df.bottom - df.top);
+  };
+  /* Ties keep z-order, std::stable_sort would need a temporary buffer */
+  std::sort(candidates_.begin(), candidates_.end(),
+            [&](const auto &a, const auto &b) {
+              /* Sideband streams have no client fallback */
+              bool a_sideband = a.second->sideband_stream != nullptr;
+              bool b_sideband = b.second->sideband_stream != nullptr;
+              if (a_sideband != b_sideband)
+                return a_sideband;
+              if (area(a.second) != area(b.second))
+                return area(a.second) > area(b.second);
+              return a.first < b.first;
+            });
+
+  /* The bottom layer may only take the primary plane, other layers only
+   * overlays that can be stacked freely */
+  auto usable = [bottom_z = layers.begin()->first](size_t z, DrmPlane *plane) {
+    if (z == bottom_z)
+      return plane->type() == DRM_PLANE_TYPE_PRIMARY;
+    return plane->type() == DRM_PLANE_TYPE_OVERLAY && plane->zpos_property() &&
+           !plane->zpos_property().is_immutable();
+  };
+
+  for (auto &[z, layer] : candidates_) {
+    auto best = planes->end();
+    for (auto it = planes->begin(); it != planes->end(); ++it) {
+      DrmPlane *plane = *it;
+      if (!usable(z, plane) || !plane->IsValidForLayer(layer))
+        continue;
+      if (best == planes->end() || PlaneCost(*plane) < PlaneCost(**best))
+        best = it;
+    }
+    if (best == planes->end())
+      continue;
+
+    composition->emplace_back(DrmCompositionPlane::Type::kLayer, *best, z);
+    planes->erase(best);
+    layers.erase(std::find_if(layers.begin(), layers.end(),
+                              [z = z](const auto &l) { return l.first == z; }));
+  }
+
+  return 0;
+}
+
 int PlanStageGreedy::ProvisionPlanes(
     std::vector<DrmCompositionPlane> *composition,
-    std::map<size_t, DrmHwcLayer *> &layers,
+    PlanLayers &layers,
     std::vector<DrmPlane *> *planes) {
   // Fill up the remaining planes
   for (auto i = layers.begin(); i != layers.end(); i = layers.erase(i)) {
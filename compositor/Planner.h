@@ -25,6 +25,7 @@
 #include <vector>
 
 #include "compositor/DrmDisplayComposition.h"
+#include "drm/DrmDisplayPipeline.h"
 #include "drmhwcomposer.h"
 
 namespace android {
@@ -39,7 +40,7 @@ class Planner {
     }
 
     virtual int ProvisionPlanes(std::vector<DrmCompositionPlane> *composition,
-                                std::map<size_t, DrmHwcLayer *> &layers,
+                                PlanLayers &layers,
                                 std::vector<DrmPlane *> *planes) = 0;
 
    protected:
@@ -57,25 +58,25 @@ class Planner {
                        std::vector<DrmPlane *> *planes,
                        DrmCompositionPlane::Type type,
                        std::pair<size_t, DrmHwcLayer *> layer) {
-      DrmPlane *plane = PopPlane(planes);
-      std::vector<DrmPlane *> unused_planes;
-      int ret = -ENOENT;
-      while (plane) {
-        ret = plane->IsValidForLayer(layer.second) ? 0 : -EINVAL;
-        if (!ret)
-          break;
-        if (!plane->zpos_property().is_immutable())
-          unused_planes.push_back(plane);
-        plane = PopPlane(planes);
-      }
-
-      if (!ret) {
-        composition->emplace_back(type, plane, layer.first);
-        planes->insert(planes->begin(), unused_planes.begin(),
-                       unused_planes.end());
+      if (planes->empty())
+        return -ENOENT;
+
+      // Skipped planes with immutable zpos can't be used for upper layers
+      for (auto it = planes->begin(); it != planes->end();) {
+        DrmPlane *plane = *it;
+        if (plane->IsValidForLayer(layer.second)) {
+          composition->emplace_back(type, plane, layer.first);
+          planes->erase(it);
+          return 0;
+        }
+        if (plane->zpos_property().is_immutable())
+          it = planes->erase(it);
+        else
+          ++it;
       }
 
-      return ret;
+      planes->clear();
+      return -EINVAL;
     }
   };
 
@@ -89,12 +90,20 @@ class Planner {
   // @primary_planes: a vector of primary planes available for this frame
   // @overlay_planes: a vector of overlay planes available for this frame
   //
-  // Returns: A tuple with the status of the operation (0 for success) and
-  //          a vector of the resulting plan (ie: layer->plane mapping).
-  std::tuple<int, std::vector<DrmCompositionPlane>> ProvisionPlanes(
-      std::map<size_t, DrmHwcLayer *> &layers, DrmCrtc *crtc,
-      std::vector<DrmPlane *> *primary_planes,
-      std::vector<DrmPlane *> *overlay_planes);
+  // @composition: receives the resulting plan (ie: layer->plane mapping)
+  //
+  // Returns: 0 on success
+  int ProvisionPlanes(PlanLayers &layers, DrmCrtc *crtc,
+                      std::vector<DrmPlane *> *primary_planes,
+                      std::vector<DrmPlane *> *overlay_planes,
+                      std::vector<DrmCompositionPlane> *composition);
+
+  // Makes the planner place layers on the planes of each tile, clipped to
+  // the tile, instead of running the stages. Tiled planning is off while the
+  // vector is empty. The vector must outlive the planner.
+  void SetTiles(const std::vector<DrmDisplayPipeline::Tile> *tiles) {
+    tiles_ = tiles;
+  }
 
   template <typename T, typename... A>
   void AddStage(A &&...args) {
@@ -103,11 +112,17 @@ class Planner {
   }
 
  private:
-  std::vector<DrmPlane *> GetUsablePlanes(
-      DrmCrtc *crtc, std::vector<DrmPlane *> *primary_planes,
-      std::vector<DrmPlane *> *overlay_planes);
+  void GetUsablePlanes(DrmCrtc *crtc, std::vector<DrmPlane *> *primary_planes,
+                       std::vector<DrmPlane *> *overlay_planes);
+  int ProvisionTiles(PlanLayers &layers,
+                     std::vector<DrmPlane *> *primary_planes,
+                     std::vector<DrmPlane *> *overlay_planes,
+                     std::vector<DrmCompositionPlane> *composition);
 
   std::vector<std::unique_ptr<PlanStage>> stages_;
+  const std::vector<DrmDisplayPipeline::Tile> *tiles_ = nullptr;
+  /* Scratch storage reused across frames */
+  std::vector<DrmPlane *> usable_planes_;
 };
 
 // This plan stage extracts all protected layers and places them on dedicated
@@ -115,17 +130,40 @@ class Planner {
 class PlanStageProtected : public Planner::PlanStage {
  public:
   int ProvisionPlanes(std::vector<DrmCompositionPlane> *composition,
-                      std::map<size_t, DrmHwcLayer *> &layers,
+                      PlanLayers &layers,
                       std::vector<DrmPlane *> *planes);
 };
 
+// This plan stage splits layers that are wider than any plane into a left and
+// a right half on two planes. The halves don't overlap, so they share the
+// layer's zpos.
+class PlanStageSplit : public Planner::PlanStage {
+ public:
+  int ProvisionPlanes(std::vector<DrmCompositionPlane> *composition,
+                      PlanLayers &layers,
+                      std::vector<DrmPlane *> *planes);
+};
+
+// This plan stage reserves planes for YUV, scaled and rotated layers before
+// the greedy stage hands the remaining planes out in z-order. Such layers take
+// the least capable plane that accepts them, largest layer first.
+class PlanStageVideo : public Planner::PlanStage {
+ public:
+  int ProvisionPlanes(std::vector<DrmCompositionPlane> *composition,
+                      PlanLayers &layers,
+                      std::vector<DrmPlane *> *planes);
+
+ private:
+  PlanLayers candidates_;
+};
+
 // This plan stage places as many layers on dedicated planes as possible (first
 // come first serve), and then sticks the rest in a precomposition plane (if
 // needed).
 class PlanStageGreedy : public Planner::PlanStage {
  public:
   int ProvisionPlanes(std::vector<DrmCompositionPlane> *composition,
-                      std::map<size_t, DrmHwcLayer *> &layers,
+                      PlanLayers &layers,
                       std::vector<DrmPlane *> *planes);
 };
 }  // namespace android
@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwc-speculative-validator"
+
+#include "SpeculativeValidator.h"
+
+#include <algorithm>
+#include <cinttypes>
+
+#include "DrmDisplayComposition.h"
+#include "DrmDisplayCompositor.h"
+#include "Planner.h"
+#include "utils/log.h"
+
+namespace android {
+
+/* ANDROID_PRIORITY_BACKGROUND, speculation must not delay real frames */
+constexpr int kSpeculationPriority = 10;
+/* Test commits per frame */
+constexpr size_t kMaxTests = 4;
+
+static auto CopyLayer(const DrmHwcLayer &src) -> DrmHwcLayer {
+  DrmHwcLayer layer;
+  layer.sf_handle = src.sf_handle;
+  layer.sideband_stream = src.sideband_stream;
+  layer.buffer_info = src.buffer_info;
+  layer.FbIdHandle = src.FbIdHandle;
+  layer.gralloc_buffer_usage = src.gralloc_buffer_usage;
+  layer.transform = src.transform;
+  layer.blending = src.blending;
+  layer.alpha = src.alpha;
+  layer.source_crop = src.source_crop;
+  layer.display_frame = src.display_frame;
+  layer.color_space = src.color_space;
+  layer.sample_range = src.sample_range;
+  layer.transfer = src.transfer;
+  layer.hdr_metadata = src.hdr_metadata;
+  return layer;
+}
+
+SpeculativeValidator::SpeculativeValidator()
+    : Worker("speculative-validator", kSpeculationPriority) {
+}
+
+auto SpeculativeValidator::Init(DrmDisplayPipeline *pipeline,
+                                DrmDisplayCompositor *compositor,
+                                const std::vector<DrmPlane *> &primary_planes,
+                                const std::vector<DrmPlane *> &overlay_planes)
+    -> int {
+  pipeline_ = pipeline;
+  compositor_ = compositor;
+  primary_planes_ = primary_planes;
+  overlay_planes_ = overlay_planes;
+
+  /* The planner keeps scratch state, it can't be shared with the display */
+  planner_ = Planner::CreateInstance(pipeline_->device);
+  if (!planner_) {
+    ALOGE("Failed to create planner instance for speculation");
+    return -ENOMEM;
+  }
+  planner_->SetTiles(&pipeline_->tiles);
+
+  return InitWorker();
+}
+
+void SpeculativeValidator::SetPlanes(
+    const std::vector<DrmPlane *> &primary_planes,
+    const std::vector<DrmPlane *> &overlay_planes) {
+  Lock();
+  primary_planes_ = primary_planes;
+  overlay_planes_ = overlay_planes;
+  pending_.reset();
+  result_.reset();
+  Unlock();
+}
+
+void SpeculativeValidator::Submit(Frame frame) {
+  Lock();
+  pending_ = std::move(frame);
+  Signal();
+  Unlock();
+}
+
+auto SpeculativeValidator::GetClientRange(uint64_t stack_hash)
+    -> std::optional<std::pair<int, size_t>> {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  if (!result_ || result_->stack_hash != stack_hash)
+    return {};
+
+  return std::make_pair(result_->client_start, result_->client_size);
+}
+
+void SpeculativeValidator::Reject(uint64_t stack_hash) {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  if (result_ && result_->stack_hash == stack_hash)
+    result_.reset();
+}
+
+auto SpeculativeValidator::TestClientRange(const Frame &frame,
+                                           int client_start,
+                                           size_t client_size) -> bool {
+  std::vector<DrmHwcLayer> layers;
+  for (int z = 0; z < frame.layers.size(); ++z) {
+    if (client_size != 0 && z == client_start)
+      layers.emplace_back(CopyLayer(frame.client_target));
+    if (client_size != 0 && z >= client_start &&
+        z < client_start + client_size)
+      continue;
+    layers.emplace_back(CopyLayer(frame.layers[z]));
+  }
+
+  const std::lock_guard<std::mutex> tests_lock(test_lock_);
+  Lock();
+  DrmCrtc *crtc = pipeline_->crtc;
+  std::vector<DrmPlane *> primary_planes = primary_planes_;
+  std::vector<DrmPlane *> overlay_planes = overlay_planes_;
+  Unlock();
+
+  auto composition = std::make_unique<DrmDisplayComposition>(crtc,
+                                                             planner_.get());
+  int ret = composition->SetLayers(layers.data(), layers.size(), true);
+  if (ret)
+    return false;
+  composition->SetOutputState(frame.output_state, client_size != 0);
+  ret = composition->Plan(&primary_planes, &overlay_planes);
+  if (ret)
+    return false;
+
+  for (DrmPlane *plane : primary_planes)
+    composition->AddPlaneDisable(plane);
+  for (DrmPlane *plane : overlay_planes)
+    composition->AddPlaneDisable(plane);
+
+  return compositor_->TestComposition(composition.get()) == 0;
+}
+
+void SpeculativeValidator::Routine() {
+  Lock();
+  if (!pending_) {
+    int ret = WaitForSignalOrExitLocked();
+    if (ret == -EINTR || !pending_) {
+      Unlock();
+      return;
+    }
+  }
+  Frame frame = std::move(*pending_);
+  pending_.reset();
+  Unlock();
+
+  /* Client composition is only required between these layers */
+  int must_first = -1;
+  int must_last = -1;
+  for (int z = 0; z < frame.must_client.size(); ++z) {
+    if (!frame.must_client[z])
+      continue;
+    if (must_first < 0)
+      must_first = z;
+    must_last = z;
+  }
+
+  std::vector<std::pair<int, size_t>> candidates;
+  if (must_first < 0)
+    candidates.emplace_back(-1, 0);
+  else
+    candidates.emplace_back(must_first, must_last - must_first + 1);
+
+  /* Moving one layer at either end of the range onto a plane is less
+   * likely to run out of planes or bandwidth */
+  int client_end = frame.client_start + int(frame.client_size);
+  if (frame.client_size > 1 && !frame.must_client[frame.client_start])
+    candidates.emplace_back(frame.client_start + 1, frame.client_size - 1);
+  if (frame.client_size > 1 && !frame.must_client[client_end - 1])
+    candidates.emplace_back(frame.client_start, frame.client_size - 1);
+
+  std::optional<Result> result;
+  size_t tests = 0;
+  for (auto [client_start, client_size] : candidates) {
+    if (client_size >= frame.client_size || tests == kMaxTests)
+      continue;
+
+    /* Don't keep the compositor busy for a stack that is already gone */
+    Lock();
+    bool outdated = pending_.has_value() || should_exit();
+    Unlock();
+    if (outdated)
+      return;
+
+    ++tests;
+    if (TestClientRange(frame, client_start, client_size)) {
+      result = Result{frame.stack_hash, client_start, client_size};
+      break;
+    }
+  }
+
+  ALOGV("Stack %" PRIx64 ": %zu tests, client layers %zu -> %zu",
+        frame.stack_hash, tests, frame.client_size,
+        result ? result->client_size : frame.client_size);
+
+  Lock();
+  result_ = result;
+  Unlock();
+}
+
+}  // namespace android
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_SPECULATIVE_VALIDATOR_H_
+#define ANDROID_SPECULATIVE_VALIDATOR_H_
+
+#include <stdint.h>
+
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "compositor/DrmDisplayComposition.h"
+#include "drm/DrmDisplayPipeline.h"
+#include "drm/DrmPlane.h"
+#include "drmhwcomposer.h"
+#include "utils/Worker.h"
+
+namespace android {
+
+class DrmDisplayCompositor;
+class Planner;
+
+/*
+ * Test-commits plans with a smaller client range than the one of the last
+ * present, off the SurfaceFlinger thread. The next frames usually have the
+ * same stack with new buffers, so their validate can use a passing range
+ * without a test commit of its own.
+ */
+class SpeculativeValidator : public Worker {
+ public:
+  /* The stack of a presented frame, acquire fences are not needed */
+  struct Frame {
+    uint64_t stack_hash = 0;
+    /* In z-order */
+    std::vector<DrmHwcLayer> layers;
+    /* Layers that can only be composed by the client */
+    std::vector<bool> must_client;
+    DrmHwcLayer client_target;
+    int client_start = -1;
+    size_t client_size = 0;
+    DrmDisplayComposition::OutputState output_state;
+  };
+
+  SpeculativeValidator();
+  /* Routine() must be done with the members before they are destroyed */
+  ~SpeculativeValidator() override {
+    Exit();
+  }
+
+  auto Init(DrmDisplayPipeline *pipeline, DrmDisplayCompositor *compositor,
+            const std::vector<DrmPlane *> &primary_planes,
+            const std::vector<DrmPlane *> &overlay_planes) -> int;
+
+  /* The display's planes change when the pipeline is bound to another CRTC */
+  void SetPlanes(const std::vector<DrmPlane *> &primary_planes,
+                 const std::vector<DrmPlane *> &overlay_planes);
+
+  /* Held while the pipeline changes, no test runs meanwhile */
+  auto LockTests() -> std::unique_lock<std::mutex> {
+    return std::unique_lock<std::mutex>(test_lock_);
+  }
+
+  /* Replaces a frame that isn't being tested yet */
+  void Submit(Frame frame);
+
+  /* Returns the smallest passing client range of the stack, if any */
+  auto GetClientRange(uint64_t stack_hash)
+      -> std::optional<std::pair<int, size_t>>;
+
+  /* Drops the result of a stack that failed to present */
+  void Reject(uint64_t stack_hash);
+
+ protected:
+  void Routine() override;
+
+ private:
+  struct Result {
+    uint64_t stack_hash;
+    int client_start;
+    size_t client_size;
+  };
+
+  auto TestClientRange(const Frame &frame, int client_start,
+                       size_t client_size) -> bool;
+
+  DrmDisplayPipeline *pipeline_ = nullptr;
+  DrmDisplayCompositor *compositor_ = nullptr;
+  std::unique_ptr<Planner> planner_;
+  std::vector<DrmPlane *> primary_planes_;
+  std::vector<DrmPlane *> overlay_planes_;
+
+  /* Serializes tests against pipeline changes */
+  std::mutex test_lock_;
+  std::optional<Frame> pending_;
+  std::optional<Result> result_;
+};
+
+}  // namespace android
+
+#endif  // ANDROID_SPECULATIVE_VALIDATOR_H_
@@ -20,10 +20,14 @@
 
 #include <xf86drmMode.h>
 
+#include <algorithm>
 #include <array>
 #include <cerrno>
+#include <cinttypes>
 #include <cstdint>
+#include <cstdio>
 #include <sstream>
+#include <tuple>
 
 #include "DrmDevice.h"
 #include "utils/log.h"
@@ -59,6 +63,25 @@ int DrmConnector::Init() {
     return ret;
   }
   UpdateEdidProperty();
+  UpdateVrrCapableProperty();
+  UpdateTile();
+  drm_->GetConnectorProperty(*this, "HDR_OUTPUT_METADATA",
+                             &hdr_output_metadata_property_);
+
+  if (drm_->GetConnectorProperty(*this, "content type",
+                                 &content_type_property_) == 0) {
+    content_type_property_.AddEnumToMap("No Data", DrmHwcContentType::kNone,
+                                        content_type_enum_map_);
+    content_type_property_.AddEnumToMap("Graphics",
+                                        DrmHwcContentType::kGraphics,
+                                        content_type_enum_map_);
+    content_type_property_.AddEnumToMap("Photo", DrmHwcContentType::kPhoto,
+                                        content_type_enum_map_);
+    content_type_property_.AddEnumToMap("Cinema", DrmHwcContentType::kCinema,
+                                        content_type_enum_map_);
+    content_type_property_.AddEnumToMap("Game", DrmHwcContentType::kGame,
+                                        content_type_enum_map_);
+  }
   if (writeback()) {
     ret = drm_->GetConnectorProperty(*this, "WRITEBACK_PIXEL_FORMATS",
                                      &writeback_pixel_formats_);
@@ -90,6 +113,12 @@ int DrmConnector::UpdateEdidProperty() {
   return ret;
 }
 
+/* The kernel updates vrr_capable on every hotplug from the sink's EDID */
+int DrmConnector::UpdateVrrCapableProperty() {
+  return drm_->GetConnectorProperty(*this, "vrr_capable",
+                                    &vrr_capable_property_);
+}
+
 auto DrmConnector::GetEdidBlob() -> DrmModePropertyBlobUnique {
   uint64_t blob_id = 0;
   int ret = UpdateEdidProperty();
@@ -105,6 +134,47 @@ auto DrmConnector::GetEdidBlob() -> DrmModePropertyBlobUnique {
   return MakeDrmModePropertyBlobUnique(drm_->fd(), blob_id);
 }
 
+/* The kernel sets TILE from the DisplayID tiled topology block on detect,
+ * as "group:single_monitor:h_tiles:v_tiles:h_loc:v_loc:width:height" */
+void DrmConnector::UpdateTile() {
+  tile_.reset();
+  DrmProperty tile_property;
+  if (drm_->GetConnectorProperty(*this, "TILE", &tile_property) != 0)
+    return;
+
+  auto [ret, blob_id] = tile_property.value();
+  if (ret != 0 || blob_id == 0)
+    return;
+
+  auto blob = MakeDrmModePropertyBlobUnique(drm_->fd(), blob_id);
+  if (!blob)
+    return;
+
+  std::string desc(static_cast<const char *>(blob->data), blob->length);
+  Tile tile{};
+  uint32_t single_monitor = 0;
+  if (sscanf(desc.c_str(),
+             "%" SCNu32 ":%" SCNu32 ":%" SCNu32 ":%" SCNu32 ":%" SCNu32
+             ":%" SCNu32 ":%" SCNu32 ":%" SCNu32,
+             &tile.group_id, &single_monitor, &tile.num_h_tiles,
+             &tile.num_v_tiles, &tile.h_location, &tile.v_location,
+             &tile.width, &tile.height) != 8 ||
+      tile.num_h_tiles * tile.num_v_tiles < 2) {
+    return;
+  }
+
+  tile_ = tile;
+}
+
+auto DrmConnector::GetDisplaySize(const DrmMode &mode) const
+    -> std::pair<uint32_t, uint32_t> {
+  if (!tile_ || !tiled_)
+    return {mode.h_display(), mode.v_display()};
+
+  return {mode.h_display() * tile_->num_h_tiles,
+          mode.v_display() * tile_->num_v_tiles};
+}
+
 uint32_t DrmConnector::id() const {
   return id_;
 }
@@ -158,6 +228,13 @@ std::string DrmConnector::name() const {
   return "None";
 }
 
+template <class T>
+static auto ModeKey(const T &m) {
+  return std::make_tuple(m.clock, m.hdisplay, m.hsync_start, m.hsync_end,
+                         m.htotal, m.hskew, m.vdisplay, m.vsync_start,
+                         m.vsync_end, m.vtotal, m.vscan, m.flags, m.type);
+}
+
 int DrmConnector::UpdateModes() {
   int fd = drm_->fd();
 
@@ -168,23 +245,85 @@ int DrmConnector::UpdateModes() {
   }
 
   state_ = c->connection;
+  UpdateVrrCapableProperty();
+  UpdateTile();
+
+  bool size_changed = mm_width_ != c->mmWidth || mm_height_ != c->mmHeight ||
+                      configs_tiled_ != tiled_;
+  mm_width_ = c->mmWidth;
+  mm_height_ = c->mmHeight;
+  configs_tiled_ = tiled_;
+
+  /* Modes reported again keep their config id and attributes */
+  std::map<decltype(ModeKey(c->modes[0])), const Config *> old_configs;
+  for (const auto &[id, config] : configs_) {
+    drm_mode_modeinfo info{};
+    config.mode.ToDrmModeModeInfo(&info);
+    old_configs.emplace(ModeKey(info), &config);
+  }
 
+  static const int32_t kUmPerInch = 25400;
+  std::map<std::pair<uint32_t, uint32_t>, int32_t> groups;
+  std::map<uint32_t, Config> new_configs;
   bool preferred_mode_found = false;
   std::vector<DrmMode> new_modes;
+  new_modes.reserve(c->count_modes);
+  /* Only modes of the tile size span a tiled display. Driven through one
+   * tile, a mode of the whole panel is preferred where there is one. */
+  auto is_tile_mode = [this](const drmModeModeInfo &m) {
+    return tile_ && m.hdisplay == tile_->width && m.vdisplay == tile_->height;
+  };
+  bool has_tile_mode = std::any_of(c->modes, c->modes + c->count_modes,
+                                   is_tile_mode);
+  bool has_panel_mode = tile_ &&
+                        !std::all_of(c->modes, c->modes + c->count_modes,
+                                     is_tile_mode);
+  bool tile_modes_only = tiled_ && has_tile_mode;
+  bool prefer_panel_mode = !tiled_ && has_panel_mode;
+  uint32_t fallback_mode_id = 0;
   for (int i = 0; i < c->count_modes; ++i) {
-    bool exists = false;
-    for (const DrmMode &mode : modes_) {
-      if (mode == c->modes[i]) {
-        new_modes.push_back(mode);
-        exists = true;
-        break;
-      }
+    if (tile_modes_only && !is_tile_mode(c->modes[i]))
+      continue;
+
+    auto old = old_configs.find(ModeKey(c->modes[i]));
+    Config config{};
+    if (old != old_configs.end()) {
+      config = *old->second;
+    } else {
+      config.mode = DrmMode(&c->modes[i]);
+      config.mode.set_id(drm_->next_mode_id());
     }
-    if (!exists) {
-      DrmMode m(&c->modes[i]);
-      m.set_id(drm_->next_mode_id());
-      new_modes.push_back(m);
+
+    const DrmMode &mode = config.mode;
+    if (old == old_configs.end() || size_changed) {
+      auto [width, height] = GetDisplaySize(mode);
+      config.width = static_cast<int32_t>(width);
+      config.height = static_cast<int32_t>(height);
+      config.vsync_period_ns = mode.v_refresh() != 0.0F
+                                   ? static_cast<int32_t>(1E9 /
+                                                          mode.v_refresh())
+                                   : -1;
+      config.dpi_x = mm_width_ ? static_cast<int32_t>(width * kUmPerInch /
+                                                      mm_width_)
+                               : -1;
+      config.dpi_y = mm_height_ ? static_cast<int32_t>(height * kUmPerInch /
+                                                       mm_height_)
+                                : -1;
     }
+
+    /* Group ids follow the order of the first mode of each resolution */
+    auto res = std::make_pair(mode.h_display(), mode.v_display());
+    config.group = groups.emplace(res, static_cast<int32_t>(groups.size()))
+                       .first->second;
+
+    new_modes.push_back(mode);
+    new_configs.emplace(mode.id(), config);
+
+    if (prefer_panel_mode && is_tile_mode(c->modes[i]))
+      continue;
+    if (fallback_mode_id == 0)
+      fallback_mode_id = mode.id();
+
     // Use only the first DRM_MODE_TYPE_PREFERRED mode found
     if (!preferred_mode_found &&
         (new_modes.back().type() & DRM_MODE_TYPE_PREFERRED)) {
@@ -192,13 +331,55 @@ int DrmConnector::UpdateModes() {
       preferred_mode_found = true;
     }
   }
+  drmModeFreeConnector(c);
+
   modes_.swap(new_modes);
+  configs_.swap(new_configs);
+
+  for (auto it = mode_blobs_.begin(); it != mode_blobs_.end();) {
+    if (configs_.count(it->first) == 0 && it->first != active_mode_.id())
+      it = mode_blobs_.erase(it);
+    else
+      ++it;
+  }
   if (!preferred_mode_found && !modes_.empty()) {
-    preferred_mode_id_ = modes_[0].id();
+    preferred_mode_id_ = fallback_mode_id;
   }
+
+  auto edid = GetEdidBlob();
+  if (edid) {
+    const auto *data = static_cast<const uint8_t *>(edid->data);
+    edid_.assign(data, data + edid->length);
+  } else {
+    edid_.clear();
+  }
+  edid_info_ = ParseEdid(edid_.data(), edid_.size());
   return 0;
 }
 
+auto DrmConnector::GetConfig(uint32_t config_id) const -> const Config * {
+  auto it = configs_.find(config_id);
+  return it != configs_.end() ? &it->second : nullptr;
+}
+
+uint32_t DrmConnector::GetModeBlob(const DrmMode &mode) {
+  auto it = mode_blobs_.find(mode.id());
+  if (it != mode_blobs_.end())
+    return *it->second;
+
+  struct drm_mode_modeinfo drm_mode {};
+  mode.ToDrmModeModeInfo(&drm_mode);
+
+  auto blob = drm_->RegisterUserPropertyBlob(&drm_mode,
+                                             sizeof(struct drm_mode_modeinfo));
+  if (!blob)
+    return 0;
+
+  uint32_t blob_id = *blob;
+  mode_blobs_.emplace(mode.id(), std::move(blob));
+  return blob_id;
+}
+
 const DrmMode &DrmConnector::active_mode() const {
   return active_mode_;
 }
@@ -250,4 +431,51 @@ uint32_t DrmConnector::mm_width() const {
 uint32_t DrmConnector::mm_height() const {
   return mm_height_;
 }
+
+/* Sinks without a valid EDID get every type the driver can signal */
+bool DrmConnector::IsContentTypeSupported(DrmHwcContentType type) const {
+  if (content_type_enum_map_.count(type) == 0)
+    return false;
+
+  if (!edid_info_.valid)
+    return true;
+
+  const EdidContentTypes &sink = edid_info_.content_types;
+  switch (type) {
+    case DrmHwcContentType::kGraphics:
+      return sink.graphics;
+    case DrmHwcContentType::kPhoto:
+      return sink.photo;
+    case DrmHwcContentType::kCinema:
+      return sink.cinema;
+    case DrmHwcContentType::kGame:
+      return sink.game;
+    default:
+      return true;
+  }
+}
+
+bool DrmConnector::IsAllmSupported() const {
+  return content_type_enum_map_.count(DrmHwcContentType::kGame) != 0 &&
+         (!edid_info_.valid || edid_info_.allm ||
+          edid_info_.content_types.game);
+}
+
+auto DrmConnector::AtomicSetContentType(drmModeAtomicReq &pset,
+                                        DrmHwcContentType type) const
+    -> bool {
+  auto it = content_type_enum_map_.find(type);
+  if (it == content_type_enum_map_.end())
+    return true;
+
+  return content_type_property_.AtomicSet(pset, it->second);
+}
+
+bool DrmConnector::vrr_capable() const {
+  if (!vrr_capable_property_)
+    return false;
+
+  auto [ret, value] = vrr_capable_property_.value();
+  return ret == 0 && value != 0;
+}
 }  // namespace android
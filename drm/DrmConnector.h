@@ -20,18 +20,31 @@
 #include <stdint.h>
 #include <xf86drmMode.h>
 
+#include <map>
+#include <optional>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "DrmEncoder.h"
 #include "DrmMode.h"
 #include "DrmProperty.h"
 #include "DrmUnique.h"
+#include "utils/EdidParser.h"
 
 namespace android {
 
 class DrmDevice;
 
+/* Values match the HWC2 content types */
+enum class DrmHwcContentType : int32_t {
+  kNone,
+  kGraphics,
+  kPhoto,
+  kCinema,
+  kGame,
+};
+
 class DrmConnector {
  public:
   DrmConnector(DrmDevice *drm, drmModeConnectorPtr c,
@@ -42,6 +55,7 @@ class DrmConnector {
 
   int Init();
   int UpdateEdidProperty();
+  int UpdateVrrCapableProperty();
   auto GetEdidBlob() -> DrmModePropertyBlobUnique;
 
   uint32_t id() const;
@@ -58,9 +72,31 @@ class DrmConnector {
 
   int UpdateModes();
 
+  /* Display config built from a mode, with the attributes queried by the
+   * framework precomputed */
+  struct Config {
+    DrmMode mode;
+    int32_t width;
+    int32_t height;
+    int32_t vsync_period_ns;
+    /* Dots per 1000 inches, -1 if the physical size is unknown */
+    int32_t dpi_x;
+    int32_t dpi_y;
+    /* Configs with the same resolution share a group */
+    int32_t group;
+  };
+
   const std::vector<DrmMode> &modes() const {
     return modes_;
   }
+  const Config *GetConfig(uint32_t config_id) const;
+  const std::map<uint32_t, Config> &configs() const {
+    return configs_;
+  }
+
+  /* Returns the MODE_ID blob for the mode, created on first use and kept while
+   * the connector reports the mode. Returns 0 on failure. */
+  uint32_t GetModeBlob(const DrmMode &mode);
   const DrmMode &active_mode() const;
   void set_active_mode(const DrmMode &mode);
 
@@ -70,6 +106,9 @@ class DrmConnector {
   const DrmProperty &writeback_pixel_formats() const;
   const DrmProperty &writeback_fb_id() const;
   const DrmProperty &writeback_out_fence() const;
+  const DrmProperty &hdr_output_metadata_property() const {
+    return hdr_output_metadata_property_;
+  }
 
   const std::vector<DrmEncoder *> &possible_encoders() const {
     return possible_encoders_;
@@ -82,10 +121,63 @@ class DrmConnector {
   uint32_t mm_width() const;
   uint32_t mm_height() const;
 
+  /* EDID and the sink capabilities parsed from it, both cached on every
+   * UpdateModes(), i.e. on every hotplug */
+  const std::vector<uint8_t> &edid() const {
+    return edid_;
+  }
+  const EdidInfo &edid_info() const {
+    return edid_info_;
+  }
+
+  /* Sink supports variable refresh rate (adaptive sync) */
+  bool vrr_capable() const;
+
+  /* HDMI content type signalled in the AVI infoframe */
+  bool IsContentTypeSupported(DrmHwcContentType type) const;
+  /* ALLM is signalled as the Game content type */
+  bool IsAllmSupported() const;
+  auto AtomicSetContentType(drmModeAtomicReq &pset,
+                            DrmHwcContentType type) const -> bool;
+
   uint32_t get_preferred_mode_id() const {
     return preferred_mode_id_;
   }
 
+  /* Position of the connector in a display driven through one connector per
+   * tile, from the TILE property. Tile locations are zero-based. */
+  struct Tile {
+    uint32_t group_id;
+    uint32_t num_h_tiles;
+    uint32_t num_v_tiles;
+    uint32_t h_location;
+    uint32_t v_location;
+    uint32_t width;
+    uint32_t height;
+  };
+  const std::optional<Tile> &tile() const {
+    return tile_;
+  }
+  /* The top-left tile of the display, if this connector drives another
+   * tile of it. Such connectors don't form a display of their own. */
+  DrmConnector *tile_leader() const {
+    return tile_leader_;
+  }
+  void set_tile_leader(DrmConnector *leader) {
+    tile_leader_ = leader;
+  }
+  /* Set by the pipeline while the display is driven through all of its
+   * tiles. Modes and configs follow on the next UpdateModes(). */
+  bool tiled() const {
+    return tiled_;
+  }
+  void set_tiled(bool tiled) {
+    tiled_ = tiled;
+  }
+  /* Resolution of the whole display while the tiles run the mode */
+  auto GetDisplaySize(const DrmMode &mode) const
+      -> std::pair<uint32_t, uint32_t>;
+
  private:
   DrmDevice *drm_;
 
@@ -102,6 +194,10 @@ class DrmConnector {
 
   DrmMode active_mode_;
   std::vector<DrmMode> modes_;
+  std::map<uint32_t, Config> configs_;
+  std::map<uint32_t /*mode id*/, DrmModeUserPropertyBlobUnique> mode_blobs_;
+  std::vector<uint8_t> edid_;
+  EdidInfo edid_info_;
 
   DrmProperty dpms_property_;
   DrmProperty crtc_id_property_;
@@ -109,10 +205,22 @@ class DrmConnector {
   DrmProperty writeback_pixel_formats_;
   DrmProperty writeback_fb_id_;
   DrmProperty writeback_out_fence_;
+  DrmProperty vrr_capable_property_;
+  DrmProperty content_type_property_;
+  DrmProperty hdr_output_metadata_property_;
+  std::map<DrmHwcContentType, uint64_t> content_type_enum_map_;
 
   std::vector<DrmEncoder *> possible_encoders_;
 
   uint32_t preferred_mode_id_{};
+
+  /* Read on init and on every UpdateModes() */
+  void UpdateTile();
+  std::optional<Tile> tile_;
+  DrmConnector *tile_leader_ = nullptr;
+  bool tiled_ = false;
+  /* Tiling the configs were sized for */
+  bool configs_tiled_ = false;
 };
 }  // namespace android
 
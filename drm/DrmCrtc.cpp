@@ -49,6 +49,19 @@ int DrmCrtc::Init() {
     ALOGE("Failed to get OUT_FENCE_PTR property");
     return ret;
   }
+
+  ret = drm_->GetCrtcProperty(*this, "VRR_ENABLED", &vrr_enabled_property_);
+  if (ret)
+    ALOGI("Could not get VRR_ENABLED property for crtc %d", id_);
+
+  /* Color management properties are optional */
+  drm_->GetCrtcProperty(*this, "CTM", &ctm_property_);
+  drm_->GetCrtcProperty(*this, "GAMMA_LUT", &gamma_lut_property_);
+  drm_->GetCrtcProperty(*this, "GAMMA_LUT_SIZE", &gamma_lut_size_property_);
+  drm_->GetCrtcProperty(*this, "DEGAMMA_LUT", &degamma_lut_property_);
+  drm_->GetCrtcProperty(*this, "DEGAMMA_LUT_SIZE",
+                        &degamma_lut_size_property_);
+
   return 0;
 }
 
@@ -83,4 +96,28 @@ const DrmProperty &DrmCrtc::mode_property() const {
 const DrmProperty &DrmCrtc::out_fence_ptr_property() const {
   return out_fence_ptr_property_;
 }
+
+const DrmProperty &DrmCrtc::vrr_enabled_property() const {
+  return vrr_enabled_property_;
+}
+
+const DrmProperty &DrmCrtc::ctm_property() const {
+  return ctm_property_;
+}
+
+const DrmProperty &DrmCrtc::gamma_lut_property() const {
+  return gamma_lut_property_;
+}
+
+const DrmProperty &DrmCrtc::gamma_lut_size_property() const {
+  return gamma_lut_size_property_;
+}
+
+const DrmProperty &DrmCrtc::degamma_lut_property() const {
+  return degamma_lut_property_;
+}
+
+const DrmProperty &DrmCrtc::degamma_lut_size_property() const {
+  return degamma_lut_size_property_;
+}
 }  // namespace android
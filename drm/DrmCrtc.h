@@ -46,6 +46,12 @@ class DrmCrtc {
   const DrmProperty &active_property() const;
   const DrmProperty &mode_property() const;
   const DrmProperty &out_fence_ptr_property() const;
+  const DrmProperty &vrr_enabled_property() const;
+  const DrmProperty &ctm_property() const;
+  const DrmProperty &gamma_lut_property() const;
+  const DrmProperty &gamma_lut_size_property() const;
+  const DrmProperty &degamma_lut_property() const;
+  const DrmProperty &degamma_lut_size_property() const;
 
  private:
   DrmDevice *drm_;
@@ -59,6 +65,12 @@ class DrmCrtc {
   DrmProperty active_property_;
   DrmProperty mode_property_;
   DrmProperty out_fence_ptr_property_;
+  DrmProperty vrr_enabled_property_;
+  DrmProperty ctm_property_;
+  DrmProperty gamma_lut_property_;
+  DrmProperty gamma_lut_size_property_;
+  DrmProperty degamma_lut_property_;
+  DrmProperty degamma_lut_size_property_;
 };
 }  // namespace android
 
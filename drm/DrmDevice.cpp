@@ -27,6 +27,7 @@
 #include <cerrno>
 #include <cinttypes>
 #include <cstdint>
+#include <cstdlib>
 #include <sstream>
 #include <string>
 
@@ -79,7 +80,9 @@ static std::vector<DrmConnector *> make_primary_display_candidates(
                                           std::end(primary_candidates),
                                           [](const DrmConnector *conn) {
                                             return conn->state() !=
-                                                   DRM_MODE_CONNECTED;
+                                                       DRM_MODE_CONNECTED ||
+                                                   conn->tile_leader() !=
+                                                       nullptr;
                                           }),
                            std::end(primary_candidates));
 
@@ -155,6 +158,13 @@ std::tuple<int, int> DrmDevice::Init(const char *path, int num_displays) {
   }
   HasAddFb2ModifiersSupport_ = cap_value != 0;
 
+#ifdef DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP
+  cap_value = 0;
+  if (drmGetCap(fd(), DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP, &cap_value))
+    cap_value = 0;
+  HasAtomicAsyncPageFlipSupport_ = cap_value != 0;
+#endif
+
   drmSetMaster(fd());
   if (!drmIsMaster(fd())) {
     ALOGE("DRM/KMS master access required");
@@ -260,6 +270,8 @@ std::tuple<int, int> DrmDevice::Init(const char *path, int num_displays) {
       connectors_.emplace_back(std::move(conn));
   }
 
+  GroupTiles();
+
   // Primary display priority:
   // 1) vendor.hwc.drm.primary_display_order property
   // 2) internal connectors
@@ -281,6 +293,8 @@ std::tuple<int, int> DrmDevice::Init(const char *path, int num_displays) {
   // If no priority display were found then pick first available as primary and
   // for the others assign consecutive display_numbers.
   for (auto &conn : connectors_) {
+    if (conn->tile_leader() != nullptr)
+      continue;
     if (conn->external() || conn->internal()) {
       if (!found_primary) {
         conn->set_display(num_displays);
@@ -305,6 +319,11 @@ std::tuple<int, int> DrmDevice::Init(const char *path, int num_displays) {
     return std::make_tuple(-ENOENT, 0);
   }
 
+  /* Wider layers are split across two planes */
+  char plane_max_width_prop[PROPERTY_VALUE_MAX];
+  property_get("vendor.hwc.drm.plane_max_width", plane_max_width_prop, "0");
+  auto plane_max_width = uint32_t(strtoul(plane_max_width_prop, nullptr, 10));
+
   for (uint32_t i = 0; i < plane_res->count_planes; ++i) {
     auto p = MakeDrmModePlaneUnique(fd(), plane_res->planes[i]);
     if (!p) {
@@ -320,6 +339,7 @@ std::tuple<int, int> DrmDevice::Init(const char *path, int num_displays) {
       ALOGE("Init plane %d failed", plane_res->planes[i]);
       break;
     }
+    plane->set_max_width(plane_max_width);
 
     planes_.emplace_back(std::move(plane));
   }
@@ -332,13 +352,30 @@ std::tuple<int, int> DrmDevice::Init(const char *path, int num_displays) {
     return std::make_tuple(ret, 0);
   }
 
+  /* Further tiles take CRTCs left over by the displays */
+  for (auto &conn : connectors_) {
+    if (conn->tile_leader() != nullptr)
+      conn->set_display(conn->tile_leader()->display());
+  }
+  std::stable_partition(connectors_.begin(), connectors_.end(),
+                        [](const std::unique_ptr<DrmConnector> &conn) {
+                          return conn->tile_leader() == nullptr;
+                        });
+
   for (auto &conn : connectors_) {
     ret = CreateDisplayPipe(conn.get());
+    if (ret && conn->tile_leader() != nullptr) {
+      /* The display falls back to its top-left tile */
+      ALOGW("No CRTC left for tile connector %d", conn->id());
+      conn->set_encoder(nullptr);
+      ret = 0;
+      continue;
+    }
     if (ret) {
       ALOGE("Failed CreateDisplayPipe %d with %d", conn->id(), ret);
       return std::make_tuple(ret, 0);
     }
-    if (!AttachWriteback(conn.get())) {
+    if (conn->tile_leader() == nullptr && !AttachWriteback(conn.get())) {
       ALOGI("Display %d has writeback attach to it", conn->display());
     }
   }
@@ -351,7 +388,7 @@ bool DrmDevice::HandlesDisplay(int display) const {
 
 DrmConnector *DrmDevice::GetConnectorForDisplay(int display) const {
   for (const auto &conn : connectors_) {
-    if (conn->display() == display)
+    if (conn->display() == display && conn->tile_leader() == nullptr)
       return conn.get();
   }
   return nullptr;
@@ -391,6 +428,14 @@ DrmConnector *DrmDevice::AvailableWritebackConnector(int display) const {
 }
 
 DrmCrtc *DrmDevice::GetCrtcForDisplay(int display) const {
+  /* Tiled displays have a CRTC per tile, the first one drives the top-left
+   * tile */
+  DrmConnector *conn = GetConnectorForDisplay(display);
+  if (conn != nullptr && conn->encoder() != nullptr &&
+      conn->encoder()->crtc() != nullptr &&
+      conn->encoder()->crtc()->display() == display)
+    return conn->encoder()->crtc();
+
   for (const auto &crtc : crtcs_) {
     if (crtc->display() == display)
       return crtc.get();
@@ -414,10 +459,35 @@ uint32_t DrmDevice::next_mode_id() {
   return ++mode_id_;
 }
 
-int DrmDevice::TryEncoderForDisplay(int display, DrmEncoder *enc) {
+void DrmDevice::GroupTiles() {
+  for (auto &conn : connectors_) {
+    const auto &tile = conn->tile();
+    if (!tile || (tile->h_location == 0 && tile->v_location == 0))
+      continue;
+
+    for (auto &leader : connectors_) {
+      const auto &leader_tile = leader->tile();
+      if (leader_tile && leader_tile->group_id == tile->group_id &&
+          leader_tile->h_location == 0 && leader_tile->v_location == 0) {
+        ALOGI("Connector %s drives tile %" PRIu32 ",%" PRIu32 " of %s",
+              conn->name().c_str(), tile->h_location, tile->v_location,
+              leader->name().c_str());
+        conn->set_tile_leader(leader.get());
+        break;
+      }
+    }
+  }
+}
+
+int DrmDevice::TryEncoderForDisplay(int display, DrmEncoder *enc,
+                                    bool exclusive) {
+  auto can_bind = [display, exclusive](const DrmCrtc *crtc) {
+    return exclusive ? crtc->display() == -1 : crtc->can_bind(display);
+  };
+
   /* First try to use the currently-bound crtc */
   DrmCrtc *crtc = enc->crtc();
-  if (crtc && crtc->can_bind(display)) {
+  if (crtc && can_bind(crtc)) {
     crtc->set_display(display);
     enc->set_crtc(crtc);
     return 0;
@@ -429,7 +499,7 @@ int DrmDevice::TryEncoderForDisplay(int display, DrmEncoder *enc) {
     if (crtc == enc->crtc())
       continue;
 
-    if (crtc->can_bind(display)) {
+    if (can_bind(crtc)) {
       crtc->set_display(display);
       enc->set_crtc(crtc);
       return 0;
@@ -442,9 +512,11 @@ int DrmDevice::TryEncoderForDisplay(int display, DrmEncoder *enc) {
 
 int DrmDevice::CreateDisplayPipe(DrmConnector *connector) {
   int display = connector->display();
+  /* Every tile needs a CRTC of its own */
+  bool exclusive = connector->tile_leader() != nullptr;
   /* Try to use current setup first */
   if (connector->encoder()) {
-    int ret = TryEncoderForDisplay(display, connector->encoder());
+    int ret = TryEncoderForDisplay(display, connector->encoder(), exclusive);
     if (!ret) {
       return 0;
     }
@@ -456,7 +528,7 @@ int DrmDevice::CreateDisplayPipe(DrmConnector *connector) {
   }
 
   for (DrmEncoder *enc : connector->possible_encoders()) {
-    int ret = TryEncoderForDisplay(display, enc);
+    int ret = TryEncoderForDisplay(display, enc, exclusive);
     if (!ret) {
       connector->set_encoder(enc);
       return 0;
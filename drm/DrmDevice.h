@@ -91,6 +91,11 @@ class DrmDevice {
     return HasAddFb2ModifiersSupport_;
   }
 
+  /* Atomic commits may flip without waiting for vblank */
+  bool HasAtomicAsyncPageFlipSupport() const {
+    return HasAtomicAsyncPageFlipSupport_;
+  }
+
   DrmFbImporter &GetDrmFbImporter() {
     return *mDrmFbImporter.get();
   }
@@ -101,7 +106,11 @@ class DrmDevice {
                   DrmProperty *property) const;
 
  private:
-  int TryEncoderForDisplay(int display, DrmEncoder *enc);
+  /* Exclusive binding only takes CRTCs that aren't bound to a display */
+  int TryEncoderForDisplay(int display, DrmEncoder *enc,
+                           bool exclusive = false);
+  /* Connectors of further tiles are attached to the top-left tile */
+  void GroupTiles();
 
   int CreateDisplayPipe(DrmConnector *connector);
   int AttachWriteback(DrmConnector *display_conn);
@@ -121,6 +130,7 @@ class DrmDevice {
   std::map<int, int> displays_;
 
   bool HasAddFb2ModifiersSupport_{};
+  bool HasAtomicAsyncPageFlipSupport_{};
 
   std::shared_ptr<DrmDevice> self;
 
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwc-drm-display-pipeline"
+
+#include "DrmDisplayPipeline.h"
+
+#include <cinttypes>
+
+#include "DrmDevice.h"
+#include "utils/log.h"
+
+namespace android {
+
+auto DrmDisplayPipeline::CreatePipeline(DrmDevice *device, int display)
+    -> std::unique_ptr<DrmDisplayPipeline> {
+  auto pipeline = std::make_unique<DrmDisplayPipeline>();
+  pipeline->device = device;
+  pipeline->display = display;
+  if (pipeline->Rebind() != 0)
+    return {};
+
+  return pipeline;
+}
+
+auto DrmDisplayPipeline::Rebind() -> int {
+  DrmConnector *new_connector = device->GetConnectorForDisplay(display);
+  if (!new_connector) {
+    ALOGE("Failed to get connector for display %d", display);
+    return -ENODEV;
+  }
+
+  DrmCrtc *new_crtc = device->GetCrtcForDisplay(display);
+  if (!new_crtc) {
+    ALOGE("Failed to get crtc for display %d", display);
+    return -ENODEV;
+  }
+
+  connector = new_connector;
+  encoder = connector->encoder();
+  bool was_tiled = !tiles.empty();
+  BindTiles();
+  connector->set_tiled(!tiles.empty());
+  if (new_crtc == crtc && !was_tiled && tiles.empty())
+    return 0;
+
+  crtc = new_crtc;
+  planes.clear();
+  if (!tiles.empty()) {
+    for (const Tile &tile : tiles)
+      planes.insert(planes.end(), tile.planes.begin(), tile.planes.end());
+    return 0;
+  }
+
+  for (const auto &plane : device->planes()) {
+    if (plane->GetCrtcSupported(*crtc))
+      planes.push_back(plane.get());
+  }
+
+  return 0;
+}
+
+void DrmDisplayPipeline::BindTiles() {
+  tiles.clear();
+  const auto &leader_tile = connector->tile();
+  if (!leader_tile)
+    return;
+
+  DrmCrtc *leader_crtc = device->GetCrtcForDisplay(display);
+  tiles.push_back({connector, leader_crtc, {}, 0, 0,
+                   int32_t(leader_tile->width), int32_t(leader_tile->height)});
+  for (const auto &conn : device->connectors()) {
+    if (conn->tile_leader() != connector)
+      continue;
+
+    const auto &tile = conn->tile();
+    DrmCrtc *tile_crtc = conn->encoder() != nullptr ? conn->encoder()->crtc()
+                                                     : nullptr;
+    if (!tile || tile_crtc == nullptr ||
+        conn->state() != DRM_MODE_CONNECTED) {
+      ALOGW("Tile connector %d is unusable, display %d shows one tile only",
+            conn->id(), display);
+      tiles.clear();
+      return;
+    }
+    tiles.push_back({conn.get(), tile_crtc, {},
+                     int32_t(tile->h_location * tile->width),
+                     int32_t(tile->v_location * tile->height),
+                     int32_t(tile->width), int32_t(tile->height)});
+  }
+  if (tiles.size() != leader_tile->num_h_tiles * leader_tile->num_v_tiles) {
+    ALOGW("Display %d has %zu of %" PRIu32 " tiles connected", display,
+          tiles.size(), leader_tile->num_h_tiles * leader_tile->num_v_tiles);
+    tiles.clear();
+    return;
+  }
+
+  /* Each plane goes to the tile with the fewest planes among those it can
+   * be attached to */
+  for (const auto &plane : device->planes()) {
+    Tile *target = nullptr;
+    for (Tile &tile : tiles) {
+      if (plane->GetCrtcSupported(*tile.crtc) &&
+          (target == nullptr || tile.planes.size() < target->planes.size()))
+        target = &tile;
+    }
+    if (target != nullptr)
+      target->planes.push_back(plane.get());
+  }
+}
+
+}  // namespace android
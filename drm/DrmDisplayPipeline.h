@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_DRM_DISPLAY_PIPELINE_H_
+#define ANDROID_DRM_DISPLAY_PIPELINE_H_
+
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+namespace android {
+
+class DrmConnector;
+class DrmCrtc;
+class DrmDevice;
+class DrmEncoder;
+class DrmPlane;
+
+/*
+ * The KMS objects a display is scanned out with, resolved once when the
+ * display is created instead of on every commit. Owned by the display and
+ * shared by its compositor and vsync workers, which must not outlive it.
+ */
+struct DrmDisplayPipeline {
+  static auto CreatePipeline(DrmDevice *device, int display)
+      -> std::unique_ptr<DrmDisplayPipeline>;
+
+  /* Resolves the objects again after the connector was routed anew, e.g.
+   * on hotplug. The connector is told whether it drives all tiles. */
+  auto Rebind() -> int;
+
+  DrmDevice *device = nullptr;
+  int display = -1;
+
+  DrmConnector *connector = nullptr;
+  DrmEncoder *encoder = nullptr;
+  DrmCrtc *crtc = nullptr;
+  /* All planes that can be attached to the CRTC, or to any tile's CRTC */
+  std::vector<DrmPlane *> planes;
+
+  /* A tiled display is driven through a connector and CRTC per tile, all
+   * committed together. The first tile is the one above. */
+  struct Tile {
+    DrmConnector *connector;
+    DrmCrtc *crtc;
+    /* Planes are shared out so that no tile can lose one to another */
+    std::vector<DrmPlane *> planes;
+    /* Area of the tile on the display */
+    int32_t x;
+    int32_t y;
+    int32_t width;
+    int32_t height;
+  };
+  /* Empty for displays that aren't tiled or lack a CRTC for some tile */
+  std::vector<Tile> tiles;
+
+ private:
+  void BindTiles();
+};
+
+}  // namespace android
+
+#endif  // ANDROID_DRM_DISPLAY_PIPELINE_H_
@@ -20,6 +20,12 @@
 #include "DrmFbImporter.h"
 
 #include <hardware/gralloc.h>
+#include <linux/dma-buf.h>
+#include <sync/sync.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
@@ -86,7 +92,114 @@ auto DrmFbIdHandle::CreateInstance(hwc_drm_bo_t *bo, GemHandle first_gem_handle,
   return local;
 }
 
+auto DrmFbIdHandle::CreateShadowInstance(const hwc_drm_bo_t &bo,
+                                         const std::shared_ptr<DrmDevice> &drm)
+    -> std::shared_ptr<DrmFbIdHandle> {
+  // NOLINTNEXTLINE(cppcoreguidelines-owning-memory): priv. constructor usage
+  std::shared_ptr<DrmFbIdHandle> local(new DrmFbIdHandle(drm));
+
+  /* Sized in bytes, the real format is only known to ADDFB2 */
+  struct drm_mode_create_dumb create {};
+  create.width = bo.pitches[0];
+  create.height = bo.height;
+  create.bpp = 8;
+  int err = drmIoctl(drm->fd(), DRM_IOCTL_MODE_CREATE_DUMB, &create);
+  if (err != 0) {
+    ALOGE("Failed to create shadow buffer errno=%d", errno);
+    local.reset();
+    return local;
+  }
+  local->gem_handles_[0] = create.handle;
+  local->map_pitch_ = create.pitch;
+
+  std::array<uint32_t, HWC_DRM_BO_MAX_PLANES> pitches{create.pitch};
+  std::array<uint32_t, HWC_DRM_BO_MAX_PLANES> offsets{};
+  err = drmModeAddFB2(drm->fd(), bo.width, bo.height, bo.format,
+                      &local->gem_handles_[0], &pitches[0], &offsets[0],
+                      &local->fb_id_, 0);
+  if (err != 0) {
+    ALOGE("could not create shadow drm fb %d", err);
+    local.reset();
+    return local;
+  }
+
+  struct drm_mode_map_dumb map {};
+  map.handle = create.handle;
+  err = drmIoctl(drm->fd(), DRM_IOCTL_MODE_MAP_DUMB, &map);
+  if (err != 0) {
+    ALOGE("Failed to map shadow buffer errno=%d", errno);
+    local.reset();
+    return local;
+  }
+
+  void *addr = mmap(nullptr, create.size, PROT_WRITE, MAP_SHARED, drm->fd(),
+                    static_cast<off_t>(map.offset));
+  if (addr == MAP_FAILED) {
+    ALOGE("Failed to mmap shadow buffer errno=%d", errno);
+    local.reset();
+    return local;
+  }
+  local->map_ = static_cast<uint8_t *>(addr);
+  local->map_size_ = create.size;
+
+  return local;
+}
+
+void DrmFbIdHandle::StartCopy(const hwc_drm_bo_t &bo, int acquire_fence) {
+  WaitCopy();
+  UniqueFd fence(acquire_fence >= 0 ? dup(acquire_fence) : -1);
+  copy_ = std::async(std::launch::async,
+                     [this, bo, fence = std::move(fence)]() {
+                       return CopyFrom(bo, fence.Get());
+                     });
+}
+
+auto DrmFbIdHandle::WaitCopy() -> int {
+  if (!copy_.valid())
+    return 0;
+
+  return copy_.get();
+}
+
+auto DrmFbIdHandle::CopyFrom(const hwc_drm_bo_t &bo, int acquire_fence)
+    -> int {
+  constexpr int kFenceTimeoutMs = 1000;
+  if (acquire_fence >= 0 && sync_wait(acquire_fence, kFenceTimeoutMs) != 0) {
+    ALOGE("Timed out waiting for the source of a shadow copy");
+    return -ETIME;
+  }
+
+  size_t src_size = bo.offsets[0] + size_t(bo.pitches[0]) * bo.height;
+  void *addr = mmap(nullptr, src_size, PROT_READ, MAP_SHARED, bo.prime_fds[0],
+                    0);
+  if (addr == MAP_FAILED) {
+    ALOGE("Failed to mmap prime fd %d errno=%d", bo.prime_fds[0], errno);
+    return -errno;
+  }
+  const uint8_t *src = static_cast<const uint8_t *>(addr) + bo.offsets[0];
+
+  /* Let the exporter flush caches of non-coherent memory */
+  struct dma_buf_sync sync {};
+  sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
+  ioctl(bo.prime_fds[0], DMA_BUF_IOCTL_SYNC, &sync);
+
+  size_t line = std::min(bo.pitches[0], map_pitch_);
+  for (uint32_t y = 0; y < bo.height; y++)
+    memcpy(&map_[size_t(y) * map_pitch_], &src[size_t(y) * bo.pitches[0]],
+           line);
+
+  sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+  ioctl(bo.prime_fds[0], DMA_BUF_IOCTL_SYNC, &sync);
+
+  munmap(addr, src_size);
+  return 0;
+}
+
 DrmFbIdHandle::~DrmFbIdHandle() {
+  WaitCopy();
+  if (map_ != nullptr)
+    munmap(map_, map_size_);
+
   /* Destroy framebuffer object */
   if (drmModeRmFB(drm_->fd(), fb_id_) != 0) {
     ALOGE("Failed to rm fb");
@@ -116,21 +229,24 @@ DrmFbIdHandle::~DrmFbIdHandle() {
   }
 }
 
-auto DrmFbImporter::GetOrCreateFbId(hwc_drm_bo_t *bo)
+auto DrmFbImporter::GetOrCreateFbId(hwc_drm_bo_t *bo, int acquire_fence,
+                                    bool test_only)
     -> std::shared_ptr<DrmFbIdHandle> {
   /* Lookup DrmFbIdHandle in cache first. First handle serves as a cache key. */
   GemHandle first_handle = 0;
   int32_t err = drmPrimeFDToHandle(drm_->fd(), bo->prime_fds[0], &first_handle);
 
   if (err != 0) {
-    ALOGE("Failed to import prime fd %d ret=%d", bo->prime_fds[0], err);
-    return std::shared_ptr<DrmFbIdHandle>();
+    /* Memory of another device this one can't reach */
+    ALOGV("Failed to import prime fd %d ret=%d", bo->prime_fds[0], err);
+    return GetOrCreateShadowFbId(bo, acquire_fence, test_only);
   }
 
   auto drm_fb_id_cached = drm_fb_id_handle_cache_.find(first_handle);
 
   if (drm_fb_id_cached != drm_fb_id_handle_cache_.end()) {
     if (auto drm_fb_id_handle_shared = drm_fb_id_cached->second.lock()) {
+      stats_.direct_hits++;
       return drm_fb_id_handle_shared;
     }
     drm_fb_id_handle_cache_.erase(drm_fb_id_cached);
@@ -144,11 +260,65 @@ auto DrmFbImporter::GetOrCreateFbId(hwc_drm_bo_t *bo)
 
   /* No DrmFbIdHandle found in cache, create framebuffer object */
   auto fb_id_handle = DrmFbIdHandle::CreateInstance(bo, first_handle, drm_);
-  if (fb_id_handle) {
-    drm_fb_id_handle_cache_[first_handle] = fb_id_handle;
+  if (!fb_id_handle) {
+    /* Layout or placement rejected by ADDFB2 */
+    return GetOrCreateShadowFbId(bo, acquire_fence, test_only);
   }
 
+  stats_.direct_misses++;
+  drm_fb_id_handle_cache_[first_handle] = fb_id_handle;
   return fb_id_handle;
 }
 
+auto DrmFbImporter::GetOrCreateShadowFbId(hwc_drm_bo_t *bo, int acquire_fence,
+                                          bool test_only)
+    -> std::shared_ptr<DrmFbIdHandle> {
+  /* The CPU can't detile, only linear single-plane buffers are copied */
+  bool linear = bo->modifiers[0] == DRM_FORMAT_MOD_NONE ||
+                bo->modifiers[0] == DRM_FORMAT_MOD_INVALID;
+  struct stat st {};
+  if (!linear || bo->pitches[1] != 0 || fstat(bo->prime_fds[0], &st) != 0) {
+    ALOGE("Buffer with prime fd %d can't be scanned out", bo->prime_fds[0]);
+    stats_.failures++;
+    return std::shared_ptr<DrmFbIdHandle>();
+  }
+
+  auto entry = std::find_if(shadow_cache_.begin(), shadow_cache_.end(),
+                            [&](const ShadowEntry &e) {
+                              return e.source == st.st_ino &&
+                                     e.width == bo->width &&
+                                     e.height == bo->height &&
+                                     e.format == bo->format;
+                            });
+  if (entry != shadow_cache_.end()) {
+    shadow_cache_.splice(shadow_cache_.begin(), shadow_cache_, entry);
+  } else {
+    constexpr size_t kMaxShadowEntries = 8;
+    if (shadow_cache_.size() >= kMaxShadowEntries)
+      shadow_cache_.pop_back();
+    shadow_cache_.push_front({st.st_ino, bo->width, bo->height, bo->format});
+  }
+
+  /* Skip the shadow still referenced by an applied composition */
+  std::shared_ptr<DrmFbIdHandle> *fb = &shadow_cache_.front().fbs[0];
+  if (*fb && fb->use_count() > 1)
+    fb = &shadow_cache_.front().fbs[1];
+
+  if (*fb && fb->use_count() == 1) {
+    stats_.shadow_hits++;
+  } else {
+    stats_.shadow_misses++;
+    *fb = DrmFbIdHandle::CreateShadowInstance(*bo, drm_);
+    if (!*fb) {
+      stats_.failures++;
+      return std::shared_ptr<DrmFbIdHandle>();
+    }
+  }
+
+  if (!test_only)
+    (*fb)->StartCopy(*bo, acquire_fence);
+
+  return *fb;
+}
+
 }  // namespace android
@@ -20,11 +20,16 @@
 #include <drm/drm_fourcc.h>
 #include <hardware/gralloc.h>
 
+#include <sys/types.h>
+
 #include <array>
+#include <future>
+#include <list>
 #include <map>
 
 #include "drm/DrmDevice.h"
 #include "drmhwcgralloc.h"
+#include "utils/UniqueFd.h"
 
 #ifndef DRM_FORMAT_INVALID
 #define DRM_FORMAT_INVALID 0
@@ -40,6 +45,12 @@ class DrmFbIdHandle {
                              const std::shared_ptr<DrmDevice> &drm)
       -> std::shared_ptr<DrmFbIdHandle>;
 
+  /* Linear dumb buffer matching the geometry of bo, used when bo itself
+   * can't be scanned out by this device */
+  static auto CreateShadowInstance(const hwc_drm_bo_t &bo,
+                                   const std::shared_ptr<DrmDevice> &drm)
+      -> std::shared_ptr<DrmFbIdHandle>;
+
   ~DrmFbIdHandle();
   DrmFbIdHandle(DrmFbIdHandle &&) = delete;
   DrmFbIdHandle(const DrmFbIdHandle &) = delete;
@@ -50,14 +61,29 @@ class DrmFbIdHandle {
     return fb_id_;
   }
 
+  /* Shadow buffers only. Copies the content of the linear single-plane
+   * buffer bo once acquire_fence signals, off the calling thread. bo must
+   * stay valid until WaitCopy(). */
+  void StartCopy(const hwc_drm_bo_t &bo, int acquire_fence);
+  /* Result of the last copy, 0 if there was none */
+  auto WaitCopy() -> int;
+
  private:
   explicit DrmFbIdHandle(std::shared_ptr<DrmDevice> drm)
       : drm_(std::move(drm)){};
 
+  auto CopyFrom(const hwc_drm_bo_t &bo, int acquire_fence) -> int;
+
   const std::shared_ptr<DrmDevice> drm_;
 
   uint32_t fb_id_{};
   std::array<GemHandle, HWC_DRM_BO_MAX_PLANES> gem_handles_{};
+
+  /* CPU mapping of shadow buffers */
+  uint8_t *map_{};
+  size_t map_size_{};
+  uint32_t map_pitch_{};
+  std::future<int> copy_;
 };
 
 class DrmFbImporter {
@@ -70,9 +96,39 @@ class DrmFbImporter {
   auto operator=(const DrmFbImporter &) = delete;
   auto operator=(DrmFbImporter &&) = delete;
 
-  auto GetOrCreateFbId(hwc_drm_bo_t *bo) -> std::shared_ptr<DrmFbIdHandle>;
+  /* Hit rates of the framebuffer and shadow buffer caches */
+  struct Stats {
+    uint64_t direct_hits = 0;
+    uint64_t direct_misses = 0;
+    uint64_t shadow_hits = 0;
+    uint64_t shadow_misses = 0;
+    uint64_t failures = 0;
+  };
+
+  /* Buffers the device can't scan out directly (foreign memory placement,
+   * rejected by ADDFB2) are copied into a cached shadow buffer once
+   * acquire_fence signals. The copy runs in the background, the commit
+   * waits for it with DrmFbIdHandle::WaitCopy(). TEST_ONLY commits only
+   * need the geometry of the shadow, test_only skips the copy. */
+  auto GetOrCreateFbId(hwc_drm_bo_t *bo, int acquire_fence = -1,
+                       bool test_only = false)
+      -> std::shared_ptr<DrmFbIdHandle>;
+
+  /* Unfilled linear buffer of the geometry of bo, for test commits */
+  auto CreateTestFbId(const hwc_drm_bo_t &bo)
+      -> std::shared_ptr<DrmFbIdHandle> {
+    return DrmFbIdHandle::CreateShadowInstance(bo, drm_);
+  }
+
+  auto stats() const -> const Stats & {
+    return stats_;
+  }
 
  private:
+  auto GetOrCreateShadowFbId(hwc_drm_bo_t *bo, int acquire_fence,
+                             bool test_only)
+      -> std::shared_ptr<DrmFbIdHandle>;
+
   void CleanupEmptyCacheElements() {
     for (auto it = drm_fb_id_handle_cache_.begin();
          it != drm_fb_id_handle_cache_.end();) {
@@ -87,6 +143,19 @@ class DrmFbImporter {
   const std::shared_ptr<DrmDevice> drm_;
 
   std::map<GemHandle, std::weak_ptr<DrmFbIdHandle>> drm_fb_id_handle_cache_;
+
+  /* Keyed by the dma-buf inode since the source can't be imported. Two
+   * shadows per source so that the scanned out one is never written. */
+  struct ShadowEntry {
+    ino_t source{};
+    uint32_t width{};
+    uint32_t height{};
+    uint32_t format{};
+    std::array<std::shared_ptr<DrmFbIdHandle>, 2> fbs;
+  };
+  std::list<ShadowEntry> shadow_cache_; /* Most recently used first */
+
+  Stats stats_;
 };
 
 }  // namespace android
@@ -104,6 +104,8 @@ int DrmPlane::Init() {
   }
 
   GetPlaneProperty("IN_FENCE_FD", in_fence_fd_property_, Presence::kOptional);
+  GetPlaneProperty("FB_DAMAGE_CLIPS", fb_damage_clips_property_,
+                   Presence::kOptional);
 
   if (HasNonRgbFormat()) {
     if (GetPlaneProperty("COLOR_ENCODING", color_encoding_propery_,
@@ -142,6 +144,18 @@ bool DrmPlane::GetCrtcSupported(const DrmCrtc &crtc) const {
 }
 
 bool DrmPlane::IsValidForLayer(DrmHwcLayer *layer) {
+  auto src_w = uint32_t(layer->source_crop.right - layer->source_crop.left);
+  auto dst_w = uint32_t(layer->display_frame.right -
+                        layer->display_frame.left);
+  return IsValidForLayerPart(layer, std::max(src_w, dst_w));
+}
+
+bool DrmPlane::IsValidForLayerPart(DrmHwcLayer *layer, uint32_t width) {
+  if (max_width_ != 0 && width > max_width_) {
+    ALOGV("Layer is wider than plane %d", id_);
+    return false;
+  }
+
   if (!rotation_property_) {
     if (layer->transform != DrmHwcTransform::kIdentity) {
       ALOGV("No rotation property on plane %d", id_);
@@ -212,6 +226,14 @@ static uint64_t ToDrmRotation(DrmHwcTransform transform) {
 
 auto DrmPlane::AtomicSetState(drmModeAtomicReq &pset, DrmHwcLayer &layer,
                               uint32_t zpos, uint32_t crtc_id) -> int {
+  return AtomicSetState(pset, layer, layer.source_crop, layer.display_frame,
+                        zpos, crtc_id);
+}
+
+auto DrmPlane::AtomicSetState(drmModeAtomicReq &pset, DrmHwcLayer &layer,
+                              const hwc_frect_t &source_crop,
+                              const hwc_rect_t &display_frame, uint32_t zpos,
+                              uint32_t crtc_id) -> int {
   if (!layer.FbIdHandle) {
     ALOGE("Expected a valid framebuffer for pset");
     return -EINVAL;
@@ -235,20 +257,20 @@ auto DrmPlane::AtomicSetState(drmModeAtomicReq &pset, DrmHwcLayer &layer,
 
   if (!crtc_property_.AtomicSet(pset, crtc_id) ||
       !fb_property_.AtomicSet(pset, layer.FbIdHandle->GetFbId()) ||
-      !crtc_x_property_.AtomicSet(pset, layer.display_frame.left) ||
-      !crtc_y_property_.AtomicSet(pset, layer.display_frame.top) ||
-      !crtc_w_property_.AtomicSet(pset, layer.display_frame.right -
-                                            layer.display_frame.left) ||
-      !crtc_h_property_.AtomicSet(pset, layer.display_frame.bottom -
-                                            layer.display_frame.top) ||
-      !src_x_property_.AtomicSet(pset, (int)(layer.source_crop.left) << 16) ||
-      !src_y_property_.AtomicSet(pset, (int)(layer.source_crop.top) << 16) ||
-      !src_w_property_.AtomicSet(pset, (int)(layer.source_crop.right -
-                                             layer.source_crop.left)
-                                           << 16) ||
-      !src_h_property_.AtomicSet(pset, (int)(layer.source_crop.bottom -
-                                             layer.source_crop.top)
-                                           << 16)) {
+      !crtc_x_property_.AtomicSet(pset, display_frame.left) ||
+      !crtc_y_property_.AtomicSet(pset, display_frame.top) ||
+      !crtc_w_property_.AtomicSet(pset, display_frame.right -
+                                            display_frame.left) ||
+      !crtc_h_property_.AtomicSet(pset, display_frame.bottom -
+                                            display_frame.top) ||
+      !src_x_property_.AtomicSet(pset, (int)(source_crop.left) << 16) ||
+      !src_y_property_.AtomicSet(pset, (int)(source_crop.top) << 16) ||
+      !src_w_property_.AtomicSet(pset,
+                                 (int)(source_crop.right - source_crop.left)
+                                     << 16) ||
+      !src_h_property_.AtomicSet(pset,
+                                 (int)(source_crop.bottom - source_crop.top)
+                                     << 16)) {
     return -EINVAL;
   }
 
@@ -281,6 +303,37 @@ auto DrmPlane::AtomicSetState(drmModeAtomicReq &pset, DrmHwcLayer &layer,
   return 0;
 }
 
+auto DrmPlane::AtomicSetFlip(drmModeAtomicReq &pset, DrmHwcLayer &layer)
+    -> int {
+  if (!layer.FbIdHandle) {
+    ALOGE("Expected a valid framebuffer for pset");
+    return -EINVAL;
+  }
+
+  if (layer.acquire_fence &&
+      !in_fence_fd_property_.AtomicSet(pset, layer.acquire_fence.Get())) {
+    return -EINVAL;
+  }
+
+  if (!fb_property_.AtomicSet(pset, layer.FbIdHandle->GetFbId()))
+    return -EINVAL;
+
+  return 0;
+}
+
+auto DrmPlane::AtomicSetDamage(drmModeAtomicReq &pset, uint32_t fb_id,
+                               uint32_t damage_blob_id) -> int {
+  if (!fb_damage_clips_property_)
+    return -EOPNOTSUPP;
+
+  if (!fb_property_.AtomicSet(pset, fb_id) ||
+      !fb_damage_clips_property_.AtomicSet(pset, damage_blob_id)) {
+    return -EINVAL;
+  }
+
+  return 0;
+}
+
 auto DrmPlane::AtomicDisablePlane(drmModeAtomicReq &pset) -> int {
   if (!crtc_property_.AtomicSet(pset, 0) || !fb_property_.AtomicSet(pset, 0)) {
     return -EINVAL;
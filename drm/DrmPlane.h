@@ -42,14 +42,44 @@ class DrmPlane {
 
   bool GetCrtcSupported(const DrmCrtc &crtc) const;
   bool IsValidForLayer(DrmHwcLayer *layer);
+  /* Same as IsValidForLayer() for a part of the layer, split off to stay
+   * within the width limit of the plane */
+  bool IsValidForLayerPart(DrmHwcLayer *layer, uint32_t width);
+
+  /* Widest source or destination rect the plane scans out, 0 if unlimited.
+   * KMS doesn't expose the limit, it is configured per device */
+  uint32_t max_width() const {
+    return max_width_;
+  }
+  void set_max_width(uint32_t max_width) {
+    max_width_ = max_width;
+  }
 
   uint32_t type() const;
 
   bool IsFormatSupported(uint32_t format) const;
   bool HasNonRgbFormat() const;
+  bool HasRotation() const {
+    return rotation_property_;
+  }
+  bool HasDamageClips() const {
+    return fb_damage_clips_property_;
+  }
 
   auto AtomicSetState(drmModeAtomicReq &pset, DrmHwcLayer &layer, uint32_t zpos,
                       uint32_t crtc_id) -> int;
+  /* Scans out the source_crop part of the layer at display_frame */
+  auto AtomicSetState(drmModeAtomicReq &pset, DrmHwcLayer &layer,
+                      const hwc_frect_t &source_crop,
+                      const hwc_rect_t &display_frame, uint32_t zpos,
+                      uint32_t crtc_id) -> int;
+  /* Re-latches the framebuffer the plane already scans out, with only the
+   * given FB_DAMAGE_CLIPS blob flushed to the display */
+  auto AtomicSetDamage(drmModeAtomicReq &pset, uint32_t fb_id,
+                       uint32_t damage_blob_id) -> int;
+  /* Only the properties an asynchronous flip may change: the framebuffer
+   * and its acquire fence */
+  auto AtomicSetFlip(drmModeAtomicReq &pset, DrmHwcLayer &layer) -> int;
   auto AtomicDisablePlane(drmModeAtomicReq &pset) -> int;
   const DrmProperty &zpos_property() const;
 
@@ -65,6 +95,7 @@ class DrmPlane {
   uint32_t possible_crtc_mask_;
 
   uint32_t type_{};
+  uint32_t max_width_ = 0;
 
   std::vector<uint32_t> formats_;
 
@@ -83,6 +114,7 @@ class DrmPlane {
   DrmProperty alpha_property_;
   DrmProperty blend_property_;
   DrmProperty in_fence_fd_property_;
+  DrmProperty fb_damage_clips_property_;
   DrmProperty color_encoding_propery_;
   DrmProperty color_range_property_;
 
@@ -31,17 +31,16 @@ namespace android {
 
 VSyncWorker::VSyncWorker()
     : Worker("vsync", HAL_PRIORITY_URGENT_DISPLAY),
-      drm_(nullptr),
-      display_(-1),
+      pipeline_(nullptr),
       enabled_(false),
+      vrr_enabled_(false),
       last_timestamp_(-1) {
 }
 
-auto VSyncWorker::Init(DrmDevice *drm, int display,
+auto VSyncWorker::Init(DrmDisplayPipeline *pipeline,
                        std::function<void(uint64_t /*timestamp*/)> callback)
     -> int {
-  drm_ = drm;
-  display_ = display;
+  pipeline_ = pipeline;
   callback_ = std::move(callback);
 
   return InitWorker();
@@ -56,6 +55,10 @@ void VSyncWorker::VSyncControl(bool enabled) {
   Signal();
 }
 
+void VSyncWorker::VrrControl(bool enabled) {
+  vrr_enabled_ = enabled;
+}
+
 /*
  * Returns the timestamp of the next vsync in phase with last_timestamp_.
  * For example:
@@ -86,12 +89,12 @@ int VSyncWorker::SyntheticWaitVBlank(int64_t *timestamp) {
     return ret;
 
   float refresh = 60.0F;  // Default to 60Hz refresh rate
-  DrmConnector *conn = drm_->GetConnectorForDisplay(display_);
-  if (conn && conn->active_mode().v_refresh() != 0.0F)
+  DrmConnector *conn = pipeline_->connector;
+  if (conn->active_mode().v_refresh() != 0.0F)
     refresh = conn->active_mode().v_refresh();
   else
     ALOGW("Vsync worker active with conn=%p refresh=%f\n", conn,
-          conn ? conn->active_mode().v_refresh() : 0.0F);
+          conn->active_mode().v_refresh());
 
   int64_t phased_timestamp = GetPhasedVSync(kOneSecondNs /
                                                 static_cast<int>(refresh),
@@ -121,16 +124,10 @@ void VSyncWorker::Routine() {
     }
   }
 
-  int display = display_;
+  /* The CRTC may change on hotplug, under the lock */
+  uint32_t high_crtc = (pipeline_->crtc->pipe() << DRM_VBLANK_HIGH_CRTC_SHIFT);
   Unlock();
 
-  DrmCrtc *crtc = drm_->GetCrtcForDisplay(display);
-  if (!crtc) {
-    ALOGE("Failed to get crtc for display");
-    return;
-  }
-  uint32_t high_crtc = (crtc->pipe() << DRM_VBLANK_HIGH_CRTC_SHIFT);
-
   drmVBlank vblank;
   memset(&vblank, 0, sizeof(vblank));
   vblank.request.type = (drmVBlankSeqType)(DRM_VBLANK_RELATIVE |
@@ -139,9 +136,14 @@ void VSyncWorker::Routine() {
   vblank.request.sequence = 1;
 
   int64_t timestamp = 0;
-  ret = drmWaitVBlank(drm_->fd(), &vblank);
-  if (ret == -EINTR)
-    return;
+  if (vrr_enabled_) {
+    /* Keep in phase with the last vblank reported by the hardware */
+    ret = -EAGAIN;
+  } else {
+    ret = drmWaitVBlank(pipeline_->device->fd(), &vblank);
+    if (ret == -EINTR)
+      return;
+  }
 
   if (ret) {
     ret = SyntheticWaitVBlank(&timestamp);
@@ -27,6 +27,7 @@
 #include <map>
 
 #include "DrmDevice.h"
+#include "DrmDisplayPipeline.h"
 #include "utils/Worker.h"
 
 namespace android {
@@ -36,11 +37,15 @@ class VSyncWorker : public Worker {
   VSyncWorker();
   ~VSyncWorker() override = default;
 
-  auto Init(DrmDevice *drm, int display,
+  auto Init(DrmDisplayPipeline *pipeline,
             std::function<void(uint64_t /*timestamp*/)> callback) -> int;
 
   void VSyncControl(bool enabled);
 
+  /* With variable refresh rate the hardware vblank follows the presented
+   * frames, so the worker generates vsync at the nominal mode rate instead */
+  void VrrControl(bool enabled);
+
  protected:
   void Routine() override;
 
@@ -48,12 +53,12 @@ class VSyncWorker : public Worker {
   int64_t GetPhasedVSync(int64_t frame_ns, int64_t current) const;
   int SyntheticWaitVBlank(int64_t *timestamp);
 
-  DrmDevice *drm_;
+  DrmDisplayPipeline *pipeline_;
 
   std::function<void(uint64_t /*timestamp*/)> callback_;
 
-  int display_;
   std::atomic_bool enabled_;
+  std::atomic_bool vrr_enabled_;
   int64_t last_timestamp_;
 };
 }  // namespace android
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_DRM_HWC_COMMANDS_H_
+#define ANDROID_DRM_HWC_COMMANDS_H_
+
+#include <cutils/native_handle.h>
+#include <hardware/hwcomposer2.h>
+#include <stdint.h>
+
+/*
+ * Batched layer state updates, applied with a single getFunction() entry
+ * point instead of one hook call per property.
+ *
+ * The buffer is a sequence of 32-bit words. Each command starts with a
+ * header word holding the opcode in the upper and the payload length in
+ * words in the lower 16 bits, the same layout as the composer command
+ * writer. Buffers, fences and sideband streams are passed by index into a
+ * separate handle array, fences as handles with a single fd that is
+ * duplicated by the callee.
+ */
+
+/* Vendor function descriptor, outside of the hwc2_function_descriptor_t
+ * range */
+#define HWC2_FUNCTION_DRM_EXECUTE_COMMANDS 0x10001
+
+enum DrmHwcCommand : uint32_t {
+  kDrmHwcCommandLengthMask = 0xffff,
+  kDrmHwcCommandOpcodeShift = 16,
+  kDrmHwcCommandOpcodeMask = 0xffffU << kDrmHwcCommandOpcodeShift,
+
+  /* Display or layer id, 64 bit: low word, high word */
+  kDrmHwcCommandSelectDisplay = 0x000 << kDrmHwcCommandOpcodeShift,
+  kDrmHwcCommandSelectLayer = 0x001 << kDrmHwcCommandOpcodeShift,
+
+  /* x, y */
+  kDrmHwcCommandSetLayerCursorPosition = 0x300 << kDrmHwcCommandOpcodeShift,
+  /* slot (unused), buffer handle index, fence handle index or ~0 */
+  kDrmHwcCommandSetLayerBuffer = 0x301 << kDrmHwcCommandOpcodeShift,
+  /* 4 words per rect */
+  kDrmHwcCommandSetLayerSurfaceDamage = 0x302 << kDrmHwcCommandOpcodeShift,
+  kDrmHwcCommandSetLayerBlendMode = 0x400 << kDrmHwcCommandOpcodeShift,
+  /* RGBA8888, red in the lowest byte */
+  kDrmHwcCommandSetLayerColor = 0x401 << kDrmHwcCommandOpcodeShift,
+  kDrmHwcCommandSetLayerCompositionType = 0x402 << kDrmHwcCommandOpcodeShift,
+  kDrmHwcCommandSetLayerDataspace = 0x403 << kDrmHwcCommandOpcodeShift,
+  /* left, top, right, bottom */
+  kDrmHwcCommandSetLayerDisplayFrame = 0x404 << kDrmHwcCommandOpcodeShift,
+  /* float bits */
+  kDrmHwcCommandSetLayerPlaneAlpha = 0x405 << kDrmHwcCommandOpcodeShift,
+  /* stream handle index */
+  kDrmHwcCommandSetLayerSidebandStream = 0x406 << kDrmHwcCommandOpcodeShift,
+  /* left, top, right, bottom as float bits */
+  kDrmHwcCommandSetLayerSourceCrop = 0x407 << kDrmHwcCommandOpcodeShift,
+  kDrmHwcCommandSetLayerTransform = 0x408 << kDrmHwcCommandOpcodeShift,
+  /* 4 words per rect */
+  kDrmHwcCommandSetLayerVisibleRegion = 0x409 << kDrmHwcCommandOpcodeShift,
+  kDrmHwcCommandSetLayerZOrder = 0x40a << kDrmHwcCommandOpcodeShift,
+
+  /* Vendor extension: 1 to let the layer flip without waiting for vblank
+   * when it is the only one on a fullscreen plane, 0 to turn it off */
+  kDrmHwcCommandSetLayerLowLatency = 0x800 << kDrmHwcCommandOpcodeShift,
+  /* Vendor extension: 1 to keep the layer's buffer on its plane while the
+   * producer draws into it, 0 to go back to regular buffer swaps */
+  kDrmHwcCommandSetLayerFrontBuffer = 0x801 << kDrmHwcCommandOpcodeShift,
+  /* Vendor extension, front buffer layers only: 4 words per rect in buffer
+   * coordinates, flushed to the display right away */
+  kDrmHwcCommandFlushLayerDamage = 0x802 << kDrmHwcCommandOpcodeShift,
+};
+
+/*
+ * Returns the first error, with out_error_offset set to the word offset of
+ * the failing command. Commands before it have been applied.
+ */
+typedef int32_t /*hwc2_error_t*/ (*HWC2_PFN_DRM_EXECUTE_COMMANDS)(
+    hwc2_device_t *device, uint32_t num_words, const uint32_t *words,
+    uint32_t num_handles, const native_handle_t *const *handles,
+    uint32_t *out_error_offset);
+
+#endif  // ANDROID_DRM_HWC_COMMANDS_H_
@@ -22,6 +22,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include <array>
 #include <vector>
 
 #include "drm/DrmFbImporter.h"
@@ -45,6 +46,26 @@ enum class DrmHwcSampleRange : int32_t {
   kLimitedRange,
 };
 
+/* HDR transfer functions that can be passed through to the sink */
+enum class DrmHwcTransfer : int32_t {
+  kUndefined,
+  kSt2084,
+  kHlg,
+};
+
+/* Mastering display and content light level metadata of an HDR layer.
+ * Chromaticities are CIE 1931 xy, luminances are in cd/m2, 0 if unknown. */
+struct DrmHwcHdrMetadata {
+  std::array<float, 2> red{};
+  std::array<float, 2> green{};
+  std::array<float, 2> blue{};
+  std::array<float, 2> white{};
+  float max_luminance = 0.0F;
+  float min_luminance = 0.0F;
+  float max_cll = 0.0F;
+  float max_fall = 0.0F;
+};
+
 enum DrmHwcTransform : uint32_t {
   kIdentity = 0,
   kFlipH = 1 << 0,
@@ -62,6 +83,8 @@ enum class DrmHwcBlending : int32_t {
 
 struct DrmHwcLayer {
   buffer_handle_t sf_handle = NULL;
+  /* Set instead of sf_handle for sideband layers */
+  const native_handle_t *sideband_stream = nullptr;
   hwc_drm_bo_t buffer_info{};
   std::shared_ptr<DrmFbIdHandle> FbIdHandle;
 
@@ -73,10 +96,13 @@ struct DrmHwcLayer {
   hwc_rect_t display_frame;
   DrmHwcColorSpace color_space;
   DrmHwcSampleRange sample_range;
+  DrmHwcTransfer transfer = DrmHwcTransfer::kUndefined;
+  DrmHwcHdrMetadata hdr_metadata;
 
   UniqueFd acquire_fence;
 
-  int ImportBuffer(DrmDevice *drmDevice);
+  /* Buffers imported for TEST_ONLY commits aren't copied into shadows */
+  int ImportBuffer(DrmDevice *drmDevice, bool test_only = false);
 
   bool protected_usage() const {
     return (gralloc_buffer_usage & GRALLOC_USAGE_PROTECTED) ==
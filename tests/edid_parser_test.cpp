@@ -0,0 +1,235 @@
+#include "utils/EdidParser.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <random>
+#include <vector>
+
+using android::EdidInfo;
+using android::ParseEdid;
+
+namespace {
+
+/* Corpus: a laptop panel without extensions, an HDMI 2.1 TV with a CTA-861
+ * extension, and both halves of a DisplayID tiled monitor */
+const std::vector<uint8_t> kLaptopEdid = {
+    0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x09, 0xe5, 0x47, 0x07,
+    0x00, 0x00, 0x00, 0x00, 0x01, 0x1e, 0x01, 0x04, 0xb5, 0x1f, 0x11, 0x78,
+    0x3a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1a, 0x36, 0x80, 0xa0, 0x70, 0x38,
+    0x1f, 0x40, 0x30, 0x20, 0x35, 0x00, 0x50, 0x1d, 0x74, 0x00, 0x00, 0x1a,
+    0x00, 0x00, 0x00, 0xfe, 0x00, 0x42, 0x4f, 0x45, 0x20, 0x43, 0x51, 0x0a,
+    0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x00, 0x00, 0x00, 0xfe, 0x00, 0x4e,
+    0x45, 0x31, 0x34, 0x30, 0x46, 0x48, 0x4d, 0x2d, 0x4e, 0x36, 0x31, 0x0a,
+    0x00, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xc9,
+};
+
+const std::vector<uint8_t> kTvEdid = {
+    0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x1e, 0x6d, 0xb4, 0xc0,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x1e, 0x01, 0x04, 0xb5, 0xa0, 0x5a, 0x78,
+    0x3a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x3a, 0x80, 0x18, 0x71, 0x38,
+    0x2d, 0x40, 0x30, 0x20, 0x35, 0x00, 0x50, 0x1d, 0x74, 0x00, 0x00, 0x1a,
+    0x00, 0x00, 0x00, 0xfd, 0x00, 0x18, 0x78, 0x1e, 0xa0, 0x3c, 0x00, 0x0a,
+    0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x00, 0x00, 0x00, 0xfc, 0x00, 0x4c,
+    0x47, 0x20, 0x54, 0x56, 0x20, 0x53, 0x53, 0x43, 0x52, 0x32, 0x0a, 0x20,
+    0x00, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0xa2, 0x02, 0x03, 0x33, 0xf0,
+    0x4f, 0x90, 0x1f, 0x04, 0x13, 0x05, 0x14, 0x03, 0x12, 0x10, 0x16, 0x61,
+    0x60, 0x5d, 0x5e, 0x5f, 0x68, 0x03, 0x0c, 0x00, 0x10, 0x00, 0xb8, 0x3c,
+    0x0b, 0x6a, 0xd8, 0x5d, 0xc4, 0x01, 0x78, 0x88, 0x03, 0x02, 0x30, 0x78,
+    0xe3, 0x05, 0xc3, 0x80, 0xe6, 0x06, 0x0d, 0x01, 0x80, 0x60, 0x40, 0x01,
+    0x1d, 0x00, 0x72, 0x51, 0xd0, 0x1e, 0x20, 0x30, 0x20, 0x35, 0x00, 0x50,
+    0x1d, 0x74, 0x00, 0x00, 0x1a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x49,
+};
+
+const std::vector<uint8_t> kTiledLeftEdid = {
+    0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x10, 0xac, 0xb6, 0x40,
+    0x30, 0x4b, 0x4b, 0x4c, 0x01, 0x1e, 0x01, 0x04, 0xb5, 0x3c, 0x22, 0x78,
+    0x3a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x4d, 0xd0, 0x00, 0xa0, 0xa0, 0x40,
+    0x4d, 0xb0, 0x30, 0x20, 0x35, 0x00, 0x50, 0x1d, 0x74, 0x00, 0x00, 0x1a,
+    0x00, 0x00, 0x00, 0xfc, 0x00, 0x44, 0x45, 0x4c, 0x4c, 0x20, 0x55, 0x50,
+    0x32, 0x37, 0x31, 0x35, 0x4b, 0x0a, 0x00, 0x00, 0x00, 0x10, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x18, 0x70, 0x12, 0x18, 0x03,
+    0x00, 0x12, 0x00, 0x15, 0x82, 0x10, 0x00, 0x00, 0xff, 0x09, 0x3f, 0x0b,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0xac, 0x00, 0xb6, 0x40, 0x30, 0x4b,
+    0x4b, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0xe0,
+};
+
+const std::vector<uint8_t> kTiledRightEdid = {
+    0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x10, 0xac, 0xb6, 0x40,
+    0x30, 0x4b, 0x4b, 0x4c, 0x01, 0x1e, 0x01, 0x04, 0xb5, 0x3c, 0x22, 0x78,
+    0x3a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x4d, 0xd0, 0x00, 0xa0, 0xa0, 0x40,
+    0x4d, 0xb0, 0x30, 0x20, 0x35, 0x00, 0x50, 0x1d, 0x74, 0x00, 0x00, 0x1a,
+    0x00, 0x00, 0x00, 0xfc, 0x00, 0x44, 0x45, 0x4c, 0x4c, 0x20, 0x55, 0x50,
+    0x32, 0x37, 0x31, 0x35, 0x4b, 0x0a, 0x00, 0x00, 0x00, 0x10, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x18, 0x70, 0x12, 0x18, 0x03,
+    0x00, 0x12, 0x00, 0x15, 0x82, 0x10, 0x10, 0x00, 0xff, 0x09, 0x3f, 0x0b,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0xac, 0x00, 0xb6, 0x40, 0x30, 0x4b,
+    0x4b, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0xd0,
+};
+
+const std::vector<const std::vector<uint8_t> *> kCorpus = {
+    &kLaptopEdid, &kTvEdid, &kTiledLeftEdid, &kTiledRightEdid};
+
+EdidInfo Parse(const std::vector<uint8_t> &edid) {
+  return ParseEdid(edid.data(), edid.size());
+}
+
+}  // namespace
+
+// NOLINTNEXTLINE: required by gtest macros
+TEST(EdidParserTest, LaptopPanel) {
+  EdidInfo info = Parse(kLaptopEdid);
+  ASSERT_TRUE(info.valid);
+  ASSERT_EQ("BOE", info.manufacturer);
+  ASSERT_EQ(0x0747, info.product_code);
+  ASSERT_EQ(310U, info.width_mm);
+  ASSERT_EQ(170U, info.height_mm);
+  ASSERT_TRUE(info.preferred_timing);
+  ASSERT_EQ(1920U, info.preferred_timing->hdisplay);
+  ASSERT_EQ(1080U, info.preferred_timing->vdisplay);
+  ASSERT_NEAR(60.0F, info.preferred_timing->v_refresh(), 0.1F);
+  ASSERT_TRUE(info.name.empty());
+  ASSERT_FALSE(info.hdr);
+  ASSERT_FALSE(info.tile);
+  ASSERT_FALSE(info.vrr);
+}
+
+// NOLINTNEXTLINE: required by gtest macros
+TEST(EdidParserTest, HdmiTv) {
+  EdidInfo info = Parse(kTvEdid);
+  ASSERT_TRUE(info.valid);
+  ASSERT_EQ("GSM", info.manufacturer);
+  ASSERT_EQ(0x01010101U, info.serial);
+  ASSERT_EQ("LG TV SSCR2", info.name);
+  ASSERT_EQ(1600U, info.width_mm);
+  ASSERT_EQ(900U, info.height_mm);
+  ASSERT_NEAR(60.0F, info.preferred_timing->v_refresh(), 0.1F);
+
+  ASSERT_TRUE(info.content_types.graphics);
+  ASSERT_TRUE(info.content_types.photo);
+  ASSERT_FALSE(info.content_types.cinema);
+  ASSERT_TRUE(info.content_types.game);
+  ASSERT_TRUE(info.allm);
+
+  /* HDMI Forum VRR range overrides the range limits descriptor */
+  ASSERT_TRUE(info.vrr);
+  ASSERT_EQ(48U, info.min_v_refresh);
+  ASSERT_EQ(120U, info.max_v_refresh);
+
+  ASSERT_TRUE(info.colorimetry & android::kEdidColorimetryBt2020Rgb);
+  ASSERT_TRUE(info.colorimetry & android::kEdidColorimetryDciP3);
+  ASSERT_FALSE(info.colorimetry & android::kEdidColorimetryOpRgb);
+
+  ASSERT_TRUE(info.hdr);
+  ASSERT_TRUE(info.hdr->sdr);
+  ASSERT_TRUE(info.hdr->hdr10);
+  ASSERT_TRUE(info.hdr->hlg);
+  ASSERT_NEAR(800.0F, info.hdr->max_luminance, 0.5F);
+  ASSERT_NEAR(400.0F, info.hdr->max_average_luminance, 0.5F);
+  ASSERT_NEAR(0.5F, info.hdr->min_luminance, 0.01F);
+}
+
+// NOLINTNEXTLINE: required by gtest macros
+TEST(EdidParserTest, TiledMonitor) {
+  EdidInfo left = Parse(kTiledLeftEdid);
+  EdidInfo right = Parse(kTiledRightEdid);
+  ASSERT_TRUE(left.valid);
+  ASSERT_TRUE(left.tile);
+  ASSERT_TRUE(right.tile);
+  ASSERT_EQ(2U, left.tile->num_h_tiles);
+  ASSERT_EQ(1U, left.tile->num_v_tiles);
+  ASSERT_EQ(0U, left.tile->h_location);
+  ASSERT_EQ(1U, right.tile->h_location);
+  ASSERT_EQ(2560U, left.tile->tile_width);
+  ASSERT_EQ(2880U, left.tile->tile_height);
+  ASSERT_EQ(left.tile->group_id, right.tile->group_id);
+}
+
+// NOLINTNEXTLINE: required by gtest macros
+TEST(EdidParserTest, Truncated) {
+  ASSERT_FALSE(ParseEdid(nullptr, 0).valid);
+  ASSERT_FALSE(ParseEdid(kTvEdid.data(), 127).valid);
+
+  /* Extensions that are announced but missing are ignored */
+  EdidInfo info = ParseEdid(kTvEdid.data(), 128);
+  ASSERT_TRUE(info.valid);
+  ASSERT_FALSE(info.hdr);
+}
+
+/* Mutated corpus entries must never make the parser read out of bounds,
+ * run this under ASan to catch it */
+// NOLINTNEXTLINE: required by gtest macros
+TEST(EdidParserTest, Fuzz) {
+  constexpr int kIterations = 20000;
+  std::mt19937 rng(0x45444944);
+  for (int i = 0; i < kIterations; i++) {
+    std::vector<uint8_t> edid = *kCorpus[rng() % kCorpus.size()];
+
+    int mutations = 1 + int(rng() % 16);
+    for (int m = 0; m < mutations; m++)
+      edid[rng() % edid.size()] = uint8_t(rng());
+    if (rng() % 4 == 0)
+      edid.resize(rng() % (edid.size() + 1));
+
+    /* Copy to an exactly sized heap buffer so overruns are detected */
+    std::unique_ptr<uint8_t[]> data(new uint8_t[edid.size()]);
+    std::copy(edid.begin(), edid.end(), data.get());
+    EdidInfo info = ParseEdid(data.get(), edid.size());
+
+    ASSERT_LE(info.name.size(), 13U);
+    if (info.tile) {
+      ASSERT_GE(info.tile->num_h_tiles, 1U);
+      ASSERT_GE(info.tile->num_v_tiles, 1U);
+    }
+  }
+}
+
+// NOLINTNEXTLINE: required by gtest macros
+TEST(EdidParserTest, Benchmark) {
+  constexpr int kIterations = 100000;
+  size_t checksum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kIterations; i++)
+    checksum += Parse(*kCorpus[i % kCorpus.size()]).name.size();
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+                .count();
+  RecordProperty("ns_per_edid", int(ns / kIterations));
+  ASSERT_NE(0U, checksum);
+}
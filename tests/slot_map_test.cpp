@@ -0,0 +1,55 @@
+#include "utils/SlotMap.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+using android::SlotMap;
+
+TEST(SlotMapTest, EmplaceGetErase) {
+  SlotMap<std::string> map;
+  auto a = map.Emplace("a");
+  auto b = map.Emplace("b");
+
+  ASSERT_NE(a, b);
+  ASSERT_EQ(map.size(), 2);
+  ASSERT_EQ(*map.Get(a), "a");
+  ASSERT_EQ(*map.Get(b), "b");
+
+  ASSERT_TRUE(map.Erase(a));
+  ASSERT_FALSE(map.Erase(a));
+  ASSERT_EQ(map.Get(a), nullptr);
+  ASSERT_EQ(map.size(), 1);
+}
+
+TEST(SlotMapTest, StaleHandleAfterReuse) {
+  SlotMap<int> map;
+  auto a = map.Emplace(1);
+  map.Erase(a);
+
+  /* The slot is reused with a new generation */
+  auto b = map.Emplace(2);
+  ASSERT_NE(a, b);
+  ASSERT_EQ(map.Get(a), nullptr);
+  ASSERT_EQ(*map.Get(b), 2);
+}
+
+TEST(SlotMapTest, IterateSkipsFreeSlots) {
+  SlotMap<int> map;
+  auto a = map.Emplace(1);
+  map.Emplace(2);
+  auto c = map.Emplace(3);
+  map.Erase(a);
+  map.Erase(c);
+  map.Emplace(4);
+
+  int sum = 0;
+  size_t count = 0;
+  for (auto [handle, value] : map) {
+    ASSERT_EQ(*map.Get(handle), value);
+    sum += value;
+    count++;
+  }
+  ASSERT_EQ(count, map.size());
+  ASSERT_EQ(sum, 6);
+}
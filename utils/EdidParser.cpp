@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "EdidParser.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace android {
+
+constexpr size_t kEdidBlockSize = 128;
+constexpr size_t kEdidExtensionCountOffset = 126;
+constexpr size_t kEdidDescriptorOffset = 54;
+constexpr size_t kEdidDescriptorSize = 18;
+constexpr size_t kEdidDescriptorCount = 4;
+
+constexpr uint8_t kCtaExtensionTag = 0x02;
+constexpr uint8_t kDisplayIdExtensionTag = 0x70;
+
+constexpr uint8_t kCtaVendorTag = 3;
+constexpr uint8_t kCtaExtendedTag = 7;
+constexpr uint8_t kCtaColorimetryTag = 0x05;
+constexpr uint8_t kCtaHdrStaticMetadataTag = 0x06;
+constexpr uint32_t kHdmiOui = 0x000c03;
+constexpr uint32_t kHdmiForumOui = 0xc45dd8;
+
+constexpr uint8_t kDescriptorName = 0xfc;
+constexpr uint8_t kDescriptorRangeLimits = 0xfd;
+
+constexpr uint8_t kDisplayIdParameters = 0x01;
+constexpr uint8_t kDisplayIdTiledDisplay = 0x12;
+constexpr uint8_t kDisplayId2TiledDisplay = 0x28;
+constexpr uint8_t kDisplayIdCta = 0x81;
+
+/* CTA-861.3 luminance code values */
+static float MaxLuminance(uint8_t cv) {
+  return 50.0F * std::pow(2.0F, float(cv) / 32.0F);
+}
+
+static float MinLuminance(uint8_t cv, float max_luminance) {
+  float ratio = float(cv) / 255.0F;
+  return max_luminance * ratio * ratio / 100.0F;
+}
+
+static EdidTiming ParseDetailedTiming(const uint8_t *d) {
+  constexpr uint32_t kClockUnitKhz = 10;
+  EdidTiming timing;
+  timing.clock_khz = (d[0] | (d[1] << 8)) * kClockUnitKhz;
+  timing.hdisplay = d[2] | ((d[4] & 0xf0) << 4);
+  timing.htotal = timing.hdisplay + (d[3] | ((d[4] & 0x0f) << 8));
+  timing.vdisplay = d[5] | ((d[7] & 0xf0) << 4);
+  timing.vtotal = timing.vdisplay + (d[6] | ((d[7] & 0x0f) << 8));
+  timing.interlaced = (d[17] & 0x80) != 0;
+  return timing;
+}
+
+static void ParseDescriptor(const uint8_t *d, EdidInfo &info) {
+  if (d[0] != 0 || d[1] != 0) {
+    if (!info.preferred_timing)
+      info.preferred_timing = ParseDetailedTiming(d);
+    return;
+  }
+
+  switch (d[3]) {
+    case kDescriptorName: {
+      const uint8_t *text = &d[5];
+      const uint8_t *end = std::find(text, &d[kEdidDescriptorSize], '\n');
+      info.name.assign(text, end);
+      while (!info.name.empty() && info.name.back() == ' ')
+        info.name.pop_back();
+      break;
+    }
+    case kDescriptorRangeLimits:
+      /* Rate offsets add 255 Hz */
+      info.min_v_refresh = d[5] + ((d[4] & 0x01) ? 255 : 0);
+      info.max_v_refresh = d[6] + ((d[4] & 0x02) ? 255 : 0);
+      break;
+    default:
+      break;
+  }
+}
+
+static void ParseBaseBlock(const uint8_t *block, EdidInfo &info) {
+  uint8_t checksum = 0;
+  for (size_t i = 0; i < kEdidBlockSize; i++)
+    checksum += block[i];
+  info.valid = checksum == 0;
+
+  /* Three 5-bit letters, 'A' is 1 */
+  uint16_t pnp = (block[8] << 8) | block[9];
+  for (int shift = 10; shift >= 0; shift -= 5) {
+    int letter = (pnp >> shift) & 0x1f;
+    if (letter < 1 || letter > 26) {
+      info.manufacturer.clear();
+      break;
+    }
+    info.manufacturer.push_back(char('A' + letter - 1));
+  }
+  info.product_code = block[10] | (block[11] << 8);
+  info.serial = block[12] | (block[13] << 8) | (block[14] << 16) |
+                (uint32_t(block[15]) << 24);
+
+  /* Both zero or one of them an aspect ratio when the size is unknown */
+  if (block[21] != 0 && block[22] != 0) {
+    constexpr uint32_t kMmPerCm = 10;
+    info.width_mm = block[21] * kMmPerCm;
+    info.height_mm = block[22] * kMmPerCm;
+  }
+
+  for (size_t i = 0; i < kEdidDescriptorCount; i++)
+    ParseDescriptor(&block[kEdidDescriptorOffset + i * kEdidDescriptorSize],
+                    info);
+}
+
+/* payload starts after the extended tag code */
+static EdidHdrStaticMetadata ParseHdrStaticMetadata(const uint8_t *payload,
+                                                    size_t len) {
+  EdidHdrStaticMetadata hdr;
+  if (len >= 1) {
+    hdr.sdr = (payload[0] & (1 << 0)) != 0;
+    hdr.hdr10 = (payload[0] & (1 << 2)) != 0;
+    hdr.hlg = (payload[0] & (1 << 3)) != 0;
+  }
+  if (len >= 3)
+    hdr.max_luminance = MaxLuminance(payload[2]);
+  if (len >= 4)
+    hdr.max_average_luminance = MaxLuminance(payload[3]);
+  if (len >= 5)
+    hdr.min_luminance = MinLuminance(payload[4], hdr.max_luminance);
+  return hdr;
+}
+
+static void ParseVendorBlock(const uint8_t *payload, size_t len,
+                             EdidInfo &info) {
+  if (len < 3)
+    return;
+
+  uint32_t oui = payload[0] | (payload[1] << 8) | (payload[2] << 16);
+  if (oui == kHdmiOui && len >= 8) {
+    info.content_types.graphics = (payload[7] & (1 << 0)) != 0;
+    info.content_types.photo = (payload[7] & (1 << 1)) != 0;
+    info.content_types.cinema = (payload[7] & (1 << 2)) != 0;
+    info.content_types.game = (payload[7] & (1 << 3)) != 0;
+  } else if (oui == kHdmiForumOui) {
+    if (len >= 8)
+      info.allm = (payload[7] & (1 << 1)) != 0;
+    if (len >= 10 && (payload[8] & 0x3f) != 0) {
+      info.vrr = true;
+      info.min_v_refresh = payload[8] & 0x3f;
+      uint32_t vrr_max = ((payload[8] & 0xc0) << 2) | payload[9];
+      if (vrr_max != 0)
+        info.max_v_refresh = vrr_max;
+    }
+  }
+}
+
+static void ParseCtaDataBlocks(const uint8_t *data, size_t size,
+                               EdidInfo &info) {
+  size_t offset = 0;
+  while (offset < size) {
+    uint8_t tag = data[offset] >> 5;
+    size_t len = data[offset] & 0x1f;
+    const uint8_t *payload = &data[offset + 1];
+    offset += len + 1;
+    if (offset > size)
+      break;
+
+    if (tag == kCtaVendorTag) {
+      ParseVendorBlock(payload, len, info);
+    } else if (tag == kCtaExtendedTag && len >= 1) {
+      if (payload[0] == kCtaHdrStaticMetadataTag)
+        info.hdr = ParseHdrStaticMetadata(payload + 1, len - 1);
+      else if (payload[0] == kCtaColorimetryTag && len >= 3)
+        info.colorimetry = payload[1] | ((payload[2] & 0x80) << 8);
+    }
+  }
+}
+
+static void ParseCtaExtension(const uint8_t *block, EdidInfo &info) {
+  /* Data block collection lies between byte 4 and the DTD offset */
+  size_t end = block[2];
+  if (end < 4 || end > kEdidBlockSize)
+    end = 4;
+
+  ParseCtaDataBlocks(&block[4], end - 4, info);
+}
+
+static void ParseTiledDisplay(const uint8_t *payload, size_t len,
+                              EdidInfo &info) {
+  constexpr size_t kTiledBlockSize = 21;
+  if (len < kTiledBlockSize)
+    return;
+
+  const uint8_t *topo = &payload[1];
+  const uint8_t *size = &payload[4];
+  EdidTile tile;
+  tile.num_h_tiles = ((topo[0] >> 4) | ((topo[2] >> 2) & 0x30)) + 1;
+  tile.num_v_tiles = ((topo[0] & 0x0f) | (topo[2] & 0x30)) + 1;
+  tile.h_location = (topo[1] >> 4) | (((topo[2] >> 2) & 0x03) << 4);
+  tile.v_location = (topo[1] & 0x0f) | ((topo[2] & 0x03) << 4);
+  tile.tile_width = (size[0] | (size[1] << 8)) + 1;
+  tile.tile_height = (size[2] | (size[3] << 8)) + 1;
+  std::copy_n(&payload[kTiledBlockSize - tile.group_id.size()],
+              tile.group_id.size(), tile.group_id.begin());
+  info.tile = tile;
+}
+
+static void ParseDisplayIdExtension(const uint8_t *block, EdidInfo &info) {
+  /* Section header: version, payload size, product type, extension count.
+   * The last byte of the block is the extension checksum. */
+  constexpr size_t kSectionHeaderSize = 4;
+  constexpr size_t kBlockHeaderSize = 3;
+  const uint8_t *section = &block[1];
+  size_t size = std::min<size_t>(section[1],
+                                 kEdidBlockSize - 2 - kSectionHeaderSize);
+  const uint8_t *data = &section[kSectionHeaderSize];
+
+  size_t offset = 0;
+  while (offset + kBlockHeaderSize <= size) {
+    uint8_t tag = data[offset];
+    size_t len = data[offset + 2];
+    const uint8_t *payload = &data[offset + kBlockHeaderSize];
+    offset += kBlockHeaderSize + len;
+    if (offset > size)
+      break;
+
+    switch (tag) {
+      case kDisplayIdParameters:
+        /* Image size in 0.1 mm units */
+        if (len >= 4 && info.width_mm == 0) {
+          info.width_mm = (payload[0] | (payload[1] << 8)) / 10;
+          info.height_mm = (payload[2] | (payload[3] << 8)) / 10;
+        }
+        break;
+      case kDisplayIdTiledDisplay:
+      case kDisplayId2TiledDisplay:
+        ParseTiledDisplay(payload, len, info);
+        break;
+      case kDisplayIdCta:
+        ParseCtaDataBlocks(payload, len, info);
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+auto ParseEdid(const uint8_t *data, size_t size) -> EdidInfo {
+  constexpr std::array<uint8_t, 8> kHeader = {0x00, 0xff, 0xff, 0xff,
+                                              0xff, 0xff, 0xff, 0x00};
+  EdidInfo info;
+  if (data == nullptr || size < kEdidBlockSize ||
+      !std::equal(kHeader.begin(), kHeader.end(), data))
+    return info;
+
+  ParseBaseBlock(data, info);
+
+  size_t blocks = size / kEdidBlockSize;
+  size_t extensions = data[kEdidExtensionCountOffset];
+  for (size_t i = 1; i <= extensions && i < blocks; i++) {
+    const uint8_t *block = &data[i * kEdidBlockSize];
+    if (block[0] == kCtaExtensionTag)
+      ParseCtaExtension(block, info);
+    else if (block[0] == kDisplayIdExtensionTag)
+      ParseDisplayIdExtension(block, info);
+  }
+
+  return info;
+}
+
+}  // namespace android
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_EDID_PARSER_H_
+#define ANDROID_EDID_PARSER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <optional>
+#include <string>
+
+namespace android {
+
+/* HDR static metadata data block of a CTA-861 extension */
+struct EdidHdrStaticMetadata {
+  /* Supported EOTFs */
+  bool sdr = false;
+  bool hdr10 = false; /* SMPTE ST 2084 */
+  bool hlg = false;   /* ITU-R BT.2100 HLG */
+
+  /* Desired content luminance in cd/m2, 0 when not given by the sink */
+  float max_luminance = 0.0F;
+  float max_average_luminance = 0.0F;
+  float min_luminance = 0.0F;
+};
+
+/* First detailed timing descriptor, the sink's preferred mode */
+struct EdidTiming {
+  uint32_t clock_khz = 0;
+  uint32_t hdisplay = 0;
+  uint32_t vdisplay = 0;
+  uint32_t htotal = 0;
+  uint32_t vtotal = 0;
+  bool interlaced = false;
+
+  float v_refresh() const {
+    return htotal && vtotal ? float(clock_khz) * 1000.0F /
+                                  (float(htotal) * float(vtotal))
+                            : 0.0F;
+  }
+};
+
+/* DisplayID tiled display topology, tile locations are zero-based */
+struct EdidTile {
+  uint32_t num_h_tiles = 0;
+  uint32_t num_v_tiles = 0;
+  uint32_t h_location = 0;
+  uint32_t v_location = 0;
+  uint32_t tile_width = 0;
+  uint32_t tile_height = 0;
+  /* Vendor, product and serial shared by all tiles of the display */
+  std::array<uint8_t, 8> group_id{};
+};
+
+/* Colorimetry data block flags */
+enum EdidColorimetry : uint16_t {
+  kEdidColorimetryXvYcc601 = 1 << 0,
+  kEdidColorimetryXvYcc709 = 1 << 1,
+  kEdidColorimetrySYcc601 = 1 << 2,
+  kEdidColorimetryOpYcc601 = 1 << 3,
+  kEdidColorimetryOpRgb = 1 << 4,
+  kEdidColorimetryBt2020CYcc = 1 << 5,
+  kEdidColorimetryBt2020Ycc = 1 << 6,
+  kEdidColorimetryBt2020Rgb = 1 << 7,
+  kEdidColorimetryDciP3 = 1 << 15,
+};
+
+/* HDMI content types (CNC bits of the HDMI vendor specific data block) */
+struct EdidContentTypes {
+  bool graphics = false;
+  bool photo = false;
+  bool cinema = false;
+  bool game = false;
+};
+
+struct EdidInfo {
+  /* Base block header and checksum are correct */
+  bool valid = false;
+
+  /* PNP id, e.g. "GSM" */
+  std::string manufacturer;
+  uint16_t product_code = 0;
+  uint32_t serial = 0;
+  std::string name;
+
+  /* Physical size in mm, 0 if unknown */
+  uint32_t width_mm = 0;
+  uint32_t height_mm = 0;
+
+  std::optional<EdidTiming> preferred_timing;
+
+  /* Vertical refresh range in Hz from the range limits descriptor or the
+   * HDMI Forum VRR range, 0 if not reported */
+  uint32_t min_v_refresh = 0;
+  uint32_t max_v_refresh = 0;
+  bool vrr = false;
+
+  bool allm = false;
+  EdidContentTypes content_types;
+  uint16_t colorimetry = 0;
+  std::optional<EdidHdrStaticMetadata> hdr;
+  std::optional<EdidTile> tile;
+};
+
+/* Never reads past size, malformed blocks are skipped */
+auto ParseEdid(const uint8_t *data, size_t size) -> EdidInfo;
+
+}  // namespace android
+
+#endif  // ANDROID_EDID_PARSER_H_
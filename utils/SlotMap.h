@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_SLOT_MAP_H_
+#define ANDROID_SLOT_MAP_H_
+
+#include <stdint.h>
+
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace android {
+
+/*
+ * Contiguous storage with stable 64-bit handles. A handle packs the slot
+ * index with the slot's generation, so handles of erased elements are never
+ * resolved to a newer element reusing the slot.
+ *
+ * Element addresses are only stable until the next Emplace().
+ */
+template <typename T>
+class SlotMap {
+ public:
+  using Handle = uint64_t;
+
+  class Iterator {
+   public:
+    Iterator(SlotMap *map, size_t index) : map_(map), index_(index) {
+      SkipFree();
+    }
+
+    auto operator*() const -> std::pair<Handle, T &> {
+      Slot &slot = map_->slots_[index_];
+      return {MakeHandle(index_, slot.generation), *slot.value};
+    }
+
+    auto operator++() -> Iterator & {
+      index_++;
+      SkipFree();
+      return *this;
+    }
+
+    auto operator!=(const Iterator &other) const -> bool {
+      return index_ != other.index_;
+    }
+
+   private:
+    void SkipFree() {
+      while (index_ < map_->slots_.size() && !map_->slots_[index_].value)
+        index_++;
+    }
+
+    SlotMap *map_;
+    size_t index_;
+  };
+
+  template <typename... Args>
+  auto Emplace(Args &&...args) -> Handle {
+    size_t index = 0;
+    if (free_.empty()) {
+      index = slots_.size();
+      slots_.emplace_back();
+    } else {
+      index = free_.back();
+      free_.pop_back();
+    }
+
+    Slot &slot = slots_[index];
+    slot.value.emplace(std::forward<Args>(args)...);
+    size_++;
+    return MakeHandle(index, slot.generation);
+  }
+
+  auto Erase(Handle handle) -> bool {
+    Slot *slot = Find(handle);
+    if (slot == nullptr)
+      return false;
+
+    slot->value.reset();
+    slot->generation++;
+    free_.push_back(static_cast<uint32_t>(handle & kIndexMask));
+    size_--;
+    return true;
+  }
+
+  auto Get(Handle handle) -> T * {
+    Slot *slot = Find(handle);
+    return slot != nullptr ? &*slot->value : nullptr;
+  }
+
+  auto size() const -> size_t {
+    return size_;
+  }
+
+  auto begin() -> Iterator {
+    return Iterator(this, 0);
+  }
+
+  auto end() -> Iterator {
+    return Iterator(this, slots_.size());
+  }
+
+ private:
+  static constexpr Handle kIndexMask = 0xffffffff;
+  static constexpr int kGenerationShift = 32;
+
+  struct Slot {
+    std::optional<T> value;
+    /* Starts at 1 so that 0 is never a valid handle */
+    uint32_t generation = 1;
+  };
+
+  static auto MakeHandle(size_t index, uint32_t generation) -> Handle {
+    return (Handle(generation) << kGenerationShift) | index;
+  }
+
+  auto Find(Handle handle) -> Slot * {
+    size_t index = handle & kIndexMask;
+    if (index >= slots_.size())
+      return nullptr;
+
+    Slot &slot = slots_[index];
+    if (!slot.value || slot.generation != handle >> kGenerationShift)
+      return nullptr;
+
+    return &slot;
+  }
+
+  std::vector<Slot> slots_;
+  std::vector<uint32_t> free_;
+  size_t size_ = 0;
+};
+
+}  // namespace android
+
+#endif  // ANDROID_SLOT_MAP_H_
@@ -22,6 +22,7 @@
 #include <ui/GraphicBufferMapper.h>
 
 #include "bufferinfo/BufferInfoGetter.h"
+#include "bufferinfo/SidebandStreamProvider.h"
 #include "drm/DrmFbImporter.h"
 #include "drmhwcomposer.h"
 
@@ -29,17 +30,27 @@
 
 namespace android {
 
-int DrmHwcLayer::ImportBuffer(DrmDevice *drmDevice) {
+int DrmHwcLayer::ImportBuffer(DrmDevice *drmDevice, bool test_only) {
   buffer_info = hwc_drm_bo_t{};
 
-  int ret = BufferInfoGetter::GetInstance()->ConvertBoInfo(sf_handle,
-                                                           &buffer_info);
+  int ret = 0;
+  if (sideband_stream != nullptr) {
+    ret = SidebandStreamProvider::GetInstance()->GetFrame(sideband_stream,
+                                                          &buffer_info,
+                                                          &acquire_fence);
+    if (ret == -EAGAIN)
+      return ret;
+  } else {
+    ret = BufferInfoGetter::GetInstance()->ConvertBoInfo(sf_handle,
+                                                         &buffer_info);
+  }
   if (ret) {
     ALOGE("Failed to convert buffer info %d", ret);
     return ret;
   }
 
-  FbIdHandle = drmDevice->GetDrmFbImporter().GetOrCreateFbId(&buffer_info);
+  FbIdHandle = drmDevice->GetDrmFbImporter().GetOrCreateFbId(
+      &buffer_info, acquire_fence.Get(), test_only);
   if (!FbIdHandle) {
     ALOGE("Failed to import buffer");
     return -EINVAL;